@@ -57,6 +57,9 @@ try:
                     "code": 404
                 }
 
+    print(f"Status: {response.get('code', 200)}")
+    print("Content-Type: application/json")
+    print()
     print(json.dumps(response, indent=2))
 
 except Exception as e:
@@ -65,4 +68,7 @@ except Exception as e:
         "message": str(e),
         "code": 500
     }
+    print("Status: 500")
+    print("Content-Type: application/json")
+    print()
     print(json.dumps(error_response, indent=2))
\ No newline at end of file
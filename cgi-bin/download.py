@@ -0,0 +1,35 @@
+#!/usr/bin/env python3
+import os
+
+# USER TESTING: curl -O http://localhost:8080/cgi-bin/download.py/flames.jpeg
+# The script only decides whether the file may be downloaded, the server sends it (X-Sendfile,
+# relative to the location's sendfile_root) with sendfile(), Range and conditional GET support.
+
+filename = os.environ.get("PATH_INFO", "").lstrip("/") or os.environ.get("QUERY_STRING", "")
+
+
+def find_upload(name):
+    """Path relative to www/uploads: flat, or in the shard subdirectories of shard_depth (ab/cd/<name>)"""
+    if os.path.isfile(os.path.join("www/uploads", name)):
+        return name
+    for root, dirs, names in os.walk("www/uploads"):
+        dirs[:] = [d for d in dirs if not d.startswith(".")]
+        if name in names:
+            return os.path.relpath(os.path.join(root, name), "www/uploads")
+    return None
+
+
+if not filename or "/" in filename or filename.startswith("."):
+    print("Status: 400 Bad Request")
+    print("Content-Type: text/plain")
+    print()
+    print("Usage: /cgi-bin/download.py/<file in www/uploads>")
+elif find_upload(filename) is None:
+    print("Status: 404 Not Found")
+    print("Content-Type: text/plain")
+    print()
+    print(f"No such file: {filename}")
+else:
+    print(f'Content-Disposition: attachment; filename="{filename}"')
+    print(f"X-Sendfile: {find_upload(filename)}")
+    print()
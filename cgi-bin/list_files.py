@@ -13,11 +13,13 @@ try:
     # List all files in the directory
     files = []
     if os.path.exists(uploads_dir) and os.path.isdir(uploads_dir):
-        for file in os.listdir(uploads_dir):
-            file_path = os.path.join(uploads_dir, file)
-            # Skip directories, index.html, and hidden files
-            if os.path.isfile(file_path) and file != "index.html" and not file.startswith('.'):
-                files.append(file)
+        # with shard_depth the files live in hash-named subdirectories (ab/cd/<name>), older ones flat
+        for root, dirs, names in os.walk(uploads_dir):
+            # Skip hidden directories (.cas), index.html, and hidden files
+            dirs[:] = [d for d in dirs if not d.startswith('.')]
+            for file in names:
+                if file != "index.html" and not file.startswith('.'):
+                    files.append(file)
     else:
         sys.stderr.write(f"Directory not found: {uploads_dir}\n")
     
@@ -0,0 +1,158 @@
+#!/usr/bin/env python3
+# Minimal FastCGI responder for locations with fastcgi_pass: keeps one Python interpreter warm and runs
+# the CGI scripts (cgi-bin/*.py) in it instead of starting a new one per request.
+#   python3 fastcgi_app.py [unix socket path, default /tmp/webserv-fcgi.sock]
+# Every connection gets a forked worker that serves its requests one after another (FCGI_KEEP_CONN).
+import io
+import os
+import runpy
+import signal
+import socket
+import struct
+import sys
+
+FCGI_BEGIN_REQUEST, FCGI_ABORT_REQUEST, FCGI_END_REQUEST = 1, 2, 3
+FCGI_PARAMS, FCGI_STDIN, FCGI_STDOUT, FCGI_STDERR = 4, 5, 6, 7
+FCGI_GET_VALUES, FCGI_GET_VALUES_RESULT, FCGI_UNKNOWN_TYPE = 9, 10, 11
+FCGI_KEEP_CONN = 1
+HEADER = struct.Struct("!BBHHBx")
+
+
+def read_exact(conn, length):
+    data = b""
+    while len(data) < length:
+        chunk = conn.recv(length - len(data))
+        if not chunk:
+            raise EOFError
+        data += chunk
+    return data
+
+
+def read_record(conn):
+    version, rtype, request_id, length, padding = HEADER.unpack(read_exact(conn, HEADER.size))
+    content = read_exact(conn, length + padding)[:length]
+    return rtype, request_id, content
+
+
+def write_record(conn, rtype, request_id, content=b""):
+    for start in range(0, max(len(content), 1), 65535):
+        chunk = content[start:start + 65535]
+        padding = -len(chunk) % 8
+        conn.sendall(HEADER.pack(1, rtype, request_id, len(chunk), padding) + chunk + b"\0" * padding)
+
+
+def decode_length(data, pos):
+    if data[pos] < 128:
+        return data[pos], pos + 1
+    return struct.unpack("!I", data[pos:pos + 4])[0] & 0x7fffffff, pos + 4
+
+
+def decode_params(data):
+    params, pos = {}, 0
+    while pos < len(data):
+        name_length, pos = decode_length(data, pos)
+        value_length, pos = decode_length(data, pos)
+        name = data[pos:pos + name_length].decode("latin-1")
+        pos += name_length
+        params[name] = data[pos:pos + value_length].decode("latin-1")
+        pos += value_length
+    return params
+
+
+def encode_params(params):
+    out = b""
+    for name, value in params.items():
+        out += bytes([len(name), len(value)]) + name.encode() + value.encode()
+    return out
+
+
+def run_script(params, body):
+    if not os.path.isfile(params.get("SCRIPT_FILENAME", "")):
+        return b"Status: 404 Not Found\r\nContent-Type: text/plain\r\n\r\nScript not found\n", b"", 1
+    stdout, stderr = io.BytesIO(), io.BytesIO()
+    saved = sys.stdin, sys.stdout, sys.stderr, dict(os.environ), os.getcwd()
+    sys.stdin = io.TextIOWrapper(io.BytesIO(body), encoding="utf-8")
+    sys.stdout = io.TextIOWrapper(stdout, encoding="utf-8", write_through=True)
+    sys.stderr = io.TextIOWrapper(stderr, encoding="utf-8", write_through=True)
+    os.environ.clear()
+    os.environ.update(params)
+    status = 0
+    try:
+        runpy.run_path(params["SCRIPT_FILENAME"], run_name="__main__")
+    except SystemExit as exit:
+        status = exit.code if isinstance(exit.code, int) else 1
+    except BaseException as error:
+        sys.stderr.write("%s: %s\n" % (type(error).__name__, error))
+        status = 1
+    finally:
+        sys.stdout.detach()
+        sys.stderr.detach()
+        sys.stdin, sys.stdout, sys.stderr = saved[0], saved[1], saved[2]
+        os.environ.clear()
+        os.environ.update(saved[3])
+        os.chdir(saved[4])
+    return stdout.getvalue(), stderr.getvalue(), status
+
+
+def serve(conn):
+    params, stdin, request_id, keep_conn = b"", b"", None, True
+    while keep_conn:
+        try:
+            rtype, rid, content = read_record(conn)
+        except EOFError:
+            return
+        if rid == 0:
+            if rtype == FCGI_GET_VALUES:
+                wanted = decode_params(content)
+                values = {"FCGI_MAX_CONNS": "1", "FCGI_MAX_REQS": "1", "FCGI_MPXS_CONNS": "0"}
+                write_record(conn, FCGI_GET_VALUES_RESULT, 0,
+                             encode_params({k: v for k, v in values.items() if k in wanted}))
+            else:
+                write_record(conn, FCGI_UNKNOWN_TYPE, 0, bytes([rtype]) + b"\0" * 7)
+            continue
+        if rtype == FCGI_BEGIN_REQUEST:
+            request_id, keep_conn = rid, bool(content[2] & FCGI_KEEP_CONN)
+            params, stdin = b"", b""
+        elif rid != request_id:
+            continue
+        elif rtype == FCGI_PARAMS:
+            params += content
+        elif rtype == FCGI_ABORT_REQUEST:
+            write_record(conn, FCGI_END_REQUEST, rid, struct.pack("!IB3x", 1, 0))
+            request_id = None
+        elif rtype == FCGI_STDIN and content:
+            stdin += content
+        elif rtype == FCGI_STDIN:
+            out, err, status = run_script(decode_params(params), stdin)
+            write_record(conn, FCGI_STDOUT, rid, out)
+            if out:
+                write_record(conn, FCGI_STDOUT, rid)
+            if err:
+                write_record(conn, FCGI_STDERR, rid, err)
+                write_record(conn, FCGI_STDERR, rid)
+            write_record(conn, FCGI_END_REQUEST, rid, struct.pack("!IB3x", status & 0xffffffff, 0))
+            request_id = None
+
+
+def main():
+    path = sys.argv[1] if len(sys.argv) > 1 else "/tmp/webserv-fcgi.sock"
+    if os.path.exists(path):
+        os.unlink(path)
+    listener = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    listener.bind(path)
+    listener.listen(64)
+    signal.signal(signal.SIGCHLD, signal.SIG_IGN)
+    while True:
+        conn, _ = listener.accept()
+        if os.fork() == 0:
+            listener.close()
+            try:
+                serve(conn)
+            except (BrokenPipeError, ConnectionResetError):
+                pass
+            os._exit(0)
+        conn.close()
+
+
+if __name__ == "__main__":
+    main()
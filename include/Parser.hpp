@@ -54,6 +54,9 @@ private:
     bool checkValidSquareBrackets(const std::string &line);
     bool checkMaxBodySize(const std::string &value);
     int checkForDuplicates(std::vector<Server> &servers_vector);
+    bool parseExpiresRule(const std::string &entry, Route &route);
+    bool parseHeaderLine(const std::string &entry, std::string &header);
+    bool parseDuration(const std::string &value, long &seconds);
 
 public:
     Parser();
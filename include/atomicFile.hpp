@@ -0,0 +1,60 @@
+#ifndef ATOMICFILE_HPP
+#define ATOMICFILE_HPP
+
+#include <string>
+#include <cstddef>
+
+#define ATOMIC_FILE_MODE 0644
+#define ATOMIC_TEMP_PREFIX ".upload-"
+
+// How much an upload has to survive before it is answered with 201
+enum FsyncPolicy
+{
+    FSYNC_NONE, // page cache only (previous behaviour)
+    FSYNC_DATA, // fdatasync the file contents
+    FSYNC_FULL  // fsync the file and its directory, the new name survives a power loss too
+};
+
+enum PublishResult
+{
+    PUBLISH_OK,
+    PUBLISH_EXISTS, // the final name was taken (-> 409), the new data is discarded
+    PUBLISH_ERROR
+};
+
+// A file that becomes visible under its final name only once it is complete.
+// Data goes into an unnamed O_TMPFILE in the target directory (or a hidden temp name where the
+// filesystem lacks O_TMPFILE) and publish() links it in with no-replace semantics, so readers
+// never see a partial upload and two uploads to the same name can't overwrite each other.
+// Anything not published is removed when the object goes away.
+class AtomicFile
+{
+public:
+    AtomicFile();
+    ~AtomicFile();
+
+    bool open(const std::string &final_path, FsyncPolicy policy);
+    bool write(const char *data, size_t length);
+    PublishResult publish();
+    void discard();
+    int fd() const;
+
+    static bool parseFsyncPolicy(const std::string &value, FsyncPolicy &policy);
+    static bool syncDirectoryOf(const std::string &path);
+
+private:
+    int file_fd;
+    std::string final_path;
+    std::string temp_path; // empty while the data lives in an O_TMPFILE
+    FsyncPolicy policy;
+
+    bool syncFile();
+    bool syncDirectory();
+    PublishResult linkTmpFile();
+    PublishResult renameTempFile();
+
+    AtomicFile(const AtomicFile &);
+    AtomicFile &operator=(const AtomicFile &);
+};
+
+#endif
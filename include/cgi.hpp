@@ -7,6 +7,8 @@
 #include <iostream>
 #include <sys/socket.h>
 #include <string.h>
+#include <strings.h>
+#include <cctype>
 #include <sstream>
 #include <cerrno>
 #include <cstdio>
@@ -19,14 +21,59 @@
 #include <map>
 #include <ctime>
 #include <fcntl.h>
+#include <sys/ioctl.h>
 #include <string>
+#include <vector>
+#include <deque>
+#include <set>
 
 // this is the path to the python interpreter, needs to be adjusted depening on the users system
-#define PYTHON_PATH "/usr/bin/python3";
+#define PYTHON_PATH "/usr/bin/python3"
 
 #define CGI_TIMEOUT 3
+#define CGI_INPUT_CHUNK 65536      // request body bytes written to the script's stdin per write()
+#define CGI_SPOOL_THRESHOLD 65536  // larger bodies wait for the script in an unlinked temp file, not in memory
+#define CGI_SPOOL_DIR "/tmp"
+#define CGI_READ_CHUNK 65536         // script output read per POLLIN
+#define CGI_MAX_HEADER_SIZE 8192     // output without a blank line by then is sent as a plain body
+#define CGI_STREAM_HIGH_WATER 262144 // unsent bytes that pause reading the script's output
+#define CGI_STREAM_LOW_WATER 65536   // ... and resume it
+#define CGI_MAX_PROCESSES 64         // scripts running at once over all locations, more wait in the queue
+#define CGI_RETRY_AFTER "2"          // seconds, sent with the 503 of a full or timed-out queue
 
 class HttpResponse;
+class GzipEncoder;
+
+// A CGI request waiting for a free slot (cgi_max_procs, CGI_MAX_PROCESSES). Its client fd is out of
+// the poll set until the script starts
+struct CGIQueuedRequest
+{
+    int client_fd;
+    Server *server;
+    HttpRequest request;
+    HttpResponse *response;
+    time_t deadline;
+    struct timespec queued;
+};
+
+// Header block at the start of CGI output (RFC 3875 6.2), read the same way from scripts and FastCGI
+struct CGIResponseHead
+{
+    int status;               // from Status, 0 if there was none, -1 if it was malformed
+    std::string location;
+    long long content_length; // -1 if there was none
+    std::string sendfile;     // X-Sendfile / X-Accel-Redirect: file the server sends instead of the body
+    std::vector<std::pair<std::string, std::string> > fields; // everything else, passed on to the client
+
+    CGIResponseHead() : status(0), content_length(-1) {}
+};
+
+enum CGIHeadState
+{
+    CGI_HEAD_INCOMPLETE, // no blank line yet
+    CGI_HEAD_COMPLETE,
+    CGI_HEAD_NONE        // output does not start with a header field: all of it is body
+};
 
 class CGI
 {
@@ -41,29 +88,73 @@ public:
     void sendResponse(const std::string &response) const;
     static void checkRunningProcesses(int pfds_fd);
     static void checkAllCGIProcesses();
-    static void checkCGIProcess(int pfds_fd);
+    static bool admit(int fd, Server &server, const HttpRequest &request, HttpResponse &response);
+    static void checkQueue();
+    static void checkCGIProcess(int pfds_fd, short revents);
     static std::string resolveCGIPath(const std::string &uri);
     static std::string extractPathInfo(const std::string &uri);
     static void printRunningProcesses();
+    static CGIHeadState findResponseHead(const std::string &output, size_t &header_end, size_t &body_start);
+    static void parseResponseHead(const std::string &block, CGIResponseHead &head);
+    static bool isLocalRedirect(const CGIResponseHead &head);
+    static bool sendsFile(const CGIResponseHead &head, const HttpResponse &response);
+    static void applyResponseHead(const CGIResponseHead &head, HttpResponse &response);
+    static void respond(int fd, Server &server, HttpResponse *response);
+    static void startRequest(int fd, Server &server, HttpRequest &request, HttpResponse *response);
+    static bool refresh(const HttpRequest &request);
 
     struct CGIProcess
     {
         time_t last_update_time;
         int output_pipe;
         int response_fd;
-        HttpRequest *request;
+        HttpRequest request;   // without its body, re-run for a local redirect
+        Server *server;
         HttpResponse *response;
         bool process_finished;
         bool finished_success;
         bool ready_to_send;
         int status;
+        int input_pipe;        // non-blocking write end of the script's stdin while body is left, else -1
+        std::string input;     // the body, unless it is spooled
+        int input_spool;       // unlinked temp file holding the body, or -1
+        off_t input_offset;
+        off_t input_size;
+        std::string output;    // script output while its header block is incomplete
+        bool headers_done;     // response head is built, further output is body
+        bool output_done;      // the script closed its stdout
+        bool client_http11;    // body can be framed with chunked encoding
+        bool chunked;
+        long long body_left;   // bytes still allowed by the script's Content-Length, -1 if it sent none
+        GzipEncoder *gzip;     // compresses the body as it streams, NULL if not
+        std::string stream;    // framed bytes the client socket has not taken yet
+        size_t stream_offset;
+        std::string local_redirect; // Location the script sent instead of a response
+        bool file_response;    // response is a file named by X-Sendfile, sent by the ResponseWriter
+        bool splice;           // body goes pipe -> socket with splice() (cgi_splice)
+        size_t splice_left;    // bytes of the current chunk still in the pipe
+        std::string cache_key; // cgi_cache GET: the copy served if the script fails (stale-if-error)
+        bool cache_fill;       // this run produces the key's next copy (CGICache), its body is kept
+        CGIResponseHead cache_head;
+        std::string cache_body;
 
-        CGIProcess() : last_update_time(0), output_pipe(-1), request(NULL), response(NULL), process_finished(false), finished_success(false), ready_to_send(false), status(0) {}
+        CGIProcess() : last_update_time(0), output_pipe(-1), server(NULL), response(NULL), process_finished(false), finished_success(false), ready_to_send(false), status(0),
+                       input_pipe(-1), input_spool(-1), input_offset(0), input_size(0), headers_done(false), output_done(false), client_http11(false),
+                       chunked(false), body_left(-1), gzip(NULL), stream_offset(0), file_response(false), splice(false), splice_left(0), cache_fill(false) {}
     };
 
     static std::map<pid_t, CGIProcess> running_processes;
+    static void processExited(pid_t pid, int status);
+    static void scriptStarted(pid_t placeholder, pid_t pid);
+    static void scriptFailed(pid_t placeholder);
 
 private:
+    static std::map<int, pid_t> fd_to_pid; // output pipe, input pipe and client fd of every running script
+    static std::map<const Route *, size_t> running_per_route;
+    static std::map<const Route *, size_t> queued_per_route;
+    static std::deque<CGIQueuedRequest *> queue; // FIFO over all locations, bounded per location by cgi_queue_max
+    static std::set<pid_t> unwanted;             // placeholders of pooled scripts to kill once their pid is known
+
     int clientSocket;
     std::string scriptPath;
     std::string method;
@@ -75,16 +166,35 @@ private:
     void sendCGIOutputToClient(int pipefd) const;
     void sendHttpResponseHeaders(const std::string &contentType) const;
     static std::string constructErrorResponse(int status_code, const std::string &message);
-    static void addProcess(pid_t pid, int output_pipe, int response_fd, HttpRequest &req, HttpResponse *response);
+    static void addProcess(pid_t pid, int output_pipe, int response_fd, HttpRequest &req, HttpResponse *response, Server *server);
     static void cleanupProcess(pid_t pid);
     static void readFromCGI(pid_t pid, CGIProcess &proc);
-    static void sendCGIResponse(CGIProcess &proc);
     std::string getStatusMessage(int status_code);
     pid_t runChildCGI(int pipe_in[2], int pipe_out[2], HttpRequest &request);
 
-    void postRequest(int pipe_in[2]);
-    static void readCGI(pid_t pid, CGIProcess &proc);
-    static void killCGI(pid_t pid, CGIProcess &proc);
+    void startInput(CGIProcess &proc, int pipe_write);
+    static int spoolBody(const std::string &body);
+    static void feedInput(CGIProcess &proc);
+    static void closeInput(CGIProcess &proc);
+    static void readCGI(CGIProcess &proc);
+    static bool parseOutputHeaders(CGIProcess &proc);
+    static void startResponse(CGIProcess &proc, const CGIResponseHead &head, bool has_body);
+    static void appendBody(CGIProcess &proc, const char *data, size_t length);
+    static void frameBody(CGIProcess &proc, const char *data, size_t length);
+    static void finishBody(CGIProcess &proc);
+    static bool writeStream(CGIProcess &proc);
+    static bool relayOutput(CGIProcess &proc);
+    static void closeOutput(CGIProcess &proc);
+    static void endCGI(std::map<pid_t, CGIProcess>::iterator it);
+    static void stopScript(pid_t pid);
+    static void redirectLocally(std::map<pid_t, CGIProcess>::iterator it);
+    static void sendFinalResponse(std::map<pid_t, CGIProcess>::iterator it);
+    static void releaseProcess(std::map<pid_t, CGIProcess>::iterator it);
+    static bool hasSlot(const Route &route);
+    static void startQueued();
+    static void runRequest(int fd, Server &server, HttpRequest &request, HttpResponse *response);
+    static void leaveQueue(CGIQueuedRequest *entry);
+    static void rejectRequest(int fd, Server &server, HttpResponse *response, int status);
 };
 
 #endif
\ No newline at end of file
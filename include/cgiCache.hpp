@@ -0,0 +1,60 @@
+#ifndef CGICACHE_HPP
+#define CGICACHE_HPP
+
+#include <string>
+#include <vector>
+#include <map>
+#include <ctime>
+#include "cgi.hpp"
+
+#define CGI_CACHE_MAX_ENTRIES 1024 // responses kept over all locations; when full, expired ones make room first
+#define CGI_CACHE_MAX_BODY 1048576 // larger responses are streamed as usual but not kept
+
+// A script response kept for later GETs: its parsed head and the whole body, unframed and uncompressed
+struct CGICacheEntry
+{
+    CGIResponseHead head;
+    std::string body;
+    time_t stored;
+    time_t fresh_until; // max-age, else cgi_cache_ttl
+    time_t stale_until; // stale-while-revalidate: served as is while one script refreshes it
+    time_t error_until; // stale-if-error: served instead of a failed or timed-out script's answer
+};
+
+// A client waiting for the response another script run is producing for the same key. Its fd is out
+// of the poll set until then
+struct CGICacheWaiter
+{
+    int client_fd;
+    Server *server;
+    HttpRequest request;
+    HttpResponse *response;
+};
+
+// Micro-cache for GETs on CGI locations with `cgi_cache`, keyed by Host, path and query string.
+// Only complete 200 responses without Set-Cookie, no-store, no-cache or private are kept, for the
+// script's max-age / s-maxage or cgi_cache_ttl; its stale-while-revalidate and stale-if-error (or
+// cgi_cache_stale) set how long a copy may outlive that. A hit never forks. Concurrent misses share one
+// script run (a "fill"): the first request streams it, the others wait and get the stored copy
+class CGICache
+{
+public:
+    static bool applies(const HttpRequest &request);
+    static std::string keyFor(const HttpRequest &request);
+    static bool handle(int fd, Server &server, const HttpRequest &request, HttpResponse &response);
+    static bool claimFill(const std::string &key);
+    static bool storable(const CGIResponseHead &head);
+    static void store(const std::string &key, const Route &route, const CGIResponseHead &head, const std::string &body);
+    static void abandon(const std::string &key, int status);
+    static bool serveOnError(const std::string &key, HttpResponse &response);
+
+private:
+    static void applyEntry(const CGICacheEntry &entry, HttpResponse &response, const char *state);
+    static void purge(time_t now);
+    static long directive(const std::string &cache_control, const std::string &name);
+
+    static std::map<std::string, CGICacheEntry> entries;
+    static std::map<std::string, std::vector<CGICacheWaiter> > fills; // key -> clients waiting for its running script
+};
+
+#endif
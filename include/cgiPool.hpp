@@ -0,0 +1,81 @@
+#ifndef CGIPOOL_HPP
+#define CGIPOOL_HPP
+
+#include <string>
+#include <vector>
+#include <map>
+#include <ctime>
+#include <sys/types.h>
+
+#define CGI_POOL_DEFAULT_MAX_REQUESTS 1000 // scripts a worker starts before it is replaced (cgi_pool_max_requests)
+#define CGI_POOL_DEFAULT_IDLE_TIMEOUT 60   // seconds before workers above cgi_pool_min are reaped (cgi_pool_idle_timeout)
+#define CGI_POOL_MAX_WORKERS 256
+#define CGI_POOL_HANDSHAKE_TIMEOUT 2       // seconds an idle worker has to answer a request with the script's pid
+#define CGI_POOL_PENDING_BASE 0x40000000   // placeholder pids until then, above any real one (PID_MAX_LIMIT is 2^22)
+#define CGI_POOL_MESSAGE_MAX 65536         // script path and environment of one request
+
+struct Route;
+class Server;
+
+enum CGIWorkerState
+{
+    CGI_WORKER_STARTING, // exec'd, still importing
+    CGI_WORKER_IDLE,
+    CGI_WORKER_HANDSHAKE, // request sent, its "P<pid>" not read yet
+    CGI_WORKER_BUSY      // a script it forked is running
+};
+
+struct CGIWorkerPool;
+
+// One pre-started interpreter, talking to the server over a SOCK_SEQPACKET socketpair:
+//   server -> worker  "script\0NAME=value\0..." + SCM_RIGHTS [stdin read end, stdout write end]
+//   worker -> server  "R" once ready, "P<pid>" after forking the script, "X<wait status>" when it exited
+struct CGIWorker
+{
+    int fd;
+    pid_t pid;
+    CGIWorkerState state;
+    unsigned long served;
+    pid_t script;          // while busy: the script it forked
+    pid_t pending;         // during the handshake: the placeholder pid the request is tracked under
+    time_t handshake_deadline;
+    time_t idle_since;
+    CGIWorkerPool *pool;
+};
+
+struct CGIWorkerPool
+{
+    const Route *route;
+    std::vector<CGIWorker *> workers;
+};
+
+// Warm interpreter pool for CGI locations with `cgi_pool_max`: every worker has python3 started and the
+// usual modules imported, and runs each script in a fork of itself, so a request costs a fork instead
+// of exec + interpreter startup + imports. The script's pipes are the ones CGI::runChildCGI made, so
+// output, timeouts and kill() work as for fork+exec. Without an idle worker the request falls back
+// to fork+exec and the pool grows in the background, up to cgi_pool_max
+class CGIPool
+{
+public:
+    static void start(std::vector<Server> &servers);
+    static void stop();
+    static pid_t run(const Route &route, const std::string &script, char **env, int stdin_fd, int stdout_fd);
+    static bool ownsFd(int fd);
+    static void handleEvent(int fd);
+    static void maintain();
+
+private:
+    static std::map<const Route *, CGIWorkerPool *> pools;
+    static std::map<int, CGIWorker *> workers; // by control socket
+    static time_t last_maintenance;
+    static pid_t next_placeholder;
+
+    static size_t minimumWorkers(const Route &route);
+    static CGIWorkerPool *poolFor(const Route &route);
+    static CGIWorker *spawn(CGIWorkerPool *pool);
+    static void retire(CGIWorker *worker);
+    static void checkHandshakes(time_t now);
+    static bool sendRequest(CGIWorker *worker, const std::string &message, int stdin_fd, int stdout_fd);
+};
+
+#endif
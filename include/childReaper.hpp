@@ -0,0 +1,40 @@
+#ifndef CHILDREAPER_HPP
+#define CHILDREAPER_HPP
+
+#include <map>
+#include <ctime>
+#include <sys/types.h>
+#include <sys/syscall.h>
+
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434 // Linux 5.3, older headers don't name it
+#endif
+
+// Collects the server's children (scripts started with fork+exec, CGI pool workers) from the event loop.
+// Each child gets a pidfd in the poll set that turns readable when it exits, and the loop then reaps it
+// with waitpid(WNOHANG), so reaping never blocks and the exit status is never lost to SIG_IGN.
+// Kernels without pidfd_open get one signalfd for SIGCHLD instead, drained with waitpid(-1, WNOHANG).
+// Exit statuses go to CGI::processExited
+class ChildReaper
+{
+public:
+    static void start();
+    static void stop();
+    static void watch(pid_t pid);
+    static bool ownsFd(int fd);
+    static void handleEvent(int fd);
+    static void maintain();
+    static void prepareChild();
+
+private:
+    static void reapAll();
+    static void reaped(pid_t pid, int status);
+    static void unwatch(pid_t pid);
+
+    static std::map<int, pid_t> pidfds;   // pidfd -> child
+    static std::map<pid_t, int> children; // child -> its pidfd, -1 when the signalfd or the sweep reaps it
+    static int signal_fd;                 // SIGCHLD signalfd, -1 while pidfds are used
+    static time_t last_sweep;
+};
+
+#endif
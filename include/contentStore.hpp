@@ -0,0 +1,28 @@
+#ifndef CONTENTSTORE_HPP
+#define CONTENTSTORE_HPP
+
+#include <string>
+#include "atomicFile.hpp"
+
+#define CAS_DIR_NAME ".cas"                    // object store inside the location's directory, hidden from listings
+#define CAS_XATTR "user.webserv.sha256"        // digest kept on the inode, so any name leads back to its object
+#define CAS_HASH_CHUNK 65536
+
+// Content-addressed upload storage (`dedup = true` per location).
+// Each distinct body is stored once as <dir>/.cas/<2 hex>/<sha256>; the user-visible names are
+// hard links to that object, so an identical re-upload costs a hash and a link(), no data write.
+// Objects are never modified in place. The last name going away takes the object with it
+class ContentStore
+{
+public:
+    static PublishResult store(const std::string &store_dir, const std::string &final_path, const std::string &body, FsyncPolicy policy);
+    static void release(const std::string &store_dir, const std::string &path);
+
+private:
+    static std::string objectPath(const std::string &store_dir, const std::string &digest);
+    static bool ensureDirectory(const std::string &path);
+    static PublishResult writeObject(const std::string &object, const std::string &digest, const std::string &body, FsyncPolicy policy);
+    static void recordUpload(size_t bytes, bool stored);
+};
+
+#endif
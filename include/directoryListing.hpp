@@ -0,0 +1,71 @@
+#ifndef DIRECTORYLISTING_HPP
+#define DIRECTORYLISTING_HPP
+
+#include <string>
+#include <vector>
+#include <map>
+#include <ctime>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "httpRequest.hpp"
+#include "httpResponse.hpp"
+#include "scopedLock.hpp"
+
+#define DIR_CACHE_MAX_DIRS 64          // directories kept in the listing cache (least recently used is evicted)
+#define DIR_LISTING_DEFAULT_LIMIT 1000 // entries per page if the client does not ask for ?limit=
+#define DIR_LISTING_MAX_LIMIT 10000
+#define GETDENTS_BUFFER_SIZE 65536
+
+struct DirectoryEntry
+{
+    std::string name;
+    bool is_directory;
+    off_t size;
+    time_t mtime;
+};
+
+// Autoindex pages. Directory contents are read once with getdents64 + fstatat and cached per
+// directory; a cached snapshot is thrown away when the directory's mtime changes or inotify
+// reports a change inside it. Each request only sorts/slices the snapshot and renders one page
+// (?offset=&limit=&sort=name|size|mtime&order=asc|desc) as HTML, or as JSON for Accept: application/json
+class DirectoryListing
+{
+public:
+    static bool render(const HttpRequest &request, HttpResponse &response);
+
+private:
+    struct CachedDirectory
+    {
+        dev_t device;
+        ino_t inode;
+        struct timespec mtime;
+        int watch;          // inotify watch descriptor, -1 if none
+        bool stale;         // set by inotify events
+        unsigned long last_used;
+        std::vector<DirectoryEntry> entries; // sorted by name
+    };
+
+    static pthread_mutex_t mutex;
+    static std::map<std::string, CachedDirectory> cache;
+    static std::map<int, std::string> watch_to_path;
+    static int inotify_fd;
+    static unsigned long use_counter;
+
+    static const std::vector<DirectoryEntry> *getEntries(const std::string &path);
+    static bool readEntries(const std::string &path, std::vector<DirectoryEntry> &entries);
+    static void processInotifyEvents();
+    static void addWatch(const std::string &path, CachedDirectory &cached);
+    static void evictLeastRecentlyUsed();
+
+    static std::string queryParam(const std::string &query, const std::string &name);
+    static bool wantsJson(const HttpRequest &request);
+    static std::string htmlEscape(const std::string &text);
+    static std::string jsonEscape(const std::string &text);
+    static std::string pageLink(const std::string &uri, const std::string &sort, const std::string &order, size_t offset, size_t limit);
+    static std::string renderHtml(const HttpRequest &request, const std::vector<const DirectoryEntry *> &page,
+                                  size_t offset, size_t limit, size_t total, const std::string &sort, const std::string &order);
+    static std::string renderJson(const HttpRequest &request, const std::vector<const DirectoryEntry *> &page,
+                                  size_t offset, size_t limit, size_t total);
+};
+
+#endif
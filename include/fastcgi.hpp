@@ -0,0 +1,117 @@
+#ifndef FASTCGI_HPP
+#define FASTCGI_HPP
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <ctime>
+#include <sys/socket.h>
+
+#define FASTCGI_DEFAULT_MAX_CONNS 4 // persistent connections per backend (fastcgi_max_conns)
+#define FASTCGI_DEFAULT_TIMEOUT 30  // seconds from accepting a request to its last record (fastcgi_timeout)
+#define FASTCGI_IDLE_TIMEOUT 60     // unused connections are closed after this many seconds
+#define FASTCGI_QUEUE_MAX 64        // requests per backend waiting for a connection, more -> 503
+#define FASTCGI_READ_SIZE 65536
+#define FASTCGI_HEADER_LEN 8
+#define FASTCGI_MAX_CONTENT 65535   // content bytes of one record
+#define FASTCGI_REQUEST_ID 1        // one request per connection at a time, see FastCGIConnection
+
+class Server;
+class HttpRequest;
+class HttpResponse;
+
+enum FastCGIRecordType
+{
+    FCGI_BEGIN_REQUEST = 1,
+    FCGI_ABORT_REQUEST = 2,
+    FCGI_END_REQUEST = 3,
+    FCGI_PARAMS = 4,
+    FCGI_STDIN = 5,
+    FCGI_STDOUT = 6,
+    FCGI_STDERR = 7
+};
+
+struct FastCGIBackend;
+
+// A client request from the moment it is accepted until its response is handed to the client socket
+struct FastCGIRequest
+{
+    int client_fd;
+    Server *server;
+    HttpResponse *response;
+    HttpRequest *client_request; // copy without the body, re-run for a local redirect
+    FastCGIBackend *backend;
+    std::string records; // BEGIN_REQUEST, PARAMS and STDIN, encoded up front; kept until END_REQUEST for a retry
+    std::string output;  // FCGI_STDOUT so far
+    time_t deadline;
+    struct timespec started;
+};
+
+// One socket to a backend. It carries one request at a time and is reused for the next
+// (FCGI_KEEP_CONN): backends that multiplex requests on a connection are rare, parallelism comes
+// from the pool. Records are still matched by request id
+struct FastCGIConnection
+{
+    int fd;
+    FastCGIBackend *backend;
+    bool connecting;        // non-blocking connect() in progress
+    FastCGIRequest *active; // NULL while idle
+    std::string out;
+    size_t out_offset;
+    std::string in;
+    unsigned long served; // requests answered, a reused connection may have been closed by the backend
+    time_t idle_since;
+};
+
+// A configured "unix:/path" or "ip:port", shared by all locations naming the same address
+struct FastCGIBackend
+{
+    std::string address;
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    size_t max_conns;
+    std::vector<FastCGIConnection *> connections;
+    std::deque<FastCGIRequest *> waiting; // bounded by FASTCGI_QUEUE_MAX (backpressure towards clients)
+};
+
+// FastCGI client for locations with `fastcgi_pass`: instead of forking an interpreter per request,
+// requests go to long-lived application processes over pooled persistent connections. Everything
+// runs on the event loop: backend sockets are non-blocking pollfds, a request waits for a free
+// connection in its backend's queue, and checkTimeouts() answers 504 for backends that stall.
+// While a request is out the client fd is not polled; the finished response is queued like any other
+class FastCGI
+{
+public:
+    static void handleRequest(int fd, Server &server, const HttpRequest &request, HttpResponse &response);
+    static bool ownsFd(int fd);
+    static void handleEvent(int fd, short revents);
+    static void checkTimeouts();
+    static bool parseAddress(const std::string &address, struct sockaddr_storage &addr, socklen_t &addr_len);
+
+private:
+    static std::map<std::string, FastCGIBackend *> backends;
+    static std::map<int, FastCGIConnection *> connections; // by socket fd
+    static size_t next_backend;
+
+    static FastCGIBackend *selectBackend(const std::vector<std::string> &addresses, size_t max_conns);
+    static void dispatch(FastCGIRequest *request);
+    static FastCGIConnection *openConnection(FastCGIBackend *backend);
+    static void assign(FastCGIConnection *connection, FastCGIRequest *request);
+    static bool flush(FastCGIConnection *connection);
+    static void readRecords(FastCGIConnection *connection);
+    static bool processRecords(FastCGIConnection *connection);
+    static void failConnection(FastCGIConnection *connection);
+    static void pump(FastCGIBackend *backend);
+    static void dropConnection(FastCGIConnection *connection);
+    static void finish(FastCGIRequest *request, int status);
+    static void applyOutput(const std::string &output, const HttpRequest &client_request, HttpResponse &response,
+                            std::string &local_redirect);
+
+    static std::string encodeRequest(const Server &server, const HttpRequest &request, const std::string &script,
+                                     const std::string &path_info);
+    static void appendRecord(std::string &out, FastCGIRecordType type, const char *data, size_t length);
+    static void appendParam(std::string &params, const std::string &name, const std::string &value);
+};
+
+#endif
@@ -0,0 +1,52 @@
+#ifndef FILEIOPOOL_HPP
+#define FILEIOPOOL_HPP
+
+#include <deque>
+#include <vector>
+#include <ctime>
+#include <pthread.h>
+#include "httpRequest.hpp"
+#include "httpResponse.hpp"
+#include "server.hpp"
+
+#define FILEIO_WORKERS 4     // threads doing blocking filesystem work (static files, uploads, deletes, listings)
+#define FILEIO_QUEUE_MAX 256 // jobs waiting for a worker; beyond that requests are handled on the loop again
+
+// A non-CGI request handed to a worker: processRequest runs there, the loop only sends the result
+struct FileIOJob
+{
+    int fd;
+    Server *server;
+    HttpRequest request;
+    HttpResponse *response;
+    struct timespec submitted;
+    struct timespec started;
+};
+
+// Bounded worker pool for blocking disk I/O. The loop submits jobs, workers post finished jobs to
+// a completion list and signal an eventfd that sits in the poll set, the loop then collects them
+// with takeCompleted(). Queue depth and queue-wait / service / total latency go to Metrics
+class FileIOPool
+{
+public:
+    static bool start(size_t workers);
+    static void stop();
+    static bool submit(int fd, Server *server, const HttpRequest &request, HttpResponse *response);
+    static void takeCompleted(std::vector<FileIOJob *> &jobs);
+    static void finish(FileIOJob *job);
+    static int notifyFd();
+
+private:
+    static void *workerMain(void *arg);
+    static double secondsSince(const struct timespec &start);
+
+    static pthread_mutex_t mutex;
+    static pthread_cond_t work_available;
+    static std::vector<pthread_t> threads;
+    static std::deque<FileIOJob *> queue;
+    static std::vector<FileIOJob *> completed;
+    static int event_fd;
+    static bool stopping;
+};
+
+#endif
@@ -0,0 +1,43 @@
+#ifndef GZIPENCODER_HPP
+#define GZIPENCODER_HPP
+
+#include <string>
+#include <cstddef>
+#include <zlib.h>
+
+#define GZIP_DEFAULT_LEVEL 6
+#define GZIP_DEFAULT_MIN_LENGTH 256
+#define GZIP_DEFAULT_MAX_MEMORY 262144 // zlib's own default: 128K window + 128K hash tables
+#define GZIP_CHUNK_SIZE 16384
+
+// Streaming gzip (deflate with gzip wrapper) compressor.
+// One encoder per response, so its zlib state is the per-connection memory cost.
+// Input can be fed in pieces (e.g. CGI output as it arrives); finish() writes the trailer.
+class GzipEncoder
+{
+public:
+    GzipEncoder();
+    ~GzipEncoder();
+
+    bool init(int level, size_t max_memory);
+    bool update(const char *data, size_t length, std::string &out, bool flush);
+    bool finish(std::string &out);
+    size_t bytesIn() const;
+    size_t bytesOut() const;
+
+    // one-shot compression of a complete body
+    static bool compress(const std::string &in, std::string &out, int level, size_t max_memory);
+
+private:
+    z_stream stream;
+    bool initialized;
+    bool finished;
+
+    bool deflateInto(const char *data, size_t length, int flush_mode, std::string &out);
+    static void chooseMemoryParameters(size_t max_memory, int &window_bits, int &mem_level);
+
+    GzipEncoder(const GzipEncoder &);
+    GzipEncoder &operator=(const GzipEncoder &);
+};
+
+#endif
@@ -52,6 +52,7 @@ public:
   int error_code;
   std::string queryString;
   std::string contentType;
+  int internal_redirects; // local redirects (CGI Location: /path) that led to this request
 
   // for parsing
   size_t position;
@@ -7,14 +7,33 @@
 #include <sstream>
 #include <string>
 #include <vector>
+#include <sys/types.h>
+#include "server.hpp"
+
+// Part of the body that is not held in `body`: inline bytes (e.g. multipart part headers)
+// followed by a byte range of body_fd that is sent zero-copy from the file
+struct BodySegment
+{
+    std::string data;
+    off_t offset;
+    size_t length;
+
+    BodySegment() : offset(0), length(0) {}
+    BodySegment(const std::string &data, off_t offset, size_t length) : data(data), offset(offset), length(length) {}
+};
 
 // Core data structure for outgoing responses
 class HttpResponse {
     public:
         HttpResponse();
+        ~HttpResponse();
         
         void setHeader(const std::string &header_name, const std::string &header_value);
-        std::string generateRawResponseStr();
+        std::string generateHeaderBlock() const;
+        static const char *reasonPhrase(int code);
+        static const char *statusLine(int code);
+        size_t bodyLength() const;
+        void closeBodyFile();
         int fd;                                     // FD to send the response
         std::string version;                        // e.g., HTTP/1.1
         int status_code;                            // e.g., 200, 404
@@ -25,6 +44,17 @@ class HttpResponse {
         bool close_connection; 
         bool complete;                     // true if Connection: close header is set
         bool is_cgi_response;              // used as trigger to differentiate between cgi and static error pages
+        const Route *route;                // matched location, NULL if routing failed
+        const Server *server;              // server block that accepted the connection (error pages, headers)
+        bool gzip_accepted;                // client sent Accept-Encoding allowing gzip
+        bool head_only;                    // HEAD request: same headers as GET, the body is never sent
+        bool keep_body;                    // error status with a body of the handler's own (CGI output), no error page
+        int body_fd;                       // open file the segments refer to, -1 if none (owned, closed on destruction)
+        std::vector<BodySegment> segments; // sent after `body`, e.g. byte ranges of body_fd
+
+    private:
+        HttpResponse(const HttpResponse &);
+        HttpResponse &operator=(const HttpResponse &);
 
 };
 
@@ -0,0 +1,39 @@
+#ifndef METRICS_HPP
+#define METRICS_HPP
+
+#include <string>
+#include <map>
+#include <vector>
+#include <pthread.h>
+
+#define METRICS_CONTENT_TYPE "text/plain; version=0.0.4"
+
+// Process-wide counters, gauges and latency histograms, shared by the loop and the worker threads.
+// Served in Prometheus text format by locations with `metrics = true`
+class Metrics
+{
+public:
+    static void increment(const std::string &name, double value = 1);
+    static void setGauge(const std::string &name, double value);
+    static void addGauge(const std::string &name, double delta);
+    static void setRatio(const std::string &name, const std::string &numerator, const std::string &denominator);
+    static void observe(const std::string &name, double seconds);
+    static std::string render();
+
+private:
+    struct Histogram
+    {
+        std::vector<unsigned long> buckets; // cumulative counts are computed when rendering
+        unsigned long count;
+        double sum;
+
+        Histogram();
+    };
+
+    static pthread_mutex_t mutex;
+    static std::map<std::string, double> counters;
+    static std::map<std::string, double> gauges;
+    static std::map<std::string, Histogram> histograms;
+};
+
+#endif
@@ -16,10 +16,10 @@
 class RequestParser {
   public:
     static void parseRawRequest(HttpRequest &request);
+    static void checkForDirectory(HttpRequest &request);
     
   private:
     static void tokenizeRequestLine(HttpRequest &request);
-    static void checkForDirectory(HttpRequest &request);
     static void tokenizeHeaders(HttpRequest &request);
     static void parseBody(HttpRequest &request);
     static void saveChunkedBody(HttpRequest &request);
@@ -6,17 +6,31 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <cstdio>
+#include <cstdlib>
+#include <cctype>
 #include <fstream>
 #include <map>
 #include <ctime>
+#include <iomanip>
+#include <cerrno>
 #include "httpRequest.hpp"
 #include "httpResponse.hpp"
 #include "cgi.hpp"
 #include "server.hpp"
 #include "mimeTypeMapper.hpp"
+#include "gzipEncoder.hpp"
+#include "directoryListing.hpp"
+#include "metrics.hpp"
+#include "contentStore.hpp"
+#include "resumableUpload.hpp"
 #include <dirent.h>
+#include <fcntl.h>
+#include <vector>
+#include <algorithm>
 #include <sys/types.h>
 
+#define MAX_BYTE_RANGES 16 // more ranges than this in one request are ignored and the full file is sent
+
 // Processes the HTTP request and generates the HTTP response. Includes logic for:
 // - Routing the request
 // - Populating the HTTPResponse object based on the request
@@ -27,9 +41,16 @@ public:
     void processRequest(int &fd, Server &config, HttpRequest &request, HttpResponse &response);
     static void responseBuilder(HttpResponse &response);
     static std::string getStatusMessage(int code);
+    static const std::string &generateDateHeader();
+    static void refreshDateHeader();
+    static bool runsOnEventLoop(const Server &config, const HttpRequest &request);
+    static bool compressesStream(HttpResponse &response);
+    static void deliverInternalFile(const HttpRequest &request, HttpResponse &response, const std::string &file);
 
 
 private:
+    static std::string cached_date;      // Date header value, refreshed at most once per second
+    static std::time_t cached_date_time;
     // Routing
     static void routeRequest(int &fd, Server &server, HttpRequest &request, HttpResponse &response);
     static bool findMatchingRoute(Server &server, HttpRequest &request, HttpResponse &response);
@@ -44,10 +65,26 @@ private:
     static void setFullPath(HttpRequest &request);
     static bool hasReadPermission(const std::string &file_path, HttpResponse &response);
     static bool readFile(HttpRequest &request, HttpResponse &response);
+    static bool acceptsEncoding(const HttpRequest &request, const std::string &coding);
+    static void selectPrecompressedFile(HttpRequest &request, HttpResponse &response);
+    static void deliverFile(HttpRequest &request, HttpResponse &response, bool zero_copy = false);
+    static void attachFile(const HttpRequest &request, HttpResponse &response, const struct stat &file_stat);
+    // Conditional GET helpers
+    static std::string generateETag(const struct stat &file_stat);
+    static void setValidatorHeaders(const struct stat &file_stat, HttpResponse &response);
+    static bool isNotModified(const HttpRequest &request, const HttpResponse &response, const struct stat &file_stat);
+    static bool etagListMatches(const std::string &header_value, const std::string &etag);
+    // Byte range helpers
+    static bool handleRangeRequest(const HttpRequest &request, HttpResponse &response, const struct stat &file_stat);
+    static bool parseRangeHeader(const std::string &value, off_t file_size, std::vector<std::pair<off_t, off_t> > &ranges);
+    static bool ifRangeMatches(const HttpRequest &request, const HttpResponse &response, const struct stat &file_stat);
+    static std::string contentRangeValue(off_t first, off_t last, off_t file_size);
     // POST request handlers
     static void processFileUpload(HttpRequest &request, HttpResponse &response);
     static void writeToFile(HttpRequest &request, HttpResponse &response);
     // DELETE request handlers
+    static void processResumableUpload(HttpRequest &request, HttpResponse &response);
+    static void setUploadProgressHeaders(const UploadProgress &progress, HttpResponse &response);
     static void processFileDeletion(HttpRequest &request, HttpResponse &response);
     static void removeFile(HttpRequest &request, HttpResponse &response);
 
@@ -62,11 +99,19 @@ private:
     static void finalizeFullPath(HttpRequest &request, size_t &last_slash_pos);
     static void extractOrGenerateFilename(HttpRequest &request);
     static std::string generateTimestampName();
+    static std::string shardDirectory(const Route &route, const std::string &file_name);
+    static std::string locateShard(const Route &route, const std::string &base, const std::string &file_name);
+    static bool createShardDirectories(const std::string &base, const std::string &shard);
     static std::string sanitizeFileName(std::string &file_name);
     // Builder helpers
-    static std::string generateDateHeader();
-    static std::string buildFullPath(int status_code);
-    static std::string read_error_file(std::string &file_path);
+    static std::string formatHttpDate(std::time_t time);
+    static bool parseHttpDate(const std::string &date, std::time_t &time);
+    static bool gzipEligible(const HttpResponse &response);
+    static void compressResponse(HttpResponse &response);
+    static void weakenETag(HttpResponse &response);
+    static void applyCachePolicy(HttpResponse &response);
+    static const ExpiresRule *findExpiresRule(const Route &route, const std::string &type);
+    static bool isCompressibleType(const Route &route, const HttpResponse &response);
     // static void createHtmlBody(HttpResponse &response);
     static void generateDirectoryListing(const HttpRequest &request, HttpResponse &response);
     static bool handleCGIErrors(int &fd, Server &config, HttpRequest &request, HttpResponse &response);
@@ -0,0 +1,59 @@
+#ifndef RESPONSEWRITER_HPP
+#define RESPONSEWRITER_HPP
+
+#include <string>
+#include <vector>
+#include <sys/types.h>
+#include "httpResponse.hpp"
+
+#define WRITER_MAX_IOV 64 // iovecs per sendmsg call, well below IOV_MAX
+
+enum WriteStatus
+{
+    WRITE_DONE,  // everything sent
+    WRITE_AGAIN, // socket buffer full, call write() again on POLLOUT
+    WRITE_ERROR  // peer gone or file error, drop the connection
+};
+
+// One contiguous piece of the serialized response: bytes in memory or a byte range of the body file
+struct WritePiece
+{
+    const char *data; // NULL for file ranges
+    off_t offset;     // start in body_fd for file ranges
+    size_t length;
+
+    WritePiece(const char *data, off_t offset, size_t length) : data(data), offset(offset), length(length) {}
+};
+
+// Sends a response without serializing it into one string.
+// Takes over the header block, body, segments and body_fd of an HttpResponse, so the response
+// can be deleted right away. Memory pieces go out together with sendmsg (scatter-gather),
+// file ranges with sendfile. A partial write only moves the cursor; nothing is rebuilt.
+class ResponseWriter
+{
+public:
+    explicit ResponseWriter(HttpResponse &response);
+    ~ResponseWriter();
+
+    WriteStatus write(int fd);
+    size_t bytesRemaining() const;
+
+private:
+    std::string header_block;
+    std::string body;
+    std::vector<BodySegment> segments;
+    int body_fd;
+    std::vector<WritePiece> pieces;
+    size_t current;      // first piece not completely sent
+    size_t piece_offset; // bytes of pieces[current] already sent
+    size_t remaining;
+
+    WriteStatus writeMemory(int fd);
+    WriteStatus writeFile(int fd);
+    void advance(size_t bytes);
+
+    ResponseWriter(const ResponseWriter &);
+    ResponseWriter &operator=(const ResponseWriter &);
+};
+
+#endif
@@ -0,0 +1,66 @@
+#ifndef RESUMABLEUPLOAD_HPP
+#define RESUMABLEUPLOAD_HPP
+
+#include <string>
+#include <map>
+#include <ctime>
+#include <pthread.h>
+#include <sys/types.h>
+#include "atomicFile.hpp"
+
+#define RESUMABLE_MAX_SIZE 4294967296LL // largest total a Content-Range PUT may announce (4 GiB)
+#define RESUMABLE_MAX_SESSIONS 128      // unfinished uploads at once, more -> 503
+#define RESUMABLE_IDLE_TIMEOUT 3600     // seconds without a segment before an unfinished upload is dropped
+
+enum SegmentResult
+{
+    SEGMENT_STORED,   // written, ranges are still missing (-> 202)
+    SEGMENT_COMPLETE, // last range arrived and the file was published (-> 201)
+    SEGMENT_CONFLICT, // total differs from the running upload, or the name was taken meanwhile (-> 409)
+    SEGMENT_BUSY,     // too many unfinished uploads (-> 503)
+    SEGMENT_ERROR
+};
+
+struct UploadProgress
+{
+    off_t total;
+    off_t received;
+    std::string ranges; // "0-1048575,2097152-3145727", inclusive like Content-Range
+};
+
+// PUT with Content-Range: segments of one upload (keyed by its target path, so any connection can
+// continue it) are pwritten into a sparse AtomicFile of the announced total size. The received ranges
+// are kept merged; once they cover the whole file it is published under its name with the usual
+// no-replace semantics. Segments of the same upload may be written concurrently by several workers,
+// only the bookkeeping is under the lock. A failed write ends the upload until it is reaped as idle.
+// State lives in memory: a restart loses unfinished uploads
+class ResumableUpload
+{
+public:
+    static SegmentResult writeSegment(const std::string &path, off_t start, off_t end, off_t total,
+                                      const char *data, FsyncPolicy policy, UploadProgress &progress);
+    static bool progress(const std::string &path, UploadProgress &progress);
+    static bool parseContentRange(const std::string &value, off_t &start, off_t &end, off_t &total);
+
+private:
+    struct Session
+    {
+        AtomicFile file;
+        off_t total;
+        off_t received;
+        std::map<off_t, off_t> ranges; // start -> end (exclusive), non-overlapping and non-adjacent
+        int writers;                   // segments being pwritten right now
+        bool failed;                   // a pwrite failed: later segments get SEGMENT_ERROR, nothing is published
+        time_t last_active;
+    };
+
+    static pthread_mutex_t mutex;
+    static std::map<std::string, Session *> sessions;
+
+    static Session *acquire(const std::string &path, off_t total, FsyncPolicy policy, SegmentResult &error);
+    static void addRange(Session &session, off_t start, off_t end);
+    static void fillProgress(const Session &session, UploadProgress &progress);
+    static void reapIdle(time_t now);
+};
+
+#endif
@@ -0,0 +1,20 @@
+#ifndef SCOPEDLOCK_HPP
+#define SCOPEDLOCK_HPP
+
+#include <pthread.h>
+
+// Holds a pthread mutex for the lifetime of the object (state shared with the file I/O workers)
+class ScopedLock
+{
+public:
+    explicit ScopedLock(pthread_mutex_t &mutex) : mutex(mutex) { pthread_mutex_lock(&mutex); }
+    ~ScopedLock() { pthread_mutex_unlock(&mutex); }
+
+private:
+    pthread_mutex_t &mutex;
+
+    ScopedLock(const ScopedLock &);
+    ScopedLock &operator=(const ScopedLock &);
+};
+
+#endif
@@ -6,15 +6,37 @@
 #define DEFAULT_FILE "index.html"
 #define ERROR_PATH "/errors/"
 #define POLL_TIMEOUT 1000
+#define SERVER_SOFTWARE "MAC_Server/1.0"
+#define SHARD_MAX_DEPTH 3 // levels of 256 hash-named subdirectories, 3 -> 16M leaf directories
+#define CGI_DEFAULT_QUEUE_MAX 64    // requests per CGI location waiting for a free slot (cgi_queue_max), more -> 503
+#define CGI_DEFAULT_QUEUE_TIMEOUT 5 // seconds a request may wait for a slot (cgi_queue_timeout), then 503
+#define CGI_CACHE_DEFAULT_TTL 1     // seconds a cached CGI response is fresh when the script sends no max-age (cgi_cache_ttl)
+#define CGI_CACHE_DEFAULT_STALE 10  // seconds it may then be served stale, unless the script sets its own (cgi_cache_stale)
 
 #include <string>
 #include <map>
 #include <set>
 #include <vector>
 #include <iostream>
+#include <pthread.h>
+#include "gzipEncoder.hpp"
+#include "atomicFile.hpp"
+#include "fastcgi.hpp"
+#include "cgiPool.hpp"
+#include "childReaper.hpp"
 
 class HttpRequest;
 
+// Client cache lifetime for one MIME type of a location (config: expires = ["image/png 30d"]).
+// The Cache-Control value is rendered once when the config is loaded
+struct ExpiresRule
+{
+    long seconds;              // negative means "do not cache"
+    std::string cache_control; // e.g. "max-age=2592000"
+
+    ExpiresRule() : seconds(0) {}
+};
+
 // Represents a single route. One for each of the location blocks in the config file
 struct Route
 {
@@ -27,9 +49,43 @@ struct Route
     bool directory_listing_enabled;
     bool is_cgi;
     bool autoindex;
+    bool gzip_static;                   // serve a pre-compressed "<file>.gz" sidecar when the client accepts gzip
+    bool gzip;                          // compress responses on the fly
+    std::set<std::string> gzip_types;   // MIME types eligible for on-the-fly compression
+    size_t gzip_min_length;             // smaller bodies are sent uncompressed
+    int gzip_comp_level;                // zlib level 1 (fast) - 9 (small)
+    size_t gzip_max_memory;             // zlib memory budget per compressed response
+    std::string cache_control;          // Cache-Control value for successful responses, e.g. "public, max-age=31536000, immutable"
+    std::map<std::string, ExpiresRule> expires; // per MIME type ("image/png", "image/*" or "*") cache lifetime, adds Expires
+    bool metrics;                       // answer GET/HEAD with the Metrics registry instead of files
+    FsyncPolicy fsync_policy;           // durability of uploads before 201: none, data or full
+    bool dedup;                         // store uploads once per content hash, names are hard links into <path>/.cas
+    int shard_depth;                    // top-level files live in <path>/ab/cd/<name>, a = sha256(name); 0 = flat
+    std::vector<std::string> fastcgi_pass; // "unix:/path" or "ip:port" backends; set on an is_cgi location, replaces fork/exec
+    size_t fastcgi_max_conns;           // persistent connections per backend
+    int fastcgi_timeout;                // seconds until a backend that hasn't answered gets a 504
+    std::string fastcgi_root;           // directory of the scripts for SCRIPT_FILENAME (default: path)
+    size_t cgi_pool_min;                // warm interpreters kept running for this is_cgi location
+    size_t cgi_pool_max;                // upper bound of the pool, 0 = fork+exec per request
+    unsigned long cgi_pool_max_requests; // scripts per worker before it is replaced
+    int cgi_pool_idle_timeout;          // seconds an idle worker above cgi_pool_min lives
+    std::string sendfile_root;          // files CGI output may name in X-Sendfile / X-Accel-Redirect, empty = ignored
+    bool cgi_splice;                    // relay the script's body pipe -> socket with splice(), not through user space
+    size_t cgi_pipe_size;               // F_SETPIPE_SZ for the script's stdout pipe, 0 = kernel default (64K)
+    size_t cgi_max_procs;               // scripts of this location running at once, 0 = only CGI_MAX_PROCESSES
+    size_t cgi_queue_max;               // requests waiting for a slot, 0 = answer 503 right away
+    int cgi_queue_timeout;              // seconds a queued request waits before it gets a 503
+    bool cgi_cache;                     // keep GET responses of the scripts for later requests, see CGICache
+    int cgi_cache_ttl;                  // seconds a copy is fresh when the script sends no max-age
+    int cgi_cache_stale;                // default stale-while-revalidate / stale-if-error window, seconds
     std::string root_directory;
 
-    Route() : directory_listing_enabled(false), is_cgi(false), autoindex(false) {}
+    Route() : directory_listing_enabled(false), is_cgi(false), autoindex(false), gzip_static(false), gzip(false),
+              gzip_min_length(GZIP_DEFAULT_MIN_LENGTH), gzip_comp_level(GZIP_DEFAULT_LEVEL), gzip_max_memory(GZIP_DEFAULT_MAX_MEMORY), metrics(false), fsync_policy(FSYNC_NONE), dedup(false), shard_depth(0),
+              fastcgi_max_conns(FASTCGI_DEFAULT_MAX_CONNS), fastcgi_timeout(FASTCGI_DEFAULT_TIMEOUT),
+              cgi_pool_min(0), cgi_pool_max(0), cgi_pool_max_requests(CGI_POOL_DEFAULT_MAX_REQUESTS), cgi_pool_idle_timeout(CGI_POOL_DEFAULT_IDLE_TIMEOUT),
+              cgi_splice(false), cgi_pipe_size(0), cgi_max_procs(0), cgi_queue_max(CGI_DEFAULT_QUEUE_MAX), cgi_queue_timeout(CGI_DEFAULT_QUEUE_TIMEOUT),
+              cgi_cache(false), cgi_cache_ttl(CGI_CACHE_DEFAULT_TTL), cgi_cache_stale(CGI_CACHE_DEFAULT_STALE) {}
 };
 
 // Represents the overall server configuration
@@ -47,6 +103,8 @@ public:
     const std::map<std::string, Route> &getRoutes() const;
     Route *getRoute(const std::string &uri); // Getter for a specific Route by URI
     const std::map<int, std::string> &getErrorPages() const;
+    bool getErrorPageBody(int code, std::string &body) const;
+    const std::string &getStaticHeaders() const;
     HttpRequest &getRequestObject(int &fd);
 
     // Setters
@@ -55,6 +113,8 @@ public:
     void setRoute(const std::string &uri, const Route &route);
     void setErrorPages(const std::map<int, std::string> &error_pages);
     void setErrorPage(const int &code, const std::string &path);
+    void loadErrorPages();
+    void renderStaticHeaders();
     void setListenerFd(const int &listener_fd);
     void setRequestObject(int &fd, HttpRequest &request);
     void deleteRequestObject(const int &fd);
@@ -70,10 +130,14 @@ public:
     size_t client_max_body_size;
     std::map<std::string, Route> routes;    // Mapping of URIs to Route objects
     std::map<int, std::string> error_pages; // Error pages mapped by status code
+    std::map<int, std::string> error_page_bodies; // Contents of the error pages, loaded at startup / SIGHUP
+    static pthread_mutex_t error_pages_mutex;     // guards error_page_bodies: FileIOPool workers read it during a reload
     std::string index;
+    std::vector<std::string> add_headers;   // extra "Name: value" headers sent with every response
 
 private:
     std::map<int, HttpRequest> client_fd_to_request;
+    std::string static_headers;             // "Server: ...\r\n" + add_headers, rendered once by renderStaticHeaders
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,31 @@
+#ifndef SHA256_HPP
+#define SHA256_HPP
+
+#include <string>
+#include <cstddef>
+#include <stdint.h>
+
+#define SHA256_DIGEST_SIZE 32
+#define SHA256_BLOCK_SIZE 64
+
+// Incremental SHA-256 (FIPS 180-4): update() any number of times, then hexDigest() once
+class Sha256
+{
+public:
+    Sha256();
+
+    void update(const char *data, size_t length);
+    std::string hexDigest();
+
+    static std::string hash(const std::string &data);
+
+private:
+    uint32_t state[8];
+    unsigned char block[SHA256_BLOCK_SIZE];
+    size_t block_length;
+    uint64_t total_length;
+
+    void transform(const unsigned char *chunk);
+};
+
+#endif
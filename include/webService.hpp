@@ -19,6 +19,8 @@
 #include "requestParser.hpp"
 #include "httpResponse.hpp"
 #include "responseHandler.hpp"
+#include "responseWriter.hpp"
+#include "fileIOPool.hpp"
 #include "server.hpp"
 #include "debug.hpp"
 
@@ -28,6 +30,7 @@
 #define INIT_FD_SIZE 2
 #define END_HEADER "\r\n\r\n"
 #define MAX_CGI_BODY_SIZE 1000000
+#define MAX_INTERNAL_REDIRECTS 10 // local redirects from CGI output followed for one client request
 
 class WebService
 {
@@ -63,10 +66,18 @@ public:
     int start();
     void receiveRequest(int &fd, size_t &i, Server &server);
     static void sendResponse(int &fd, size_t &i, Server &server);
+    static void finishResponse(int fd, size_t &i, Server &server, const HttpRequest &request, HttpResponse *response);
+    static void handleFileIOCompletions();
+    static bool queueResponse(int fd, HttpResponse &response);
+    static void continuePendingWrite(int fd, size_t &i);
+    static void dropPendingWrite(int fd);
+    static void redirectInternally(int fd, Server &server, const HttpRequest &original, const std::string &location);
     void newConnection(Server &server);
     static void closeConnection(const int &fd, size_t &i, Server &server);
     void handleSigint(int signal);
     static void sigintHandler(int signal);
+    static void sighupHandler(int signal);
+    static volatile sig_atomic_t reload_requested;
     static int addToPfdsVector(int new_fd, bool isCGIOutput = false);
     // static void deleteFromPfdsVec(int &fd, size_t &i);
     static void deleteFromPfdsVecForCGI(const int &fd);
@@ -83,6 +94,7 @@ public:
     static std::map<int, HttpResponse *> cgi_fd_to_http_response; // fds to respective server objects pointer
     static std::vector<pollfd> pfds_vec;
     static std::map<int, Server *> fd_to_server; // fds to respective server objects pointer
+    static std::map<int, ResponseWriter *> pending_writes; // responses the socket didn't take in one go
     static void cleanup();
                                              // all pfds (listener and client) for all servers
 };
\ No newline at end of file
@@ -3,6 +3,10 @@
 #include "../../include/httpResponse.hpp"
 #include "../../include/webService.hpp"
 #include "../../include/responseHandler.hpp"
+#include "../../include/cgiPool.hpp"
+#include "../../include/gzipEncoder.hpp"
+#include "../../include/metrics.hpp"
+#include "../../include/cgiCache.hpp"
 
 // Default constructor for the CGI class
 CGI::CGI() : clientSocket(-1), scriptPath(""), method(""), queryString(""), requestBody("") {}
@@ -77,21 +81,7 @@ std::string CGI::constructErrorResponse(int status_code, const std::string &mess
 // Helper function to get status message
 std::string CGI::getStatusMessage(int status_code)
 {
-    switch (status_code)
-    {
-    case 200:
-        return "OK";
-    case 400:
-        return "Bad Request";
-    case 404:
-        return "Not Found";
-    case 500:
-        return "Internal Server Error";
-    case 504:
-        return "Gateway Timeout";
-    default:
-        return "Unknown";
-    }
+    return HttpResponse::reasonPhrase(status_code);
 }
 
 // Helper function to extract path info
@@ -189,40 +179,110 @@ char **CGI::setCGIEnvironment(const HttpRequest &httpRequest) const
     return env_array;
 }
 
-void CGI::postRequest(int pipe_in[2])
+// The body reaches the script from the poll loop, as fast as the pipe drains: a script that writes
+// output before reading all of stdin no longer deadlocks against a blocking write. Bodies above
+// CGI_SPOOL_THRESHOLD are moved to a temp file, so they aren't held in memory while the script runs
+void CGI::startInput(CGIProcess &proc, int pipe_write)
 {
-    if (method == "POST" && !requestBody.empty())
+    fcntl(pipe_write, F_SETFL, O_NONBLOCK);
+    proc.input_pipe = pipe_write;
+    proc.input_offset = 0;
+    proc.input_size = requestBody.size();
+    if (requestBody.size() > CGI_SPOOL_THRESHOLD)
+        proc.input_spool = spoolBody(requestBody);
+    if (proc.input_spool == -1)
+        proc.input = requestBody;
+    feedInput(proc);
+    if (proc.input_pipe != -1)
     {
-        const size_t CHUNK_SIZE = 4096;
-        size_t total_written = 0;
-        const char *data = requestBody.c_str();
-        size_t remaining = requestBody.length();
+        WebService::addToPfdsVector(proc.input_pipe, true);
+        WebService::setPollfdEvents(proc.input_pipe, POLLOUT);
+        WebService::cgi_fd_to_http_response[proc.input_pipe] = proc.response;
+    }
+}
 
-        while (remaining > 0)
+// returns the unlinked file with the body, or -1 and the caller keeps the body in memory
+int CGI::spoolBody(const std::string &body)
+{
+    int fd = open(CGI_SPOOL_DIR, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if (fd == -1)
+    {
+        DEBUG_MSG("CGI body spool failed", strerror(errno));
+        return -1;
+    }
+    size_t written = 0;
+    while (written < body.size())
+    {
+        ssize_t count = write(fd, body.data() + written, body.size() - written);
+        if (count == -1 && errno == EINTR)
+            continue;
+        if (count == -1)
         {
-            size_t to_write = std::min(CHUNK_SIZE, remaining);
-            ssize_t written = write(pipe_in[1], data + total_written, to_write);
+            DEBUG_MSG("CGI body spool failed", strerror(errno));
+            close(fd);
+            return -1;
+        }
+        written += count;
+    }
+    return fd;
+}
 
-            if (written == -1)
-            {
-                close(pipe_in[1]);
-                throw std::runtime_error("Failed to write to CGI input pipe");
-            }
+// writes until the pipe is full (POLLOUT brings us back) or the body is through (stdin EOF)
+void CGI::feedInput(CGIProcess &proc)
+{
+    char buffer[CGI_INPUT_CHUNK];
+    while (proc.input_offset < proc.input_size)
+    {
+        size_t length = std::min(static_cast<off_t>(CGI_INPUT_CHUNK), proc.input_size - proc.input_offset);
+        const char *data = proc.input.data() + proc.input_offset;
+        if (proc.input_spool != -1)
+        {
+            ssize_t count = pread(proc.input_spool, buffer, length, proc.input_offset);
+            if (count <= 0)
+                break;
+            data = buffer;
+            length = count;
+        }
+        ssize_t written = write(proc.input_pipe, data, length);
+        if (written == -1 && errno == EINTR)
+            continue;
+        if (written == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        if (written == -1)
+        {
+            // EPIPE: the script exited or closed stdin without reading everything
+            DEBUG_MSG_2("CGI stdin closed early", strerror(errno));
+            break;
+        }
+        proc.input_offset += written;
+        proc.last_update_time = time(NULL);
+    }
+    closeInput(proc);
+}
 
-            total_written += written;
-            remaining -= written;
-        } 
-        close(pipe_in[1]); // Close write end immediately for non-POST requests
+void CGI::closeInput(CGIProcess &proc)
+{
+    if (proc.input_pipe != -1)
+    {
+        WebService::deleteFromPfdsVecForCGI(proc.input_pipe);
+        WebService::cgi_fd_to_http_response.erase(proc.input_pipe);
+        fd_to_pid.erase(proc.input_pipe);
+        close(proc.input_pipe);
+        proc.input_pipe = -1;
     }
-       else
+    if (proc.input_spool != -1)
     {
-        close(pipe_in[1]); // Close write end immediately for non-POST requests
+        close(proc.input_spool);
+        proc.input_spool = -1;
     }
+    std::string().swap(proc.input);
 }
 
 pid_t CGI::runChildCGI(int pipe_in[2], int pipe_out[2], HttpRequest &request)
 {
-    if (pipe(pipe_in) == -1)
+    // close-on-exec: scripts forked later must not hold this request's pipe ends, or its stdin
+    // never sees EOF; the child's dup2() copies on 0 and 1 stay open
+    if (pipe2(pipe_in, O_CLOEXEC) == -1)
     {
         DEBUG_MSG("Pipe creation for stdin failed", strerror(errno));
         throw std::runtime_error("Pipe creation for stdin failed");
@@ -231,7 +291,7 @@ pid_t CGI::runChildCGI(int pipe_in[2], int pipe_out[2], HttpRequest &request)
     DEBUG_MSG("Input pipe - Write FD", pipe_in[1]);
 
     // Create output pipe
-    if (pipe(pipe_out) == -1)
+    if (pipe2(pipe_out, O_CLOEXEC) == -1)
     {
         DEBUG_MSG("Pipe creation for stdout failed", strerror(errno));
         //  Close previously opened pipe_in before throwing
@@ -239,6 +299,22 @@ pid_t CGI::runChildCGI(int pipe_in[2], int pipe_out[2], HttpRequest &request)
         close(pipe_in[1]);
         throw std::runtime_error("Pipe creation for stdout failed");
     }
+    // bigger stdout pipe: fewer wakeups (and larger splices) for scripts with lots of output
+    if (request.route != NULL && request.route->cgi_pipe_size > 0 &&
+        fcntl(pipe_out[0], F_SETPIPE_SZ, (int)request.route->cgi_pipe_size) == -1)
+        DEBUG_MSG("F_SETPIPE_SZ failed, keeping the default pipe size", strerror(errno));
+    // a warm interpreter of the location's pool forks the script instead, with these pipes
+    if (request.route != NULL && request.route->cgi_pool_max > 0)
+    {
+        char **env_array = setCGIEnvironment(request);
+        // a placeholder pid until the worker reports the script's own, see scriptStarted()
+        pid_t pooled = CGIPool::run(*request.route, scriptPath, env_array, pipe_in[0], pipe_out[1]);
+        for (char **env = env_array; *env != NULL; env++)
+            free(*env);
+        delete[] env_array;
+        if (pooled > 0)
+            return pooled;
+    }
     pid_t pid = fork();
     if (pid == -1)
     {
@@ -254,6 +330,7 @@ pid_t CGI::runChildCGI(int pipe_in[2], int pipe_out[2], HttpRequest &request)
     if (pid == 0)
     { // Child process
         DEBUG_MSG("Child process", "started");
+        ChildReaper::prepareChild();
 
         // Redirect stdin to pipe_in[0]
         if (dup2(pipe_in[0], STDIN_FILENO) == -1)
@@ -292,6 +369,7 @@ pid_t CGI::runChildCGI(int pipe_in[2], int pipe_out[2], HttpRequest &request)
         delete[] env_array;
         exit(EXIT_FAILURE);
     }
+    ChildReaper::watch(pid);
     return pid;
 }
 
@@ -319,13 +397,16 @@ void CGI::executeCGI(int &fd, HttpResponse &response, HttpRequest &request)
         close(pipe_in[0]);  // Close read end of input pipe
         close(pipe_out[1]); // Close write end of output pipe
 
-        if (request.method == "POST")
-            postRequest(pipe_in);
+        // Add process to tracking map right after fork
+        std::map<int, Server *>::iterator server_it = WebService::fd_to_server.find(fd);
+        addProcess(pid, pipe_out[0], fd, request, &response, server_it != WebService::fd_to_server.end() ? server_it->second : NULL);
+        running_processes[pid].client_http11 = (request.version == "HTTP/1.1");
+        if (request.method == "POST" && !requestBody.empty())
+            startInput(running_processes[pid], pipe_in[1]);
         else
             close(pipe_in[1]);
-
-        // Add process to tracking map right after fork
-        addProcess(pid, pipe_out[0], fd, request, &response);
+        if (running_processes[pid].input_pipe != -1)
+            fd_to_pid[running_processes[pid].input_pipe] = pid;
         DEBUG_MSG_3("CGI:WebService::fd_to_server.erase(fd); ", fd);
 
         WebService::fd_to_server.erase(fd);
@@ -340,14 +421,23 @@ void CGI::executeCGI(int &fd, HttpResponse &response, HttpRequest &request)
         // Use the local copy instead of the reference that might be invalidated
         output_pipe = output_pipe_fd;
 
+        // output is read as it comes and relayed from readCGI(), the client is only polled for POLLOUT
+        // while the socket did not take all of it
+        fcntl(output_pipe, F_SETFL, O_NONBLOCK);
         WebService::setPollfdEventsToIn(output_pipe);
-        WebService::setPollfdEventsToOut(client_fd);
+        WebService::setPollfdEvents(client_fd, 0);
 
         WebService::fd_to_server.erase(output_pipe);
 
         DEBUG_MSG_2("CGI: WebService::addToPfdsVector added fd: ", output_pipe_fd);
         WebService::cgi_fd_to_http_response[output_pipe] = &response;
-        WebService::cgi_fd_to_http_response[client_fd] = &response;
+        fd_to_pid[output_pipe] = pid;
+        // -1: a cache refresh nobody waits for, see CGI::refresh()
+        if (client_fd != -1)
+        {
+            WebService::cgi_fd_to_http_response[client_fd] = &response;
+            fd_to_pid[client_fd] = pid;
+        }
 
         DEBUG_MSG_3("CGI: WebService:: added new process at response_fd ", client_fd);
 
@@ -360,18 +450,34 @@ void CGI::executeCGI(int &fd, HttpResponse &response, HttpRequest &request)
 }
 
 std::map<pid_t, CGI::CGIProcess> CGI::running_processes;
+std::map<int, pid_t> CGI::fd_to_pid;
+std::map<const Route *, size_t> CGI::running_per_route;
+std::map<const Route *, size_t> CGI::queued_per_route;
+std::set<pid_t> CGI::unwanted;
+std::deque<CGIQueuedRequest *> CGI::queue;
 
-void CGI::addProcess(pid_t pid, int output_pipe, int response_fd, HttpRequest &req, HttpResponse *response)
+void CGI::addProcess(pid_t pid, int output_pipe, int response_fd, HttpRequest &req, HttpResponse *response, Server *server)
 {
     CGIProcess proc;
     proc.last_update_time = time(NULL);
     proc.output_pipe = output_pipe;
-    proc.request = &req;
+    proc.request = req;
+    proc.request.raw_request.clear();
+    proc.request.body.clear();
+    proc.server = server;
     proc.response_fd = response_fd;
     proc.response = response;
+    if (CGICache::applies(req))
+    {
+        proc.cache_key = CGICache::keyFor(req);
+        proc.cache_fill = CGICache::claimFill(proc.cache_key);
+    }
 
     DEBUG_MSG_2("Adding new CGI process PID", pid);
     running_processes[pid] = proc;
+    if (req.route != NULL)
+        running_per_route[req.route]++;
+    Metrics::setGauge("cgi_processes_running", running_processes.size());
 }
 
 void CGI::cleanupProcess(pid_t pid)
@@ -386,165 +492,505 @@ void CGI::cleanupProcess(pid_t pid)
         DEBUG_MSG_2("------->Could not find CGI process to cleanup ", pid);
 }
 
-void CGI::sendCGIResponse(CGIProcess &proc)
+// Output pipe is readable: the first bytes are held back until the script's header block is complete,
+// everything after that is framed and passed on to the client right away
+void CGI::readCGI(CGIProcess &proc)
 {
-    if (proc.response->complete == true)
+    char buffer[CGI_READ_CHUNK];
+    ssize_t bytes_read = read(proc.output_pipe, buffer, sizeof(buffer));
+    if (bytes_read == -1 && (errno == EAGAIN || errno == EINTR))
+        return;
+    if (bytes_read > 0)
     {
-        DEBUG_MSG_2("SG1 ", "");
-        proc.response->setHeader("Content-Type", "text/plain");
-        proc.response->version = "HTTP/1.1";
-        std::ostringstream oss;
-        oss << proc.response->body.length();
-        proc.response->setHeader("Content-Length", oss.str());
-
-        proc.response->close_connection = true;
-
-        WebService::setPollfdEventsToOut(proc.response_fd);
-        DEBUG_MSG_2("SG2 ", "");
-        ResponseHandler::responseBuilder(*proc.response);
-        DEBUG_MSG_2("SG3 ", "");
-        std::string responseStr = proc.response->generateRawResponseStr();
-        DEBUG_MSG_2("---------->responseStr ", responseStr);
-        ssize_t bytes_sent = send(proc.response_fd, responseStr.c_str(), responseStr.size(), 0);
-        if (bytes_sent == -1)
+        proc.last_update_time = time(NULL);
+        DEBUG_MSG_3("READ at readCGI, read bytes: ", bytes_read);
+        if (proc.headers_done)
+            appendBody(proc, buffer, bytes_read);
+        else
         {
-            DEBUG_MSG("Send error", strerror(errno));
+            proc.output.append(buffer, bytes_read);
+            parseOutputHeaders(proc);
         }
-        else
+    }
+    else
+    {
+        if (bytes_read == -1)
+            DEBUG_MSG_2("CGI: Read error on pipe", strerror(errno));
+        DEBUG_MSG_2("CGI::readCGI() end of script output on pipe", proc.output_pipe);
+        proc.output_done = true;
+        if (!proc.headers_done)
+            parseOutputHeaders(proc);
+        finishBody(proc);
+        // a body cut short of the script's Content-Length is not kept, releaseProcess() gives up the fill
+        if (proc.cache_fill && proc.headers_done && proc.body_left <= 0)
         {
-            DEBUG_MSG_2("Bytes sent:", bytes_sent);
-            if (bytes_sent < (ssize_t)responseStr.size())
-            {
-                DEBUG_MSG("Warning: Not all data was sent", "");
-            }
+            proc.cache_fill = false;
+            CGICache::store(proc.cache_key, *proc.request.route, proc.cache_head, proc.cache_body);
         }
-        if (close(proc.response_fd) == -1)
-            DEBUG_MSG_2("Webservice::CGI::checkRunningProcesses() Closing connection FD failed", strerror(errno));
-        DEBUG_MSG_2("Webservice::CGI::checkRunningProcesses() Closing sending pipe ", proc.response_fd);
+        closeOutput(proc);
     }
+    if (proc.output_pipe != -1 && proc.stream.size() - proc.stream_offset > CGI_STREAM_HIGH_WATER)
+        WebService::setPollfdEvents(proc.output_pipe, 0);
 }
 
-void CGI::killCGI(pid_t pid, CGIProcess &proc)
+// Waits for the blank line that ends the script's header block, then starts the response.
+// Output whose first line is not a header field, that has no blank line within CGI_MAX_HEADER_SIZE,
+// or that ends before one, is sent as a text/plain body (e.g. list_files.py prints bare JSON)
+bool CGI::parseOutputHeaders(CGIProcess &proc)
 {
-    // Check for timeout
-    time_t now = time(NULL);
-    if ((now - proc.last_update_time) > CGI_TIMEOUT)
-    {
-        DEBUG_MSG_2("CGI timeout reached for pid", pid);
-        close(proc.output_pipe);
-        WebService::deleteFromPfdsVecForCGI(proc.output_pipe);
-        
-        // Send timeout response to client before closing
-        
-        // Kill the process
-        kill(pid, SIGKILL);
-        // Wait for it to be reaped
-        waitpid(pid, NULL, 0);
-        // Same cleanup as above
-        proc.process_finished = true;
+    size_t header_end = 0;
+    size_t body_start = 0;
+    CGIHeadState state = findResponseHead(proc.output, header_end, body_start);
+    if (state == CGI_HEAD_INCOMPLETE && proc.output.size() <= CGI_MAX_HEADER_SIZE && !proc.output_done)
+        return false;
+
+    CGIResponseHead head;
+    std::string body;
+    if (state == CGI_HEAD_COMPLETE)
+    {
+        parseResponseHead(proc.output.substr(0, header_end), head);
+        if (proc.cache_fill && !CGICache::storable(head))
+        {
+            CGICache::abandon(proc.cache_key, head.status == -1 ? 502 : (head.status >= 500 ? head.status : 0));
+            proc.cache_fill = false;
+        }
+        if ((head.status >= 500 || head.status == -1) && !proc.cache_key.empty() &&
+            CGICache::serveOnError(proc.cache_key, *proc.response))
+        {
+            // stale-if-error: the last good copy goes out instead, the rest of the output is dropped
+            proc.output.clear();
+            proc.headers_done = true;
+            proc.body_left = 0;
+            proc.response->close_connection = true;
+            ResponseHandler::responseBuilder(*proc.response);
+            proc.stream += proc.response->generateHeaderBlock();
+            proc.stream += proc.response->body;
+            return true;
+        }
+        if (isLocalRedirect(head))
+        {
+            proc.local_redirect = head.location;
+            return true;
+        }
+        if (sendsFile(head, *proc.response))
+        {
+            applyResponseHead(head, *proc.response);
+            ResponseHandler::deliverInternalFile(proc.request, *proc.response, head.sendfile);
+            proc.file_response = true;
+            return true;
+        }
+        body = proc.output.substr(body_start);
+        // an error status gets the server's error page unless the script sends a body of its own,
+        // which is only known once some of it (or EOF) arrives
+        if (head.status >= 400 && body.empty() && !proc.output_done)
+            return false;
     }
+    else
+    {
+        head.fields.push_back(std::make_pair(std::string("Content-Type"), std::string("text/plain")));
+        body = proc.output;
+    }
+    proc.output.clear();
+    if (proc.cache_fill)
+        proc.cache_head = head;
+    startResponse(proc, head, !body.empty());
+    appendBody(proc, body.data(), body.size());
+    return true;
 }
 
-void CGI::readCGI(pid_t pid, CGIProcess &proc)
+// Builds and queues the response head. The body is framed with the script's Content-Length if it
+// sent one, else chunked for HTTP/1.1 clients, else by closing the connection. Error statuses
+// without a body, and malformed script output (502), are answered in full with the error page and
+// whatever the script still writes is dropped
+void CGI::startResponse(CGIProcess &proc, const CGIResponseHead &head, bool has_body)
 {
-    (void)pid;
-    ssize_t bytes_read;
-    char buffer[MAX_CGI_BODY_SIZE];
-    if ((bytes_read = read(proc.output_pipe, buffer, sizeof(buffer))) > 0)
+    HttpResponse &response = *proc.response;
+    // the head is the script's alone, nothing set on the response before it started may leak in
+    response.headers.clear();
+    response.body.clear();
+    applyResponseHead(head, response);
+    response.close_connection = true;
+    proc.headers_done = true;
+    if (response.status_code >= 400 && (!has_body || head.status == -1))
     {
-        proc.last_update_time = time(NULL);
-        DEBUG_MSG_3("READ at readFromCGI, read bytes: ", bytes_read);
-        proc.response->body.append(buffer, bytes_read);
-        proc.process_finished = false;
-
+        ResponseHandler::responseBuilder(response);
+        proc.stream += response.generateHeaderBlock();
+        if (!response.head_only)
+            proc.stream += response.body;
+        proc.body_left = 0;
         return;
     }
-    else if (bytes_read == -1)
+
+    response.keep_body = true;
+    proc.body_left = head.content_length;
+    bool bodyless = response.status_code < 200 || response.status_code == 204 || response.status_code == 304;
+    if (bodyless)
+        proc.body_left = 0;
+    else if (response.headers.find("Content-Type") == response.headers.end())
+        response.setHeader("Content-Type", "text/plain");
+
+    if (proc.body_left < 0 && ResponseHandler::compressesStream(response))
     {
-        DEBUG_MSG_3("READ at readFromCGI, read bytes: ", bytes_read);
-        DEBUG_MSG_2("CGI: Read error on pipe", proc.output_pipe);
-        // Mark the process as finished with an error.
-        proc.process_finished = true;
-        proc.finished_success = false;
-        if (errno == ECHILD)
+        proc.gzip = new GzipEncoder();
+        if (proc.gzip->init(response.route->gzip_comp_level, response.route->gzip_max_memory))
+            response.setHeader("Content-Encoding", "gzip");
+        else
         {
-            proc.last_update_time = time(NULL);
-            proc.process_finished = true;
-            proc.finished_success = true;
-            proc.response->complete = true;
-            proc.response->status_code = 200;
-            proc.response->version = "HTTP/1.1";
-            proc.response->reason_phrase = "OK";
-            DEBUG_MSG_2("readCGI() read : ", proc.response->body);
-
-            DEBUG_MSG_2("Webservice::CGI::checkRunningProcesses() Child finished, End of file reached", "");
+            delete proc.gzip;
+            proc.gzip = NULL;
         }
-
-        // Close the pipe and remove it from your poll vector.
-        close(proc.output_pipe);
-        WebService::deleteFromPfdsVecForCGI(proc.output_pipe);
     }
-    else if (bytes_read == 0)
+    if (!proc.cache_key.empty())
+        response.setHeader("X-Cache", "MISS");
+    ResponseHandler::responseBuilder(response);
+    if (!bodyless && proc.body_left >= 0)
     {
-        proc.last_update_time = time(NULL);
-        proc.process_finished = true;
-        proc.finished_success = true;
-        proc.response->complete = true;
-        proc.response->status_code = 200;
-        proc.response->version = "HTTP/1.1";
-        proc.response->reason_phrase = "OK";
-        DEBUG_MSG_2("readCGI() read : ", proc.response->body);
-        DEBUG_MSG_2("Webservice::CGI::checkRunningProcesses() Child finished, End of file reached", "");
+        std::ostringstream oss;
+        oss << proc.body_left;
+        response.setHeader("Content-Length", oss.str());
+    }
+    else if (!bodyless && proc.client_http11)
+    {
+        response.setHeader("Transfer-Encoding", "chunked");
+        proc.chunked = true;
     }
-    // Process cleanup
+    proc.stream += response.generateHeaderBlock();
+    proc.splice = response.route && response.route->cgi_splice && !proc.gzip && !response.head_only && !bodyless && !proc.cache_fill;
+}
 
-    if (close(proc.output_pipe) != 0)
+static bool isTokenChar(char c)
+{
+    return std::isalnum(static_cast<unsigned char>(c)) || std::strchr("!#$%&'*+-.^_`|~", c) != NULL;
+}
+
+// Locates the header block of CGI output: header_end is where the blank line starts, body_start
+// where the body begins. Scripts end lines with "\n" or "\r\n"
+CGIHeadState CGI::findResponseHead(const std::string &output, size_t &header_end, size_t &body_start)
+{
+    size_t name_end = 0;
+    while (name_end < output.size() && output[name_end] != '\0' && isTokenChar(output[name_end]))
+        name_end++;
+    if (name_end == output.size())
+        return CGI_HEAD_INCOMPLETE;
+    if (name_end == 0 || output[name_end] != ':')
+        return CGI_HEAD_NONE;
+
+    header_end = output.find("\r\n\r\n");
+    body_start = header_end + 4;
+    size_t lf_end = output.find("\n\n");
+    if (lf_end != std::string::npos && (header_end == std::string::npos || lf_end < header_end))
     {
-        DEBUG_MSG_2("-----------> Webservice::CGI::checkRunningProcesses() proc.response_fd pipe could not be closed  ", proc.output_pipe);
+        header_end = lf_end;
+        body_start = lf_end + 2;
     }
+    return header_end == std::string::npos ? CGI_HEAD_INCOMPLETE : CGI_HEAD_COMPLETE;
+}
+
+// Splits the header block into the fields the server interprets (RFC 3875 6.3: Status, Location,
+// and Content-Length, which only frames the body) and the ones passed on to the client
+void CGI::parseResponseHead(const std::string &block, CGIResponseHead &head)
+{
+    std::istringstream lines(block);
+    std::string line;
+    while (std::getline(lines, line))
+    {
+        if (!line.empty() && line[line.size() - 1] == '\r')
+            line.erase(line.size() - 1);
+        size_t colon = line.find(':');
+        if (colon == std::string::npos || colon == 0)
+            continue;
+        std::string name = line.substr(0, colon);
+        size_t value_start = line.find_first_not_of(" \t", colon + 1);
+        size_t value_end = line.find_last_not_of(" \t");
+        std::string value = value_start == std::string::npos ? "" : line.substr(value_start, value_end - value_start + 1);
+        if (strcasecmp(name.c_str(), "Status") == 0)
+        {
+            // "Status: 404 Not Found", the reason phrase is ours
+            bool valid = value.size() >= 3 && std::isdigit(value[0]) && std::isdigit(value[1]) && std::isdigit(value[2]) &&
+                         (value.size() == 3 || value[3] == ' ');
+            int code = valid ? std::atoi(value.substr(0, 3).c_str()) : 0;
+            head.status = (code >= 100 && code <= 599) ? code : -1;
+        }
+        else if (strcasecmp(name.c_str(), "Location") == 0)
+            head.location = value;
+        else if (strcasecmp(name.c_str(), "X-Sendfile") == 0 || strcasecmp(name.c_str(), "X-Accel-Redirect") == 0)
+            head.sendfile = value;
+        else if (strcasecmp(name.c_str(), "Content-Length") == 0)
+        {
+            char *end = NULL;
+            long long length = std::strtoll(value.c_str(), &end, 10);
+            if (!value.empty() && std::isdigit(value[0]) && *end == '\0')
+                head.content_length = length;
+        }
+        else
+            head.fields.push_back(std::make_pair(name, value));
+    }
+}
+
+// Location with a local path and no Status (RFC 3875 6.2.2): the server answers with that resource
+// itself instead of sending the client a redirect. "//host/..." is a network path, not local
+bool CGI::isLocalRedirect(const CGIResponseHead &head)
+{
+    return head.status == 0 && !head.location.empty() && head.location[0] == '/' &&
+           (head.location.size() == 1 || head.location[1] != '/');
+}
+
+// X-Sendfile is only honoured on locations with a sendfile_root and for successful responses;
+// elsewhere the header is dropped and the script's own body is sent
+bool CGI::sendsFile(const CGIResponseHead &head, const HttpResponse &response)
+{
+    return !head.sendfile.empty() && (head.status == 0 || head.status == 200) && head.location.empty() &&
+           response.route && !response.route->sendfile_root.empty();
+}
+
+// Status from the Status field; a Location without it is a client redirect (302); otherwise 200.
+// A malformed Status is the script's fault: 502. Transfer-Encoding and Connection are the
+// server's to set, the script only describes the body
+void CGI::applyResponseHead(const CGIResponseHead &head, HttpResponse &response)
+{
+    if (head.status == -1)
+        response.status_code = 502;
+    else if (head.status != 0)
+        response.status_code = head.status;
+    else if (!head.location.empty())
+        response.status_code = 302;
     else
+        response.status_code = 200;
+    if (!head.location.empty())
+        response.setHeader("Location", head.location);
+    for (size_t i = 0; i < head.fields.size(); ++i)
     {
-        DEBUG_MSG_2("-----------> Webservice::CGI::checkRunningProcesses() proc.response_fd closed  ", proc.output_pipe);
+        const std::string &name = head.fields[i].first;
+        if (strcasecmp(name.c_str(), "Content-Type") == 0)
+            response.setHeader("Content-Type", head.fields[i].second);
+        else if (strcasecmp(name.c_str(), "Transfer-Encoding") != 0 && strcasecmp(name.c_str(), "Connection") != 0)
+            response.setHeader(name, head.fields[i].second);
     }
+}
 
-    pid_t result = waitpid(pid, &proc.status, WNOHANG);
-    if (result > 0)
+// Takes one piece of body: cut to the script's Content-Length, kept for the cache while this run fills
+// it, gzip'd with a sync flush so the client can decode everything received so far, and framed
+void CGI::appendBody(CGIProcess &proc, const char *data, size_t length)
+{
+    if (proc.body_left >= 0)
+    {
+        if ((long long)length > proc.body_left)
+            length = proc.body_left;
+        proc.body_left -= length;
+    }
+    if (proc.cache_fill && proc.cache_body.size() + length > CGI_CACHE_MAX_BODY)
+    {
+        CGICache::abandon(proc.cache_key, 0);
+        proc.cache_fill = false;
+        std::string().swap(proc.cache_body);
+    }
+    else if (proc.cache_fill)
+        proc.cache_body.append(data, length);
+    if (length == 0 || proc.response->head_only)
+        return;
+    std::string compressed;
+    if (proc.gzip)
     {
-        DEBUG_MSG_3("-----------> CGI::readCGI() waitpid returned :  ", proc.output_pipe);
+        proc.gzip->update(data, length, compressed, true);
+        data = compressed.data();
+        length = compressed.size();
+    }
+    frameBody(proc, data, length);
+}
 
-        // Child has exited, status is valid
-        if (WIFEXITED(proc.status) && WEXITSTATUS(proc.status) == 0)
-        {
-            // Process exited normally with status 0
-            DEBUG_MSG_3("-----------> CGI::readCGI() waitpid returned success on exit  ", proc.output_pipe);
+// wraps bytes ready for the client in a chunk if the response is chunked
+void CGI::frameBody(CGIProcess &proc, const char *data, size_t length)
+{
+    if (length == 0)
+        return;
+    if (proc.chunked)
+    {
+        std::ostringstream size;
+        size << std::hex << length << "\r\n";
+        proc.stream += size.str();
+    }
+    proc.stream.append(data, length);
+    if (proc.chunked)
+        proc.stream += "\r\n";
+}
 
-            proc.finished_success = true;
-        }
-        else
-        {
-            killCGI(pid, proc);
-            DEBUG_MSG_3("-----------> CGI::readCGI() waitpid DIDNT return success on exit  WIFEXITED(proc.status)", WIFEXITED(proc.status));
-            DEBUG_MSG_3("-----------> CGI::readCGI() waitpid DIDNT return success on exit WEXITSTATUS(proc.status)", WEXITSTATUS(proc.status));
+void CGI::finishBody(CGIProcess &proc)
+{
+    if (proc.response->head_only)
+        return;
+    if (proc.gzip)
+    {
+        std::string trailer;
+        proc.gzip->finish(trailer);
+        delete proc.gzip;
+        proc.gzip = NULL;
+        frameBody(proc, trailer.data(), trailer.size());
+    }
+    if (proc.chunked)
+        proc.stream += "0\r\n\r\n";
+}
 
-            // Process exited abnormally or with non-zero status
-            proc.finished_success = false;
+// Sends what the client socket takes without blocking. While more than CGI_STREAM_HIGH_WATER bytes
+// wait here the output pipe is not polled, so a slow client leaves the script blocked in write()
+// instead of growing this buffer; reading resumes below CGI_STREAM_LOW_WATER.
+// Returns false if the client is gone
+bool CGI::writeStream(CGIProcess &proc)
+{
+    if (proc.response_fd == -1)
+    {
+        // cache refresh: the body was kept by appendBody(), nobody takes the framed copy
+        proc.stream.clear();
+        proc.stream_offset = 0;
+        return true;
+    }
+    while (proc.stream_offset < proc.stream.size())
+    {
+        ssize_t sent = send(proc.response_fd, proc.stream.data() + proc.stream_offset,
+                            proc.stream.size() - proc.stream_offset, MSG_NOSIGNAL);
+        if (sent == -1 && errno == EINTR)
+            continue;
+        if (sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (sent <= 0)
+        {
+            DEBUG_MSG_2("CGI: send to client failed", strerror(errno));
+            return false;
         }
+        proc.stream_offset += sent;
+        proc.last_update_time = time(NULL);
     }
-    else if (result == 0)
+    size_t pending = proc.stream.size() - proc.stream_offset;
+    if (pending == 0)
     {
-        // Child is still running
-        killCGI(pid, proc);
-        DEBUG_MSG_2("CGI: Process still running", pid);
+        proc.stream.clear();
+        proc.stream_offset = 0;
     }
-    else if (result == -1)
+    else if (proc.stream_offset > CGI_STREAM_LOW_WATER)
     {
-        DEBUG_MSG_2("CGI: waitpid error", "");
+        proc.stream.erase(0, proc.stream_offset);
+        proc.stream_offset = 0;
     }
-    WebService::deleteFromPfdsVecForCGI(proc.output_pipe);
-    DEBUG_MSG_3("------->WebService::cgi_fd_to_http_response.erase(proc.output_pipe);", proc.output_pipe);
+    WebService::setPollfdEvents(proc.response_fd, pending ? POLLOUT : 0);
+    if (proc.output_pipe != -1 && pending <= CGI_STREAM_LOW_WATER)
+        WebService::setPollfdEvents(proc.output_pipe, POLLIN);
+    return true;
+}
+
+// cgi_splice: once the head is out, the body moves from the script's pipe to the socket with
+// splice() and never enters user space. Chunked framing still works: FIONREAD says how much is in the
+// pipe, that becomes the next chunk, and its size line and CRLF go through `stream`. Stream bytes
+// always leave before the next splice. Returns false if the client is gone
+bool CGI::relayOutput(CGIProcess &proc)
+{
+    while (true)
+    {
+        if (!writeStream(proc))
+            return false;
+        if (proc.stream_offset < proc.stream.size())
+            return true;
+        if (proc.splice_left > 0)
+        {
+            ssize_t moved = splice(proc.output_pipe, NULL, proc.response_fd, NULL, proc.splice_left,
+                                   SPLICE_F_MOVE | SPLICE_F_NONBLOCK | SPLICE_F_MORE);
+            if (moved == -1 && errno == EINTR)
+                continue;
+            if (moved == -1 && errno == EAGAIN)
+            {
+                // socket full: wait for POLLOUT, the pipe keeps the data (and the script blocks)
+                WebService::setPollfdEvents(proc.output_pipe, 0);
+                WebService::setPollfdEvents(proc.response_fd, POLLOUT);
+                return true;
+            }
+            if (moved <= 0)
+            {
+                DEBUG_MSG_2("CGI: splice to client failed", strerror(errno));
+                return false;
+            }
+            proc.splice_left -= moved;
+            proc.last_update_time = time(NULL);
+            if (proc.splice_left == 0 && proc.chunked)
+                proc.stream += "\r\n";
+            continue;
+        }
+        if (proc.output_pipe == -1)
+            return true;
+        if (proc.body_left == 0)
+        {
+            // the script's Content-Length is used up, readCGI() drops the rest
+            proc.splice = false;
+            WebService::setPollfdEvents(proc.output_pipe, POLLIN);
+            return true;
+        }
+
+        int available = 0;
+        if (ioctl(proc.output_pipe, FIONREAD, &available) == -1 || available <= 0)
+        {
+            // empty pipe: either the script has not written yet or it closed stdout
+            char byte;
+            ssize_t bytes_read = read(proc.output_pipe, &byte, 1);
+            if (bytes_read == 1)
+            {
+                appendBody(proc, &byte, 1);
+                continue;
+            }
+            if (bytes_read == -1 && (errno == EAGAIN || errno == EINTR))
+            {
+                WebService::setPollfdEvents(proc.output_pipe, POLLIN);
+                WebService::setPollfdEvents(proc.response_fd, 0);
+                return true;
+            }
+            proc.output_done = true;
+            finishBody(proc);
+            closeOutput(proc);
+            continue;
+        }
+        size_t length = available;
+        if (proc.body_left >= 0)
+        {
+            length = std::min(length, (size_t)proc.body_left);
+            proc.body_left -= length;
+        }
+        if (proc.chunked)
+        {
+            std::ostringstream size;
+            size << std::hex << length << "\r\n";
+            proc.stream += size.str();
+        }
+        proc.splice_left = length;
+    }
+}
 
+void CGI::closeOutput(CGIProcess &proc)
+{
+    if (proc.output_pipe == -1)
+        return;
+    WebService::deleteFromPfdsVecForCGI(proc.output_pipe);
     WebService::cgi_fd_to_http_response.erase(proc.output_pipe);
-    WebService::setPollfdEventsToOut(proc.response_fd);
+    fd_to_pid.erase(proc.output_pipe);
+    close(proc.output_pipe);
+    proc.output_pipe = -1;
+}
+
+// Releases everything a CGI request holds: the script if it is still writing, its pipes, the client
+// connection and the response
+void CGI::endCGI(std::map<pid_t, CGIProcess>::iterator it)
+{
+    CGIProcess &proc = it->second;
+    if (!proc.output_done && !proc.process_finished)
+        stopScript(it->first);
+    closeInput(proc);
+    closeOutput(proc);
+    if (proc.response_fd != -1)
+    {
+        WebService::deleteFromPfdsVecForCGI(proc.response_fd);
+        WebService::cgi_fd_to_http_response.erase(proc.response_fd);
+        fd_to_pid.erase(proc.response_fd);
+        close(proc.response_fd);
+    }
+    delete proc.gzip;
+    delete proc.response;
+    DEBUG_MSG_2("------>Ended CGI process", it->first);
+    releaseProcess(it);
 }
 
 void CGI::printRunningProcesses()
@@ -563,121 +1009,413 @@ void CGI::printRunningProcesses()
     }
 }
 
-// 1. Find correct CGI process using the fd. Either the process with the proc.output_pipe or proc.response_fd
-// 2. If the process is proc.output_pipe - then read from it. Then waitpid and cleanup. Return back to main loop.
-// 3. If the process if response_fd - then send response. Then cleanup. Return to main loop
-void CGI::checkCGIProcess(int pfds_fd)
+// 1. Find correct CGI process using the fd: its output pipe, its input pipe or the client connection
+// 2. If the fd is the input pipe - feed the script's stdin. Return back to main loop.
+// 3. If the fd is the output pipe - read from it and relay. If it is the client - send what is pending
+void CGI::checkCGIProcess(int pfds_fd, short revents)
 {
-    if (running_processes.empty())
-        return;
-
     DEBUG_MSG_2("entered CGI::checkCGIProcess(int pfds_fd)  ", pfds_fd);
-    printRunningProcesses();
 
-    // Find the matching process
-    std::map<pid_t, CGIProcess>::iterator matching_it = running_processes.end();
-    bool found_cgi = false;
-
-    for (std::map<pid_t, CGIProcess>::iterator it = running_processes.begin();
-         it != running_processes.end(); ++it)
+    std::map<int, pid_t>::iterator fd_it = fd_to_pid.find(pfds_fd);
+    if (fd_it == fd_to_pid.end())
     {
-        pid_t current_pid = it->first;
-        (void)current_pid;
-        CGIProcess &current_proc = it->second;
+        DEBUG_MSG_2("CGI::checkCGIProcess No matching process found for fd", pfds_fd);
+        return;
+    }
+    std::map<pid_t, CGIProcess>::iterator matching_it = running_processes.find(fd_it->second);
+    if (matching_it == running_processes.end())
+    {
+        fd_to_pid.erase(fd_it);
+        return;
+    }
+    DEBUG_MSG_2("CGI::checkRunningProcesses: FOUND CGI process which wants to write to pipe or reply ", pfds_fd);
 
-        DEBUG_MSG_2("CGI::checkCGIProcess checking process PID", current_pid);
-        DEBUG_MSG_2("CGI::checkRunningProcesses: proc.output_pipe is   ", current_proc.output_pipe);
-        DEBUG_MSG_2("CGI::checkRunningProcesses: proc.response_fd is   ", current_proc.response_fd);
+    // Now use the correct iterator
+    CGIProcess &proc = matching_it->second;
 
-        if (pfds_fd == current_proc.output_pipe || pfds_fd == current_proc.response_fd)
+    if (pfds_fd == proc.input_pipe)
+    {
+        feedInput(proc);
+        return;
+    }
+    // with splice the body is moved by relayOutput() below, readCGI() only sees the head
+    if (pfds_fd == proc.output_pipe && !(proc.splice && proc.headers_done))
+    {
+        DEBUG_MSG_2("CGI::checkRunningProcesses: will try to read from CGI proceses  ", pfds_fd);
+        readCGI(proc);
+        if (proc.response_fd == -1 && (!proc.local_redirect.empty() || proc.file_response))
         {
-            matching_it = it;
-            found_cgi = true;
-            DEBUG_MSG_2("CGI::checkRunningProcesses: FOUND CGI process which wants to write to pipe or reply ", pfds_fd);
-            break;
+            // a cache refresh has nobody to redirect or send a file to, and neither is kept
+            endCGI(matching_it);
+            return;
+        }
+        if (!proc.local_redirect.empty())
+        {
+            redirectLocally(matching_it);
+            return;
+        }
+        if (proc.file_response)
+        {
+            sendFinalResponse(matching_it);
+            return;
         }
     }
-
-    // If no match was found, return
-    if (!found_cgi || matching_it == running_processes.end())
+    // the client fd only polls for POLLOUT while stream data is pending. A POLLOUT with nothing
+    // pending is stale: the output pipe came first in this poll round and drained the stream. Any
+    // other event on it (POLLHUP, POLLERR) means the client went away
+    else if (pfds_fd == proc.response_fd && proc.stream_offset == proc.stream.size() && proc.splice_left == 0)
     {
-        DEBUG_MSG_2("CGI::checkCGIProcess No matching process found for fd", pfds_fd);
+        if (!(revents & (POLLHUP | POLLERR | POLLNVAL)))
+            return;
+        DEBUG_MSG_2("CGI::checkRunningProcesses: client closed the connection ", pfds_fd);
+        endCGI(matching_it);
         return;
     }
+    if (!(proc.splice ? relayOutput(proc) : writeStream(proc)) || (proc.output_done && proc.stream.empty() && proc.splice_left == 0))
+        endCGI(matching_it);
+}
 
-    // Now use the correct iterator
-    pid_t pid = matching_it->first;
-    CGIProcess &proc = matching_it->second;
+// A child's wait status, from ChildReaper (fork+exec, pool workers) or from the pool worker that ran
+// the script. The response does not wait for it, it ends with the script's stdout, so the request may
+// be finished already; while it is not, the status is kept and a dead script's pid is never signalled
+void CGI::processExited(pid_t pid, int status)
+{
+    bool success = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    std::map<pid_t, CGIProcess>::iterator it = running_processes.find(pid);
+    if (it != running_processes.end())
+    {
+        it->second.process_finished = true;
+        it->second.status = status;
+        it->second.finished_success = success;
+    }
+    // SIGKILL is the server's own, on timeouts and when the client left
+    if (!success && !(WIFSIGNALED(status) && WTERMSIG(status) == SIGKILL))
+    {
+        Metrics::increment("cgi_script_failures_total");
+        DEBUG_MSG("CGI child failed, wait status", status);
+    }
+}
+
+// SIGKILL for a script that is still writing. A pooled script whose pid is not known yet is killed
+// as soon as its worker reports it
+void CGI::stopScript(pid_t pid)
+{
+    if (pid >= CGI_POOL_PENDING_BASE)
+        unwanted.insert(pid);
+    else
+        kill(pid, SIGKILL);
+}
 
-    // Rest of your existing code using the correct proc reference
-    if (pfds_fd == proc.output_pipe && found_cgi)
+// A pool worker reported the pid of a script that runs under a placeholder (CGIPool::run): from now
+// on the request is tracked under the real one, which timeouts and processExited() use
+void CGI::scriptStarted(pid_t placeholder, pid_t pid)
+{
+    std::map<pid_t, CGIProcess>::iterator it = running_processes.find(placeholder);
+    if (it == running_processes.end())
     {
-        DEBUG_MSG_2("CGI::checkRunningProcesses: will try to read from CGI proceses  ", pfds_fd);
-        killCGI(pid, proc);
-        if (!proc.process_finished)
-            readCGI(pid, proc);
+        // the request ended first; the script only dies if it still had output to give
+        if (unwanted.erase(placeholder))
+            kill(pid, SIGKILL);
         return;
     }
-    if (pfds_fd == proc.response_fd && found_cgi && proc.finished_success)
+    running_processes[pid] = it->second;
+    running_processes.erase(it);
+    CGIProcess &proc = running_processes[pid];
+    int fds[3] = {proc.output_pipe, proc.input_pipe, proc.response_fd};
+    for (int n = 0; n < 3; ++n)
+    {
+        std::map<int, pid_t>::iterator fd_it = fd_to_pid.find(fds[n]);
+        if (fd_it != fd_to_pid.end() && fd_it->second == placeholder)
+            fd_it->second = pid;
+    }
+}
+
+// The pool worker holding the request died or did not answer: the script may never have started,
+// and the client gets a 500 unless the response is already under way
+void CGI::scriptFailed(pid_t placeholder)
+{
+    std::map<pid_t, CGIProcess>::iterator it = running_processes.find(placeholder);
+    if (it != running_processes.end())
+    {
+        if (it->second.headers_done || it->second.response_fd == -1)
+            endCGI(it);
+        else
+        {
+            it->second.response->status_code = 500;
+            sendFinalResponse(it);
+        }
+    }
+    unwanted.erase(placeholder);
+}
+
+// The script answered with a local Location: it is done, and the connection goes back to its server
+// as a GET for that path
+void CGI::redirectLocally(std::map<pid_t, CGIProcess>::iterator it)
+{
+    CGIProcess &proc = it->second;
+    if (!proc.output_done && !proc.process_finished)
+        stopScript(it->first);
+    closeInput(proc);
+    closeOutput(proc);
+    WebService::cgi_fd_to_http_response.erase(proc.response_fd);
+    fd_to_pid.erase(proc.response_fd);
+    if (proc.server)
+        WebService::redirectInternally(proc.response_fd, *proc.server, proc.request, proc.local_redirect);
+    else
     {
-        DEBUG_MSG_2("CGI::checkRunningProcesses: will try to send CGI response ", pfds_fd);
-        sendCGIResponse(proc);
         WebService::deleteFromPfdsVecForCGI(proc.response_fd);
+        close(proc.response_fd);
+    }
+    delete proc.gzip;
+    delete proc.response;
+    releaseProcess(it);
+}
+
+// Scripts that neither produced output nor had it taken by the client for CGI_TIMEOUT seconds are
+// killed. Before the response head went out the client still gets a 504, or the stale-if-error copy
+// of a cgi_cache location; after that the connection is just closed, which tells the client the body
+// is incomplete
+void CGI::checkAllCGIProcesses()
+{
+    time_t current_time = time(NULL);
+    std::vector<pid_t> expired;
+    for (std::map<pid_t, CGIProcess>::iterator it = running_processes.begin(); it != running_processes.end(); ++it)
+        if ((current_time - it->second.last_update_time) > CGI_TIMEOUT)
+            expired.push_back(it->first);
+
+    for (size_t n = 0; n < expired.size(); ++n)
+    {
+        std::map<pid_t, CGIProcess>::iterator it = running_processes.find(expired[n]);
+        CGIProcess &proc = it->second;
+        DEBUG_MSG("CGI timeout detected for pid", it->first);
+        if (proc.cache_fill)
+        {
+            CGICache::abandon(proc.cache_key, 504);
+            proc.cache_fill = false;
+        }
+        if (proc.headers_done || proc.response_fd == -1)
+        {
+            endCGI(it);
+            continue;
+        }
+        if (proc.cache_key.empty() || !CGICache::serveOnError(proc.cache_key, *proc.response))
+            proc.response->status_code = 504;
+        sendFinalResponse(it);
+    }
+}
+
+// Stops the script and answers with the response built so far (504, X-Sendfile file) through the
+// ResponseWriter, like static responses
+void CGI::sendFinalResponse(std::map<pid_t, CGIProcess>::iterator it)
+{
+    CGIProcess &proc = it->second;
+    if (!proc.output_done && !proc.process_finished)
+        stopScript(it->first);
+    proc.output_done = true;
+    closeInput(proc);
+    closeOutput(proc);
+    proc.response->close_connection = true;
+    ResponseHandler::responseBuilder(*proc.response);
+    if (!WebService::queueResponse(proc.response_fd, *proc.response))
+    {
+        // the pending writer owns the client fd now
+        DEBUG_MSG_2("CGI response queued, rest pending for fd", proc.response_fd);
         WebService::cgi_fd_to_http_response.erase(proc.response_fd);
+        fd_to_pid.erase(proc.response_fd);
+        delete proc.gzip;
         delete proc.response;
-        running_processes.erase(matching_it);
+        releaseProcess(it);
         return;
     }
+    endCGI(it);
 }
 
+// drops a finished request and lets queued ones start in the slot it held. A cache fill that ended
+// without a copy (client gone, script failed) hands its waiters back to admission
+void CGI::releaseProcess(std::map<pid_t, CGIProcess>::iterator it)
+{
+    const Route *route = it->second.request.route;
+    std::string abandoned_fill = it->second.cache_fill ? it->second.cache_key : "";
+    running_processes.erase(it);
+    std::map<const Route *, size_t>::iterator count = running_per_route.find(route);
+    if (count != running_per_route.end() && --count->second == 0)
+        running_per_route.erase(count);
+    Metrics::setGauge("cgi_processes_running", running_processes.size());
+    if (!abandoned_fill.empty())
+        CGICache::abandon(abandoned_fill, 0);
+    startQueued();
+}
 
-void CGI::checkAllCGIProcesses()
+bool CGI::hasSlot(const Route &route)
 {
-    time_t current_time = time(NULL);
-    
-    std::map<pid_t, CGIProcess>::iterator it = running_processes.begin();
-    while (it != running_processes.end()) {
-        pid_t pid = it->first;
-        CGIProcess &proc = it->second;
-        
-        if ((current_time - proc.last_update_time) > CGI_TIMEOUT) {
-            DEBUG_MSG("CGI timeout detected for pid", pid);
-            
-            // Force kill the process
-            kill(pid, SIGKILL);
-            waitpid(pid, NULL, 0);
-            
-            // Close file descriptors
-            if (proc.output_pipe > 0) 
-                close(proc.output_pipe);
-            if (proc.response_fd > 0) 
-            {
-                proc.response->status_code = 504;
-                DEBUG_MSG_1("response.status_code ", proc.response->status_code);
-                proc.response->close_connection = true;
-                ResponseHandler::responseBuilder(*(proc.response));;
-                std::string responseStr = proc.response->generateRawResponseStr();                
-                ssize_t bytes_sent = send(proc.response_fd, responseStr.c_str(), responseStr.size(), 0);
-                if (bytes_sent == -1) {
-                    DEBUG_MSG("Error sending timeout response", strerror(errno));
-                } else {
-                    DEBUG_MSG_2("Sent timeout response, bytes:", bytes_sent);
-                }
-            }
-            close(proc.response_fd);
-            close(proc.output_pipe);
-            if (proc.response)
-                delete proc.response;            
-            // Remove from tracking structures
-            WebService::deleteFromPfdsVecForCGI(proc.output_pipe);
-            WebService::deleteFromPfdsVecForCGI(proc.response_fd);
-            WebService::cgi_fd_to_http_response.erase(proc.response_fd);
-            WebService::cgi_fd_to_http_response.erase(proc.output_pipe);
-            std::map<pid_t, CGIProcess>::iterator temp = it;
-            ++it;
-            running_processes.erase(temp);
-        } else {
-            ++it;
+    if (running_processes.size() >= CGI_MAX_PROCESSES)
+        return false;
+    if (route.cgi_max_procs == 0)
+        return true;
+    std::map<const Route *, size_t>::const_iterator count = running_per_route.find(&route);
+    return count == running_per_route.end() || count->second < route.cgi_max_procs;
+}
+
+// Admission of fork+exec / pool CGI requests. True when the script may start now. Otherwise the
+// request waits in the FIFO behind earlier ones of its location, or gets a 503 with Retry-After
+// when cgi_queue_max of them already wait; either way the response belongs to CGI from here on
+bool CGI::admit(int fd, Server &server, const HttpRequest &request, HttpResponse &response)
+{
+    const Route &route = *request.route;
+    std::map<const Route *, size_t>::iterator count = queued_per_route.find(&route);
+    size_t queued = (count == queued_per_route.end()) ? 0 : count->second;
+    if (queued == 0 && hasSlot(route))
+        return true;
+    if (queued >= route.cgi_queue_max)
+    {
+        DEBUG_MSG_1("CGI queue full for", route.uri);
+        Metrics::increment("cgi_queue_full_total");
+        rejectRequest(fd, server, &response, 503);
+        return false;
+    }
+    CGIQueuedRequest *entry = new CGIQueuedRequest;
+    entry->client_fd = fd;
+    entry->server = &server;
+    entry->request = request;
+    entry->request.raw_request.clear();
+    entry->response = &response;
+    entry->deadline = time(NULL) + route.cgi_queue_timeout;
+    clock_gettime(CLOCK_MONOTONIC, &entry->queued);
+    queue.push_back(entry);
+    queued_per_route[&route]++;
+    WebService::deleteFromPfdsVecForCGI(fd);
+    Metrics::increment("cgi_queued_total");
+    Metrics::addGauge("cgi_queue_depth", 1);
+    return false;
+}
+
+static double secondsSince(const struct timespec &start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+// starts the oldest queued requests that have a slot; a location at its cgi_max_procs does not hold
+// up the others behind it
+void CGI::startQueued()
+{
+    for (size_t n = 0; n < queue.size() && running_processes.size() < CGI_MAX_PROCESSES;)
+    {
+        CGIQueuedRequest *entry = queue[n];
+        if (!hasSlot(*entry->request.route))
+        {
+            ++n;
+            continue;
+        }
+        queue.erase(queue.begin() + n);
+        leaveQueue(entry);
+        runRequest(entry->client_fd, *entry->server, entry->request, entry->response);
+        delete entry;
+    }
+}
+
+// starts the script of a request that was out of the poll set (queued, or waiting for a cache fill)
+void CGI::runRequest(int fd, Server &server, HttpRequest &request, HttpResponse *response)
+{
+    if (WebService::findPollFd(fd) == NULL)
+        WebService::addToPfdsVector(fd, false);
+    response->close_connection = true;
+    try
+    {
+        CGI cgi;
+        cgi.handleCGIRequest(fd, request, *response);
+    }
+    catch (const std::exception &e)
+    {
+        DEBUG_MSG("CGI execution failed", e.what());
+        rejectRequest(fd, server, response, 500);
+    }
+}
+
+// a request the cache could not answer after all goes through admission like a new one
+void CGI::startRequest(int fd, Server &server, HttpRequest &request, HttpResponse *response)
+{
+    if (admit(fd, server, request, *response))
+        runRequest(fd, server, request, response);
+}
+
+// stale-while-revalidate: runs the script for a cached GET with no client attached, its output only
+// replaces the copy. Not while the location is at its limit, the stale copy is good enough until then
+bool CGI::refresh(const HttpRequest &request)
+{
+    if (!hasSlot(*request.route))
+        return false;
+    HttpRequest copy = request;
+    copy.raw_request.clear();
+    HttpResponse *response = new HttpResponse();
+    response->route = copy.route;
+    int fd = -1;
+    try
+    {
+        CGI cgi;
+        cgi.handleCGIRequest(fd, copy, *response);
+    }
+    catch (const std::exception &e)
+    {
+        DEBUG_MSG("CGI cache refresh failed", e.what());
+        delete response;
+        return false;
+    }
+    return true;
+}
+
+// 503 with Retry-After for requests that waited cgi_queue_timeout without getting a slot
+void CGI::checkQueue()
+{
+    if (queue.empty())
+        return;
+    time_t now = time(NULL);
+    for (size_t n = 0; n < queue.size();)
+    {
+        CGIQueuedRequest *entry = queue[n];
+        if (now <= entry->deadline)
+        {
+            ++n;
+            continue;
         }
+        queue.erase(queue.begin() + n);
+        leaveQueue(entry);
+        DEBUG_MSG_1("CGI request timed out in the queue", entry->request.uri);
+        Metrics::increment("cgi_queue_timeouts_total");
+        rejectRequest(entry->client_fd, *entry->server, entry->response, 503);
+        delete entry;
     }
 }
+
+void CGI::leaveQueue(CGIQueuedRequest *entry)
+{
+    std::map<const Route *, size_t>::iterator count = queued_per_route.find(entry->request.route);
+    if (count != queued_per_route.end() && --count->second == 0)
+        queued_per_route.erase(count);
+    Metrics::addGauge("cgi_queue_depth", -1);
+    Metrics::observe("cgi_queue_wait_seconds", secondsSince(entry->queued));
+}
+
+// answers a request that never got a script and closes the connection; takes over the response
+void CGI::rejectRequest(int fd, Server &server, HttpResponse *response, int status)
+{
+    response->status_code = status;
+    if (status == 503)
+        response->setHeader("Retry-After", CGI_RETRY_AFTER);
+    respond(fd, server, response);
+}
+
+// sends a response built outside a running script (cache hits, rejections) and closes the connection;
+// takes over the response
+void CGI::respond(int fd, Server &server, HttpResponse *response)
+{
+    response->close_connection = true;
+    ResponseHandler::responseBuilder(*response);
+    if (WebService::findPollFd(fd) == NULL)
+        WebService::addToPfdsVector(fd, false);
+    size_t i = 0;
+    if (WebService::queueResponse(fd, *response))
+        WebService::closeConnection(fd, i, server);
+    delete response;
+}
@@ -0,0 +1,245 @@
+#include "../../include/cgiCache.hpp"
+#include "../../include/metrics.hpp"
+#include "../../include/debug.hpp"
+
+std::map<std::string, CGICacheEntry> CGICache::entries;
+std::map<std::string, std::vector<CGICacheWaiter> > CGICache::fills;
+
+bool CGICache::applies(const HttpRequest &request)
+{
+    return request.route && request.route->cgi_cache && request.method == "GET";
+}
+
+std::string CGICache::keyFor(const HttpRequest &request)
+{
+    std::map<std::string, std::string>::const_iterator host = request.headers.find("Host");
+    std::string key = (host != request.headers.end()) ? host->second : "";
+    return key + " " + request.uri + "?" + request.queryString;
+}
+
+// Answers a cacheable GET without starting a script: from a fresh copy, from a stale one while a
+// refresh runs in the background, or by joining the script run already producing it. False on a
+// miss, the caller then runs the script, which becomes the key's fill (see CGI::addProcess)
+bool CGICache::handle(int fd, Server &server, const HttpRequest &request, HttpResponse &response)
+{
+    if (!applies(request))
+        return false;
+    std::string key = keyFor(request);
+    time_t now = time(NULL);
+    std::map<std::string, CGICacheEntry>::iterator it = entries.find(key);
+    if (it != entries.end() && now >= it->second.fresh_until && now >= it->second.stale_until && now >= it->second.error_until)
+    {
+        entries.erase(it);
+        it = entries.end();
+        Metrics::setGauge("cgi_cache_entries", entries.size());
+    }
+    if (it != entries.end() && now < it->second.fresh_until)
+    {
+        Metrics::increment("cgi_cache_hits_total");
+        applyEntry(it->second, response, "HIT");
+    }
+    else if (it != entries.end() && now < it->second.stale_until)
+    {
+        // one refresh per key; without a free slot the next request tries again
+        if (fills.find(key) == fills.end() && CGI::refresh(request))
+            Metrics::increment("cgi_cache_refreshes_total");
+        Metrics::increment("cgi_cache_stale_total");
+        applyEntry(it->second, response, "STALE");
+    }
+    else if (fills.find(key) != fills.end())
+    {
+        CGICacheWaiter waiter;
+        waiter.client_fd = fd;
+        waiter.server = &server;
+        waiter.request = request;
+        waiter.request.raw_request.clear();
+        waiter.response = &response;
+        fills[key].push_back(waiter);
+        WebService::deleteFromPfdsVecForCGI(fd);
+        Metrics::increment("cgi_cache_coalesced_total");
+        return true;
+    }
+    else
+    {
+        Metrics::increment("cgi_cache_misses_total");
+        return false;
+    }
+    DEBUG_MSG_1("CGI cache answered", key);
+    CGI::respond(fd, server, &response);
+    return true;
+}
+
+// the first script started for a key while none runs produces its next copy
+bool CGICache::claimFill(const std::string &key)
+{
+    if (fills.find(key) != fills.end())
+        return false;
+    fills[key];
+    return true;
+}
+
+bool CGICache::storable(const CGIResponseHead &head)
+{
+    if ((head.status != 0 && head.status != 200) || !head.location.empty() || !head.sendfile.empty())
+        return false;
+    for (size_t i = 0; i < head.fields.size(); ++i)
+    {
+        const std::string &name = head.fields[i].first;
+        const std::string &value = head.fields[i].second;
+        if (strcasecmp(name.c_str(), "Set-Cookie") == 0)
+            return false;
+        // the body is kept uncompressed, so only Accept-Encoding may vary
+        if (strcasecmp(name.c_str(), "Vary") == 0 && strcasecmp(value.c_str(), "Accept-Encoding") != 0)
+            return false;
+        if (strcasecmp(name.c_str(), "Cache-Control") == 0 &&
+            (directive(value, "no-store") >= 0 || directive(value, "no-cache") >= 0 || directive(value, "private") >= 0))
+            return false;
+    }
+    return true;
+}
+
+// The fill's script finished its body: keep it and answer the clients that waited for it. A copy with
+// no lifetime at all (max-age=0, no stale windows) still answers them, it is just not kept
+void CGICache::store(const std::string &key, const Route &route, const CGIResponseHead &head, const std::string &body)
+{
+    std::string cache_control;
+    for (size_t i = 0; i < head.fields.size(); ++i)
+        if (strcasecmp(head.fields[i].first.c_str(), "Cache-Control") == 0)
+            cache_control = head.fields[i].second;
+    long max_age = directive(cache_control, "s-maxage");
+    if (max_age < 0)
+        max_age = directive(cache_control, "max-age");
+    if (max_age < 0)
+        max_age = route.cgi_cache_ttl;
+    long revalidate = directive(cache_control, "stale-while-revalidate");
+    if (revalidate < 0)
+        revalidate = route.cgi_cache_stale;
+    long if_error = directive(cache_control, "stale-if-error");
+    if (if_error < 0)
+        if_error = route.cgi_cache_stale;
+
+    CGICacheEntry entry;
+    entry.head = head;
+    entry.body = body;
+    entry.stored = time(NULL);
+    entry.fresh_until = entry.stored + max_age;
+    entry.stale_until = entry.fresh_until + revalidate;
+    entry.error_until = entry.fresh_until + if_error;
+
+    if (max_age > 0 || revalidate > 0 || if_error > 0)
+    {
+        if (entries.size() >= CGI_CACHE_MAX_ENTRIES && entries.find(key) == entries.end())
+            purge(entry.stored);
+        if (entries.size() < CGI_CACHE_MAX_ENTRIES || entries.find(key) != entries.end())
+        {
+            entries[key] = entry;
+            Metrics::setGauge("cgi_cache_entries", entries.size());
+            DEBUG_MSG_1("CGI cache stored", key);
+        }
+        else
+            DEBUG_MSG_1("CGI cache full, not storing", key);
+    }
+
+    std::map<std::string, std::vector<CGICacheWaiter> >::iterator fill = fills.find(key);
+    if (fill == fills.end())
+        return;
+    std::vector<CGICacheWaiter> waiters;
+    waiters.swap(fill->second);
+    fills.erase(fill);
+    for (size_t i = 0; i < waiters.size(); ++i)
+    {
+        applyEntry(entry, *waiters[i].response, "HIT");
+        CGI::respond(waiters[i].client_fd, *waiters[i].server, waiters[i].response);
+    }
+}
+
+// The fill's script ended without a copy to keep. `status` is 0 when its response just was not
+// storable; for a server error or a timeout (504) waiters get the stale-if-error copy if there is
+// one, and after a timeout a 504 otherwise. Everyone else runs the script for themselves
+void CGICache::abandon(const std::string &key, int status)
+{
+    std::map<std::string, std::vector<CGICacheWaiter> >::iterator fill = fills.find(key);
+    if (fill == fills.end())
+        return;
+    std::vector<CGICacheWaiter> waiters;
+    waiters.swap(fill->second);
+    fills.erase(fill);
+    for (size_t i = 0; i < waiters.size(); ++i)
+    {
+        CGICacheWaiter &waiter = waiters[i];
+        if (status >= 500 && serveOnError(key, *waiter.response))
+            CGI::respond(waiter.client_fd, *waiter.server, waiter.response);
+        else if (status == 504)
+        {
+            waiter.response->status_code = 504;
+            CGI::respond(waiter.client_fd, *waiter.server, waiter.response);
+        }
+        else
+            CGI::startRequest(waiter.client_fd, *waiter.server, waiter.request, waiter.response);
+    }
+}
+
+// stale-if-error: the script failed or timed out, the client gets the last good copy instead
+bool CGICache::serveOnError(const std::string &key, HttpResponse &response)
+{
+    std::map<std::string, CGICacheEntry>::iterator it = entries.find(key);
+    if (it == entries.end() || time(NULL) >= it->second.error_until)
+        return false;
+    Metrics::increment("cgi_cache_stale_if_error_total");
+    DEBUG_MSG_1("CGI cache serving stale copy for failed script", key);
+    applyEntry(it->second, response, "STALE");
+    return true;
+}
+
+void CGICache::applyEntry(const CGICacheEntry &entry, HttpResponse &response, const char *state)
+{
+    CGI::applyResponseHead(entry.head, response);
+    response.body = entry.body;
+    response.keep_body = true;
+    std::ostringstream age;
+    age << (time(NULL) - entry.stored);
+    response.setHeader("Age", age.str());
+    response.setHeader("X-Cache", state);
+}
+
+// drops copies past all of their windows
+void CGICache::purge(time_t now)
+{
+    for (std::map<std::string, CGICacheEntry>::iterator it = entries.begin(); it != entries.end();)
+    {
+        if (now >= it->second.fresh_until && now >= it->second.stale_until && now >= it->second.error_until)
+            entries.erase(it++);
+        else
+            ++it;
+    }
+    Metrics::setGauge("cgi_cache_entries", entries.size());
+}
+
+// Value of a Cache-Control directive: its number, 0 if it has none (no-store), -1 if it is absent
+long CGICache::directive(const std::string &cache_control, const std::string &name)
+{
+    size_t start = 0;
+    while (start < cache_control.size())
+    {
+        size_t end = cache_control.find(',', start);
+        if (end == std::string::npos)
+            end = cache_control.size();
+        std::string token = cache_control.substr(start, end - start);
+        start = end + 1;
+        size_t first = token.find_first_not_of(" \t");
+        if (first == std::string::npos)
+            continue;
+        token.erase(0, first);
+        size_t equals = token.find('=');
+        std::string token_name = token.substr(0, equals);
+        token_name.erase(token_name.find_last_not_of(" \t") + 1);
+        if (strcasecmp(token_name.c_str(), name.c_str()) != 0)
+            continue;
+        if (equals == std::string::npos)
+            return 0;
+        std::string value = token.substr(equals + 1);
+        value.erase(0, value.find_first_not_of(" \t\""));
+        return std::max(0L, strtol(value.c_str(), NULL, 10));
+    }
+    return -1;
+}
@@ -0,0 +1,366 @@
+#include "../../include/cgiPool.hpp"
+#include "../../include/cgi.hpp"
+#include "../../include/server.hpp"
+#include "../../include/webService.hpp"
+#include "../../include/metrics.hpp"
+#include "../../include/debug.hpp"
+#include <sys/prctl.h>
+#include <climits>
+
+std::map<const Route *, CGIWorkerPool *> CGIPool::pools;
+std::map<int, CGIWorker *> CGIPool::workers;
+time_t CGIPool::last_maintenance = 0;
+pid_t CGIPool::next_placeholder = CGI_POOL_PENDING_BASE;
+
+// The worker: imports what the scripts in cgi-bin use, then forks once per request. The fork gets the
+// passed pipes as stdin/stdout and the request's environment, and runs the script as __main__
+static const char WORKER_PROGRAM[] =
+    "import array, os, runpy, signal, socket, sys\n"
+    "import warnings\n"
+    "warnings.simplefilter('ignore', DeprecationWarning)\n"
+    "for name in ('json', 'subprocess', 'time', 'datetime', 'struct', 'urllib.parse', 'traceback', 'cgi', 'cgitb'):\n"
+    "    try:\n"
+    "        __import__(name)\n"
+    "    except Exception:\n"
+    "        pass\n"
+    "signal.signal(signal.SIGCHLD, signal.SIG_DFL)\n"
+    "control = socket.socket(fileno=3)\n"
+    "control.send(b'R')\n"
+    "while True:\n"
+    "    fds = array.array('i')\n"
+    "    try:\n"
+    "        data, ancdata, flags, addr = control.recvmsg(65536, socket.CMSG_SPACE(2 * fds.itemsize))\n"
+    "    except OSError:\n"
+    "        break\n"
+    "    for level, kind, cdata in ancdata:\n"
+    "        if level == socket.SOL_SOCKET and kind == socket.SCM_RIGHTS:\n"
+    "            fds.frombytes(cdata[:len(cdata) - len(cdata) % fds.itemsize])\n"
+    "    if not data or len(fds) != 2:\n"
+    "        break\n"
+    "    fields = data.split(b'\\0')\n"
+    "    pid = os.fork()\n"
+    "    if pid == 0:\n"
+    "        control.close()\n"
+    "        os.dup2(fds[0], 0)\n"
+    "        os.dup2(fds[1], 1)\n"
+    "        os.close(fds[0])\n"
+    "        os.close(fds[1])\n"
+    "        sys.stdin = open(0, 'r', closefd=False)\n"
+    "        sys.stdout = open(1, 'w', closefd=False)\n"
+    "        os.environ.clear()\n"
+    "        for entry in fields[1:]:\n"
+    "            name, _, value = entry.partition(b'=')\n"
+    "            if name:\n"
+    "                os.environb[name] = value\n"
+    "        sys.argv = [os.fsdecode(fields[0])]\n"
+    "        code = 0\n"
+    "        try:\n"
+    "            runpy.run_path(sys.argv[0], run_name='__main__')\n"
+    "        except SystemExit as exit:\n"
+    "            code = exit.code if isinstance(exit.code, int) else (0 if exit.code is None else 1)\n"
+    "        except BaseException:\n"
+    "            import traceback\n"
+    "            traceback.print_exc()\n"
+    "            code = 1\n"
+    "        try:\n"
+    "            sys.stdout.flush()\n"
+    "        except Exception:\n"
+    "            pass\n"
+    "        os._exit(code)\n"
+    "    os.close(fds[0])\n"
+    "    os.close(fds[1])\n"
+    "    control.send(b'P%d' % pid)\n"
+    "    status = os.waitpid(pid, 0)[1]\n"
+    "    control.send(b'X%d' % status)\n";
+
+// pre-starts cgi_pool_min workers for every location that has a pool
+void CGIPool::start(std::vector<Server> &servers)
+{
+    for (std::vector<Server>::iterator server = servers.begin(); server != servers.end(); ++server)
+    {
+        const std::map<std::string, Route> &routes = server->getRoutes();
+        for (std::map<std::string, Route>::const_iterator it = routes.begin(); it != routes.end(); ++it)
+        {
+            if (!it->second.is_cgi || it->second.cgi_pool_max == 0)
+                continue;
+            CGIWorkerPool *pool = poolFor(it->second);
+            while (pool->workers.size() < minimumWorkers(it->second) && spawn(pool) != NULL)
+                ;
+        }
+    }
+}
+
+// closing the control sockets ends the workers: their recvmsg() sees EOF
+void CGIPool::stop()
+{
+    while (!workers.empty())
+        retire(workers.begin()->second);
+    for (std::map<const Route *, CGIWorkerPool *>::iterator it = pools.begin(); it != pools.end(); ++it)
+        delete it->second;
+    pools.clear();
+}
+
+// Hands the script to an idle worker of the route's pool, or returns -1 when the pool can't take it
+// and the caller forks itself. The loop does not wait for the worker's answer: the request is tracked
+// under a placeholder pid (>= CGI_POOL_PENDING_BASE) until handleEvent() reads "P<pid>" and passes the
+// real one to CGI::scriptStarted(). stdin_fd/stdout_fd stay the caller's to close
+pid_t CGIPool::run(const Route &route, const std::string &script, char **env, int stdin_fd, int stdout_fd)
+{
+    if (route.cgi_pool_max == 0)
+        return -1;
+    CGIWorkerPool *pool = poolFor(route);
+    CGIWorker *worker = NULL;
+    for (size_t n = 0; n < pool->workers.size() && worker == NULL; ++n)
+    {
+        if (pool->workers[n]->state == CGI_WORKER_IDLE)
+            worker = pool->workers[n];
+    }
+    if (worker == NULL)
+    {
+        Metrics::increment("cgi_pool_misses_total");
+        if (pool->workers.size() < route.cgi_pool_max)
+            spawn(pool);
+        return -1;
+    }
+
+    std::string message = script;
+    message += '\0';
+    for (char **entry = env; *entry != NULL; ++entry)
+    {
+        message += *entry;
+        message += '\0';
+    }
+    if (message.size() > CGI_POOL_MESSAGE_MAX || !sendRequest(worker, message, stdin_fd, stdout_fd))
+    {
+        retire(worker);
+        return -1;
+    }
+    if (next_placeholder == INT_MAX)
+        next_placeholder = CGI_POOL_PENDING_BASE;
+    worker->state = CGI_WORKER_HANDSHAKE;
+    worker->pending = next_placeholder++;
+    worker->handshake_deadline = time(NULL) + CGI_POOL_HANDSHAKE_TIMEOUT;
+    worker->served++;
+    Metrics::increment("cgi_pool_requests_total");
+    return worker->pending;
+}
+
+bool CGIPool::ownsFd(int fd)
+{
+    return workers.find(fd) != workers.end();
+}
+
+// "R": started, "P<pid>": the script of the request it was sent is running, "X<status>": the script
+// exited. EOF or errors: the worker is gone, and a request still waiting for its script gets a 500
+void CGIPool::handleEvent(int fd)
+{
+    std::map<int, CGIWorker *>::iterator it = workers.find(fd);
+    if (it == workers.end())
+        return;
+    CGIWorker *worker = it->second;
+    char message[32];
+    ssize_t length = recv(fd, message, sizeof(message) - 1, MSG_DONTWAIT);
+    if (length == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        return;
+    bool handshake = (worker->state == CGI_WORKER_HANDSHAKE);
+    if (length <= 0 || (message[0] != 'R' && message[0] != 'X' && !(message[0] == 'P' && handshake)))
+    {
+        DEBUG_MSG_1("CGI pool worker exited", worker->pid);
+        pid_t pending = handshake ? worker->pending : 0;
+        retire(worker);
+        if (pending)
+            CGI::scriptFailed(pending);
+        return;
+    }
+    if (message[0] == 'P')
+    {
+        message[length] = '\0';
+        worker->script = static_cast<pid_t>(atoi(message + 1));
+        worker->state = CGI_WORKER_BUSY;
+        DEBUG_MSG_2("CGI pool worker started script, pid", worker->script);
+        CGI::scriptStarted(worker->pending, worker->script);
+        worker->pending = 0;
+        return;
+    }
+    if (message[0] == 'X')
+    {
+        // the script is the worker's child, its wait status only comes this way
+        message[length] = '\0';
+        CGI::processExited(worker->script, atoi(message + 1));
+    }
+    const Route &route = *worker->pool->route;
+    if (message[0] == 'X' && worker->served >= route.cgi_pool_max_requests)
+    {
+        Metrics::increment("cgi_pool_recycled_total");
+        retire(worker);
+        return;
+    }
+    worker->state = CGI_WORKER_IDLE;
+    worker->idle_since = time(NULL);
+}
+
+// once a second: reaps workers above cgi_pool_min that idled for cgi_pool_idle_timeout and
+// tops pools back up to cgi_pool_min after workers were recycled or died
+void CGIPool::maintain()
+{
+    if (pools.empty())
+        return;
+    time_t now = time(NULL);
+    if (now == last_maintenance)
+        return;
+    last_maintenance = now;
+    checkHandshakes(now);
+    for (std::map<const Route *, CGIWorkerPool *>::iterator it = pools.begin(); it != pools.end(); ++it)
+    {
+        CGIWorkerPool *pool = it->second;
+        const Route &route = *pool->route;
+        for (size_t n = pool->workers.size(); n-- > 0 && pool->workers.size() > minimumWorkers(route);)
+        {
+            CGIWorker *worker = pool->workers[n];
+            if (worker->state == CGI_WORKER_IDLE && now - worker->idle_since > route.cgi_pool_idle_timeout)
+            {
+                Metrics::increment("cgi_pool_reaped_total");
+                retire(worker);
+            }
+        }
+        while (pool->workers.size() < minimumWorkers(route) && spawn(pool) != NULL)
+            ;
+    }
+}
+
+// A worker that took a request but did not report the script's pid in time is retired, and the
+// request gets a 500. It may have started the script anyway, so there is no fork+exec retry
+void CGIPool::checkHandshakes(time_t now)
+{
+    std::vector<CGIWorker *> late;
+    for (std::map<int, CGIWorker *>::iterator it = workers.begin(); it != workers.end(); ++it)
+    {
+        if (it->second->state == CGI_WORKER_HANDSHAKE && now > it->second->handshake_deadline)
+            late.push_back(it->second);
+    }
+    for (size_t n = 0; n < late.size(); ++n)
+    {
+        pid_t pending = late[n]->pending;
+        DEBUG_MSG_1("CGI pool worker did not start the script", late[n]->pid);
+        Metrics::increment("cgi_pool_handshake_timeouts_total");
+        retire(late[n]);
+        CGI::scriptFailed(pending);
+    }
+}
+
+// cgi_pool_max also caps cgi_pool_min
+size_t CGIPool::minimumWorkers(const Route &route)
+{
+    return std::min(route.cgi_pool_min, route.cgi_pool_max);
+}
+
+CGIWorkerPool *CGIPool::poolFor(const Route &route)
+{
+    CGIWorkerPool *&pool = pools[&route];
+    if (pool == NULL)
+    {
+        pool = new CGIWorkerPool;
+        pool->route = &route;
+        // scripts are reparented to the server when their worker dies, not to init
+        prctl(PR_SET_CHILD_SUBREAPER, 1);
+    }
+    return pool;
+}
+
+CGIWorker *CGIPool::spawn(CGIWorkerPool *pool)
+{
+    int sockets[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sockets) == -1)
+    {
+        DEBUG_MSG_1("CGI pool socketpair failed", strerror(errno));
+        return NULL;
+    }
+    int null_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    // everything the child needs is prepared here: the server has worker threads, so the child
+    // may only make async-signal-safe calls before execve
+    const char *python = PYTHON_PATH;
+    char *const args[] = {const_cast<char *>(python), const_cast<char *>("-c"), const_cast<char *>(WORKER_PROGRAM), NULL};
+    char *const env[] = {NULL}; // like the fork+exec path: nothing of the server's environment
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        ChildReaper::prepareChild();
+        if (dup2(sockets[1], 3) == -1 || (null_fd != -1 && dup2(null_fd, STDIN_FILENO) == -1))
+            _exit(EXIT_FAILURE);
+        // client sockets and listeners must not stay open in a long-lived process
+        if (close_range(4, ~0U, 0) == -1)
+        {
+            for (int fd = 4; fd < sysconf(_SC_OPEN_MAX); ++fd)
+                close(fd);
+        }
+        execve(python, args, env);
+        _exit(EXIT_FAILURE);
+    }
+    close(sockets[1]);
+    if (null_fd != -1)
+        close(null_fd);
+    if (pid == -1)
+    {
+        DEBUG_MSG_1("CGI pool fork failed", strerror(errno));
+        close(sockets[0]);
+        return NULL;
+    }
+    CGIWorker *worker = new CGIWorker;
+    worker->fd = sockets[0];
+    worker->pid = pid;
+    worker->state = CGI_WORKER_STARTING;
+    worker->served = 0;
+    worker->script = -1;
+    worker->pending = 0;
+    worker->handshake_deadline = 0;
+    worker->idle_since = time(NULL);
+    worker->pool = pool;
+    pool->workers.push_back(worker);
+    workers[worker->fd] = worker;
+    WebService::addToPfdsVector(worker->fd, true);
+    ChildReaper::watch(pid);
+    Metrics::increment("cgi_pool_spawned_total");
+    Metrics::addGauge("cgi_pool_workers", 1);
+    DEBUG_MSG_2("CGI pool worker spawned, pid", pid);
+    return worker;
+}
+
+// the worker exits on EOF and ChildReaper collects it; a script it is running keeps its pipes and
+// is reaped by the server's sweep once it is reparented
+void CGIPool::retire(CGIWorker *worker)
+{
+    std::vector<CGIWorker *> &pool = worker->pool->workers;
+    pool.erase(std::find(pool.begin(), pool.end(), worker));
+    workers.erase(worker->fd);
+    WebService::deleteFromPfdsVecForCGI(worker->fd);
+    close(worker->fd);
+    delete worker;
+    Metrics::addGauge("cgi_pool_workers", -1);
+}
+
+bool CGIPool::sendRequest(CGIWorker *worker, const std::string &message, int stdin_fd, int stdout_fd)
+{
+    int fds[2] = {stdin_fd, stdout_fd};
+    char control[CMSG_SPACE(sizeof(fds))];
+    std::memset(control, 0, sizeof(control));
+    struct iovec iov;
+    iov.iov_base = const_cast<char *>(message.data());
+    iov.iov_len = message.size();
+    struct msghdr msg;
+    std::memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    std::memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    if (sendmsg(worker->fd, &msg, MSG_NOSIGNAL) == -1)
+    {
+        DEBUG_MSG_1("CGI pool sendmsg failed", strerror(errno));
+        return false;
+    }
+    return true;
+}
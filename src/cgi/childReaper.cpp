@@ -0,0 +1,140 @@
+#include "../../include/childReaper.hpp"
+#include "../../include/cgi.hpp"
+#include "../../include/webService.hpp"
+#include "../../include/metrics.hpp"
+#include "../../include/debug.hpp"
+#include <sys/signalfd.h>
+#include <signal.h>
+#include <poll.h>
+
+std::map<int, pid_t> ChildReaper::pidfds;
+std::map<pid_t, int> ChildReaper::children;
+int ChildReaper::signal_fd = -1;
+time_t ChildReaper::last_sweep = 0;
+
+// Probes pidfd_open once. Without it SIGCHLD is blocked and read from a signalfd, which has to happen
+// before the file I/O threads start so that they inherit the mask and never take the signal
+void ChildReaper::start()
+{
+    int probe = syscall(SYS_pidfd_open, getpid(), 0);
+    if (probe != -1)
+    {
+        close(probe);
+        return;
+    }
+    DEBUG_MSG_1("pidfd_open unavailable, reaping children with a signalfd", strerror(errno));
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+    signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (signal_fd == -1)
+    {
+        // the once-a-second sweep in maintain() still reaps everything
+        DEBUG_MSG_1("signalfd failed", strerror(errno));
+        return;
+    }
+    WebService::addToPfdsVector(signal_fd, true);
+}
+
+// the fds themselves are in pfds_vec and closed with it
+void ChildReaper::stop()
+{
+    pidfds.clear();
+    children.clear();
+    signal_fd = -1;
+}
+
+// Called by the parent right after fork(). A child that already exited is fine: its pidfd is
+// readable from the start
+void ChildReaper::watch(pid_t pid)
+{
+    int pidfd = -1;
+    if (signal_fd == -1)
+        pidfd = syscall(SYS_pidfd_open, pid, 0);
+    children[pid] = pidfd;
+    if (pidfd == -1)
+        return;
+    pidfds[pidfd] = pid;
+    WebService::addToPfdsVector(pidfd, true);
+}
+
+bool ChildReaper::ownsFd(int fd)
+{
+    return fd == signal_fd || pidfds.find(fd) != pidfds.end();
+}
+
+void ChildReaper::handleEvent(int fd)
+{
+    if (fd == signal_fd)
+    {
+        // SIGCHLDs coalesce, one read says "some children exited", not which or how many
+        struct signalfd_siginfo info;
+        while (read(signal_fd, &info, sizeof(info)) == sizeof(info))
+            ;
+        reapAll();
+        return;
+    }
+    std::map<int, pid_t>::iterator it = pidfds.find(fd);
+    if (it == pidfds.end())
+        return;
+    pid_t pid = it->second;
+    int status = 0;
+    pid_t result = waitpid(pid, &status, WNOHANG);
+    if (result == pid)
+        reaped(pid, status);
+    else if (result == -1 && errno == ECHILD)
+        unwatch(pid); // collected elsewhere, only the pidfd is left
+}
+
+// Once a second: children the pidfds can't report. The pool makes the server a subreaper, so scripts
+// whose worker died, and anything those scripts left running, end up as its children
+void ChildReaper::maintain()
+{
+    time_t now = time(NULL);
+    if (now == last_sweep)
+        return;
+    last_sweep = now;
+    reapAll();
+}
+
+// in the child between fork and execve: the script must not start with SIGCHLD blocked
+void ChildReaper::prepareChild()
+{
+    if (signal_fd == -1)
+        return;
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_UNBLOCK, &mask, NULL);
+}
+
+void ChildReaper::unwatch(pid_t pid)
+{
+    std::map<pid_t, int>::iterator it = children.find(pid);
+    if (it == children.end())
+        return;
+    if (it->second != -1)
+    {
+        pidfds.erase(it->second);
+        WebService::deleteFromPfdsVecForCGI(it->second);
+        close(it->second);
+    }
+    children.erase(it);
+}
+
+void ChildReaper::reapAll()
+{
+    int status;
+    pid_t pid;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+        reaped(pid, status);
+}
+
+void ChildReaper::reaped(pid_t pid, int status)
+{
+    unwatch(pid);
+    Metrics::increment("cgi_children_reaped_total");
+    DEBUG_MSG_2("Reaped child", pid);
+    CGI::processExited(pid, status);
+}
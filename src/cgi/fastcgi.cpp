@@ -0,0 +1,622 @@
+#include "../../include/fastcgi.hpp"
+#include "../../include/cgi.hpp"
+#include "../../include/webService.hpp"
+#include "../../include/responseHandler.hpp"
+#include "../../include/metrics.hpp"
+#include "../../include/debug.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <cstdlib>
+#include <climits>
+#include <sstream>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+std::map<std::string, FastCGIBackend *> FastCGI::backends;
+std::map<int, FastCGIConnection *> FastCGI::connections;
+size_t FastCGI::next_backend = 0;
+
+static double secondsSince(const struct timespec &start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+// "unix:/run/app.sock" or "127.0.0.1:9000" (numeric, resolving would block the loop)
+bool FastCGI::parseAddress(const std::string &address, struct sockaddr_storage &addr, socklen_t &addr_len)
+{
+    std::memset(&addr, 0, sizeof(addr));
+    if (address.compare(0, 5, "unix:") == 0)
+    {
+        std::string path = address.substr(5);
+        struct sockaddr_un *unix_addr = reinterpret_cast<struct sockaddr_un *>(&addr);
+        if (path.empty() || path.size() >= sizeof(unix_addr->sun_path))
+            return false;
+        unix_addr->sun_family = AF_UNIX;
+        std::memcpy(unix_addr->sun_path, path.c_str(), path.size() + 1);
+        addr_len = sizeof(struct sockaddr_un);
+        return true;
+    }
+    size_t colon = address.rfind(':');
+    if (colon == std::string::npos)
+        return false;
+    std::string port = address.substr(colon + 1);
+    char *end;
+    long port_number = std::strtol(port.c_str(), &end, 10);
+    struct sockaddr_in *inet_addr = reinterpret_cast<struct sockaddr_in *>(&addr);
+    if (port.empty() || *end != '\0' || port_number <= 0 || port_number > 65535 ||
+        inet_pton(AF_INET, address.substr(0, colon).c_str(), &inet_addr->sin_addr) != 1)
+        return false;
+    inet_addr->sin_family = AF_INET;
+    inet_addr->sin_port = htons(static_cast<unsigned short>(port_number));
+    addr_len = sizeof(struct sockaddr_in);
+    return true;
+}
+
+// Takes over the response (deleted once sent) and the client fd, which leaves the poll set until then
+void FastCGI::handleRequest(int fd, Server &server, const HttpRequest &request, HttpResponse &response)
+{
+    const Route &route = *request.route;
+    response.is_cgi_response = true;
+    FastCGIRequest *job = new FastCGIRequest;
+    job->client_fd = fd;
+    job->server = &server;
+    job->response = &response;
+    job->client_request = new HttpRequest(request);
+    job->client_request->raw_request.clear();
+    job->client_request->body.clear();
+    job->backend = NULL;
+    job->deadline = time(NULL) + route.fastcgi_timeout;
+    clock_gettime(CLOCK_MONOTONIC, &job->started);
+    Metrics::increment("fastcgi_requests_total");
+    WebService::deleteFromPfdsVecForCGI(fd);
+
+    if (route.methods.find(request.method) == route.methods.end())
+    {
+        finish(job, 405);
+        return;
+    }
+    // "<location>/<script>.py/extra" -> script and PATH_INFO; without ".py" the rest names the script
+    std::string rest = request.uri.size() > route.uri.size() ? request.uri.substr(route.uri.size()) : "";
+    size_t script_end = rest.find(".py");
+    script_end = (script_end == std::string::npos) ? rest.size() : script_end + 3;
+    std::string script = rest.substr(0, script_end);
+    std::string path_info = rest.substr(script_end);
+    if (script.empty() || script.find("..") != std::string::npos || (!path_info.empty() && path_info[0] != '/'))
+    {
+        finish(job, 404);
+        return;
+    }
+    job->records = encodeRequest(server, request, script, path_info);
+    job->backend = selectBackend(route.fastcgi_pass, route.fastcgi_max_conns);
+    dispatch(job);
+}
+
+bool FastCGI::ownsFd(int fd)
+{
+    return connections.find(fd) != connections.end();
+}
+
+void FastCGI::handleEvent(int fd, short revents)
+{
+    std::map<int, FastCGIConnection *>::iterator it = connections.find(fd);
+    if (it == connections.end())
+        return;
+    FastCGIConnection *connection = it->second;
+    if (connection->connecting)
+    {
+        if (!(revents & (POLLOUT | POLLERR | POLLHUP)))
+            return;
+        int error = 0;
+        socklen_t length = sizeof(error);
+        if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length) == -1 || error != 0)
+        {
+            DEBUG_MSG_1("FastCGI connect failed", connection->backend->address + ": " + strerror(error));
+            Metrics::increment("fastcgi_connect_errors_total");
+            failConnection(connection);
+            return;
+        }
+        connection->connecting = false;
+    }
+    if ((revents & POLLOUT) && !flush(connection))
+    {
+        failConnection(connection);
+        return;
+    }
+    if (revents & (POLLIN | POLLHUP | POLLERR))
+        readRecords(connection);
+}
+
+// 504 for requests past their deadline (in flight or still queued), closes connections idle too long
+void FastCGI::checkTimeouts()
+{
+    if (connections.empty())
+        return;
+    time_t now = time(NULL);
+    std::vector<int> expired;
+    for (std::map<int, FastCGIConnection *>::iterator it = connections.begin(); it != connections.end(); ++it)
+    {
+        FastCGIConnection *connection = it->second;
+        if (connection->active ? now > connection->active->deadline : now - connection->idle_since > FASTCGI_IDLE_TIMEOUT)
+            expired.push_back(it->first);
+    }
+    // looked up again each time: answering one request can hand queued ones to other connections
+    for (size_t n = 0; n < expired.size(); ++n)
+    {
+        std::map<int, FastCGIConnection *>::iterator it = connections.find(expired[n]);
+        if (it == connections.end())
+            continue;
+        FastCGIConnection *connection = it->second;
+        FastCGIBackend *backend = connection->backend;
+        FastCGIRequest *request = connection->active;
+        if (request && now <= request->deadline)
+            continue;
+        if (!request && now - connection->idle_since <= FASTCGI_IDLE_TIMEOUT)
+            continue;
+        connection->active = NULL;
+        dropConnection(connection);
+        if (request)
+        {
+            DEBUG_MSG_1("FastCGI request timed out", backend->address);
+            Metrics::increment("fastcgi_timeouts_total");
+            finish(request, 504);
+        }
+        pump(backend);
+    }
+    for (std::map<std::string, FastCGIBackend *>::iterator it = backends.begin(); it != backends.end(); ++it)
+    {
+        std::deque<FastCGIRequest *> &waiting = it->second->waiting;
+        for (size_t n = 0; n < waiting.size();)
+        {
+            if (now <= waiting[n]->deadline)
+            {
+                ++n;
+                continue;
+            }
+            FastCGIRequest *request = waiting[n];
+            waiting.erase(waiting.begin() + n);
+            Metrics::addGauge("fastcgi_queue_depth", -1);
+            Metrics::increment("fastcgi_timeouts_total");
+            finish(request, 504);
+        }
+    }
+}
+
+// least loaded of the location's backends; the rotating start spreads ties
+FastCGIBackend *FastCGI::selectBackend(const std::vector<std::string> &addresses, size_t max_conns)
+{
+    FastCGIBackend *best = NULL;
+    size_t best_load = 0;
+    for (size_t n = 0; n < addresses.size(); ++n)
+    {
+        const std::string &address = addresses[(next_backend + n) % addresses.size()];
+        FastCGIBackend *&backend = backends[address];
+        if (backend == NULL)
+        {
+            backend = new FastCGIBackend;
+            backend->address = address;
+            parseAddress(address, backend->addr, backend->addr_len); // validated by the config parser
+            backend->max_conns = max_conns;
+        }
+        size_t load = backend->waiting.size();
+        for (size_t c = 0; c < backend->connections.size(); ++c)
+            load += (backend->connections[c]->active != NULL);
+        if (best == NULL || load < best_load)
+        {
+            best = backend;
+            best_load = load;
+        }
+    }
+    next_backend++;
+    return best;
+}
+
+// idle connection, else a new one while under max_conns, else the backend's queue
+void FastCGI::dispatch(FastCGIRequest *request)
+{
+    FastCGIBackend *backend = request->backend;
+    for (size_t c = 0; c < backend->connections.size(); ++c)
+    {
+        if (backend->connections[c]->active == NULL)
+        {
+            Metrics::increment("fastcgi_connections_reused_total");
+            assign(backend->connections[c], request);
+            return;
+        }
+    }
+    if (backend->connections.size() < backend->max_conns)
+    {
+        FastCGIConnection *connection = openConnection(backend);
+        if (connection == NULL)
+        {
+            Metrics::increment("fastcgi_errors_total");
+            finish(request, 502);
+            return;
+        }
+        assign(connection, request);
+        return;
+    }
+    if (backend->waiting.size() >= FASTCGI_QUEUE_MAX)
+    {
+        Metrics::increment("fastcgi_queue_full_total");
+        finish(request, 503);
+        return;
+    }
+    backend->waiting.push_back(request);
+    Metrics::addGauge("fastcgi_queue_depth", 1);
+}
+
+// hands queued requests to connections that became free or to new ones while there is room
+void FastCGI::pump(FastCGIBackend *backend)
+{
+    while (!backend->waiting.empty())
+    {
+        bool idle = false;
+        for (size_t c = 0; c < backend->connections.size() && !idle; ++c)
+            idle = (backend->connections[c]->active == NULL);
+        if (!idle && backend->connections.size() >= backend->max_conns)
+            return;
+        FastCGIRequest *request = backend->waiting.front();
+        backend->waiting.pop_front();
+        Metrics::addGauge("fastcgi_queue_depth", -1);
+        dispatch(request);
+    }
+}
+
+FastCGIConnection *FastCGI::openConnection(FastCGIBackend *backend)
+{
+    int fd = socket(backend->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+    {
+        DEBUG_MSG_1("FastCGI socket failed", strerror(errno));
+        return NULL;
+    }
+    bool connecting = false;
+    if (connect(fd, reinterpret_cast<struct sockaddr *>(&backend->addr), backend->addr_len) == -1)
+    {
+        if (errno != EINPROGRESS)
+        {
+            DEBUG_MSG_1("FastCGI connect failed", backend->address + ": " + strerror(errno));
+            Metrics::increment("fastcgi_connect_errors_total");
+            close(fd);
+            return NULL;
+        }
+        connecting = true;
+    }
+    FastCGIConnection *connection = new FastCGIConnection;
+    connection->fd = fd;
+    connection->backend = backend;
+    connection->connecting = connecting;
+    connection->active = NULL;
+    connection->out_offset = 0;
+    connection->served = 0;
+    connection->idle_since = time(NULL);
+    backend->connections.push_back(connection);
+    connections[fd] = connection;
+    WebService::addToPfdsVector(fd, true);
+    Metrics::increment("fastcgi_connections_opened_total");
+    Metrics::addGauge("fastcgi_connections", 1);
+    DEBUG_MSG("FastCGI connection opened", backend->address);
+    return connection;
+}
+
+void FastCGI::assign(FastCGIConnection *connection, FastCGIRequest *request)
+{
+    connection->active = request;
+    connection->out = request->records; // a copy: flush() drops it once sent, a retry needs it again
+    connection->out_offset = 0;
+    connection->in.clear();
+    if (connection->connecting)
+        WebService::setPollfdEvents(connection->fd, POLLIN | POLLOUT);
+    else if (!flush(connection))
+        failConnection(connection);
+}
+
+// sends what the socket takes; POLLOUT stays requested while records are left. False on a write error
+bool FastCGI::flush(FastCGIConnection *connection)
+{
+    while (connection->out_offset < connection->out.size())
+    {
+        ssize_t sent = send(connection->fd, connection->out.data() + connection->out_offset,
+                            connection->out.size() - connection->out_offset, MSG_NOSIGNAL);
+        if (sent == -1 && errno == EINTR)
+            continue;
+        if (sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (sent == -1)
+        {
+            DEBUG_MSG_1("FastCGI send failed", strerror(errno));
+            return false;
+        }
+        connection->out_offset += sent;
+    }
+    bool pending = connection->out_offset < connection->out.size();
+    if (!pending)
+    {
+        connection->out.clear();
+        connection->out_offset = 0;
+    }
+    WebService::setPollfdEvents(connection->fd, pending ? POLLIN | POLLOUT : POLLIN);
+    return true;
+}
+
+void FastCGI::readRecords(FastCGIConnection *connection)
+{
+    char buffer[FASTCGI_READ_SIZE];
+    bool closed = false;
+    while (true)
+    {
+        ssize_t count = recv(connection->fd, buffer, sizeof(buffer), 0);
+        if (count > 0)
+        {
+            connection->in.append(buffer, count);
+            if (static_cast<size_t>(count) < sizeof(buffer))
+                break;
+        }
+        else if (count == -1 && errno == EINTR)
+            continue;
+        else if (count == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        else
+        {
+            closed = true;
+            break;
+        }
+    }
+    // a backend without keep-alive sends END_REQUEST and closes, so the records come first
+    if (!processRecords(connection))
+        return;
+    if (closed)
+        failConnection(connection);
+    else if (connection->active == NULL)
+        pump(connection->backend);
+}
+
+// Consumes the complete records in the input buffer. Returns false if the connection was dropped
+bool FastCGI::processRecords(FastCGIConnection *connection)
+{
+    size_t offset = 0;
+    while (connection->in.size() - offset >= FASTCGI_HEADER_LEN)
+    {
+        const unsigned char *header = reinterpret_cast<const unsigned char *>(connection->in.data() + offset);
+        size_t content_length = (header[4] << 8) | header[5];
+        size_t record_length = FASTCGI_HEADER_LEN + content_length + header[6];
+        if (connection->in.size() - offset < record_length)
+            break;
+        const char *content = connection->in.data() + offset + FASTCGI_HEADER_LEN;
+        int type = header[1];
+        int id = (header[2] << 8) | header[3];
+        offset += record_length;
+
+        FastCGIRequest *request = connection->active;
+        if (header[0] != 1)
+        {
+            DEBUG_MSG_1("FastCGI protocol error, version", static_cast<int>(header[0]));
+            failConnection(connection);
+            return false;
+        }
+        if (request == NULL || id != FASTCGI_REQUEST_ID)
+            continue; // management records, or leftovers of a request we gave up on
+        if (type == FCGI_STDOUT)
+        {
+            request->output.append(content, content_length);
+            if (request->output.size() > MAX_CGI_BODY_SIZE)
+            {
+                DEBUG_MSG_1("FastCGI response too large", request->output.size());
+                failConnection(connection);
+                return false;
+            }
+        }
+        else if (type == FCGI_STDERR)
+            DEBUG_MSG("FastCGI stderr", std::string(content, content_length));
+        else if (type == FCGI_END_REQUEST)
+        {
+            connection->active = NULL;
+            connection->served++;
+            connection->idle_since = time(NULL);
+            connection->in.clear();
+            finish(request, 0);
+            return true;
+        }
+    }
+    connection->in.erase(0, offset);
+    return true;
+}
+
+// The connection broke (or can't be used): its request gets a 502, unless this was a reused
+// keep-alive connection the backend closed before answering, then the request goes out again
+void FastCGI::failConnection(FastCGIConnection *connection)
+{
+    FastCGIRequest *request = connection->active;
+    FastCGIBackend *backend = connection->backend;
+    bool retry = request != NULL && connection->served > 0 && request->output.empty();
+    connection->active = NULL;
+    dropConnection(connection);
+    if (retry)
+    {
+        DEBUG_MSG("FastCGI keep-alive connection closed by backend, retrying", backend->address);
+        dispatch(request);
+    }
+    else if (request)
+    {
+        Metrics::increment("fastcgi_errors_total");
+        finish(request, 502);
+    }
+    pump(backend);
+}
+
+void FastCGI::dropConnection(FastCGIConnection *connection)
+{
+    std::vector<FastCGIConnection *> &pool = connection->backend->connections;
+    pool.erase(std::find(pool.begin(), pool.end(), connection));
+    connections.erase(connection->fd);
+    WebService::deleteFromPfdsVecForCGI(connection->fd);
+    close(connection->fd);
+    delete connection;
+    Metrics::addGauge("fastcgi_connections", -1);
+}
+
+// status 0: the backend answered and its output is the response, otherwise an error status.
+// Error statuses from the application keep its body and only get the server's error page when
+// it sent none (nginx's fastcgi_intercept_errors off)
+void FastCGI::finish(FastCGIRequest *request, int status)
+{
+    HttpResponse &response = *request->response;
+    std::string local_redirect;
+    if (status == 0)
+        applyOutput(request->output, *request->client_request, response, local_redirect);
+    else
+        response.status_code = status;
+    Metrics::observe("fastcgi_request_seconds", secondsSince(request->started));
+
+    if (!local_redirect.empty())
+        WebService::redirectInternally(request->client_fd, *request->server, *request->client_request, local_redirect);
+    else
+    {
+        response.close_connection = true;
+        ResponseHandler::responseBuilder(response);
+        WebService::addToPfdsVector(request->client_fd, false);
+        size_t i = 0;
+        if (WebService::queueResponse(request->client_fd, response))
+            WebService::closeConnection(request->client_fd, i, *request->server);
+    }
+    delete request->client_request;
+    delete request->response;
+    delete request;
+}
+
+// CGI style output, parsed like a script's (CGI::parseResponseHead). A local Location is returned in
+// local_redirect instead of becoming the response, X-Sendfile replaces the body with the named file.
+// Output without a header block is plain text
+void FastCGI::applyOutput(const std::string &output, const HttpRequest &client_request, HttpResponse &response,
+                          std::string &local_redirect)
+{
+    size_t header_end = 0;
+    size_t body_start = 0;
+    if (CGI::findResponseHead(output, header_end, body_start) != CGI_HEAD_COMPLETE)
+    {
+        response.status_code = 200;
+        response.body = output;
+        response.setHeader("Content-Type", "text/plain");
+        return;
+    }
+    CGIResponseHead head;
+    CGI::parseResponseHead(output.substr(0, header_end), head);
+    if (CGI::isLocalRedirect(head))
+    {
+        local_redirect = head.location;
+        return;
+    }
+    CGI::applyResponseHead(head, response);
+    if (CGI::sendsFile(head, response))
+    {
+        ResponseHandler::deliverInternalFile(client_request, response, head.sendfile);
+        return;
+    }
+    // the body is complete here, Content-Length is recomputed for it (possibly compressed)
+    if (head.status != -1)
+    {
+        response.body = output.substr(body_start);
+        if (head.content_length >= 0 && (size_t)head.content_length < response.body.size())
+            response.body.resize(head.content_length);
+        response.keep_body = !response.body.empty();
+    }
+}
+
+std::string FastCGI::encodeRequest(const Server &server, const HttpRequest &request, const std::string &script,
+                                   const std::string &path_info)
+{
+    const Route &route = *request.route;
+    std::string root = route.fastcgi_root.empty() ? route.path : route.fastcgi_root;
+    char cwd[PATH_MAX];
+    if (root[0] != '/' && getcwd(cwd, sizeof(cwd)) != NULL)
+        root = std::string(cwd) + "/" + root;
+    if (root[root.size() - 1] != '/')
+        root += "/";
+    std::ostringstream content_length;
+    content_length << request.body.size();
+
+    std::string params;
+    appendParam(params, "GATEWAY_INTERFACE", "CGI/1.1");
+    appendParam(params, "SERVER_SOFTWARE", SERVER_SOFTWARE);
+    appendParam(params, "SERVER_PROTOCOL", request.version);
+    appendParam(params, "SERVER_NAME", server.getName());
+    appendParam(params, "SERVER_PORT", server.getPort());
+    appendParam(params, "REQUEST_METHOD", request.method);
+    appendParam(params, "REQUEST_URI", request.queryString.empty() ? request.uri : request.uri + "?" + request.queryString);
+    appendParam(params, "QUERY_STRING", request.queryString);
+    appendParam(params, "SCRIPT_NAME", route.uri + script);
+    appendParam(params, "SCRIPT_FILENAME", root + script);
+    appendParam(params, "PATH_INFO", path_info);
+    appendParam(params, "CONTENT_LENGTH", content_length.str());
+    for (std::map<std::string, std::string>::const_iterator it = request.headers.begin(); it != request.headers.end(); ++it)
+    {
+        if (strcasecmp(it->first.c_str(), "Content-Type") == 0)
+        {
+            appendParam(params, "CONTENT_TYPE", it->second);
+            continue;
+        }
+        if (strcasecmp(it->first.c_str(), "Content-Length") == 0)
+            continue;
+        std::string name = "HTTP_";
+        for (size_t c = 0; c < it->first.size(); ++c)
+            name += it->first[c] == '-' ? '_' : static_cast<char>(std::toupper(static_cast<unsigned char>(it->first[c])));
+        appendParam(params, name, it->second);
+    }
+
+    // role FCGI_RESPONDER, flags FCGI_KEEP_CONN
+    static const char begin[8] = {0, 1, 1, 0, 0, 0, 0, 0};
+    std::string records;
+    records.reserve(params.size() + request.body.size() + 64);
+    appendRecord(records, FCGI_BEGIN_REQUEST, begin, sizeof(begin));
+    appendRecord(records, FCGI_PARAMS, params.data(), params.size());
+    appendRecord(records, FCGI_PARAMS, NULL, 0);
+    if (!request.body.empty())
+        appendRecord(records, FCGI_STDIN, request.body.data(), request.body.size());
+    appendRecord(records, FCGI_STDIN, NULL, 0);
+    return records;
+}
+
+// one record per FASTCGI_MAX_CONTENT bytes, padded to 8 bytes; length 0 writes the empty stream terminator
+void FastCGI::appendRecord(std::string &out, FastCGIRecordType type, const char *data, size_t length)
+{
+    do
+    {
+        size_t chunk = std::min(length, static_cast<size_t>(FASTCGI_MAX_CONTENT));
+        size_t padding = (8 - chunk % 8) % 8;
+        char header[FASTCGI_HEADER_LEN] = {1, static_cast<char>(type), 0, FASTCGI_REQUEST_ID,
+                                           static_cast<char>(chunk >> 8), static_cast<char>(chunk & 0xff),
+                                           static_cast<char>(padding), 0};
+        out.append(header, sizeof(header));
+        out.append(data, chunk);
+        out.append(padding, '\0');
+        data += chunk;
+        length -= chunk;
+    } while (length > 0);
+}
+
+// name-value pair: lengths below 128 take one byte, longer ones four with the top bit set
+void FastCGI::appendParam(std::string &params, const std::string &name, const std::string &value)
+{
+    const std::string *parts[2] = {&name, &value};
+    for (int n = 0; n < 2; ++n)
+    {
+        size_t length = parts[n]->size();
+        if (length < 128)
+            params += static_cast<char>(length);
+        else
+        {
+            params += static_cast<char>((length >> 24) | 0x80);
+            params += static_cast<char>(length >> 16);
+            params += static_cast<char>(length >> 8);
+            params += static_cast<char>(length);
+        }
+    }
+    params += name;
+    params += value;
+}
@@ -0,0 +1,188 @@
+#include "../../include/atomicFile.hpp"
+#include "../../include/debug.hpp"
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#ifndef RENAME_NOREPLACE
+#define RENAME_NOREPLACE (1 << 0)
+#endif
+
+static std::string directoryOf(const std::string &path)
+{
+    std::string::size_type slash = path.find_last_of('/');
+    if (slash == std::string::npos)
+        return ".";
+    if (slash == 0)
+        return "/";
+    return path.substr(0, slash);
+}
+
+AtomicFile::AtomicFile() : file_fd(-1), policy(FSYNC_NONE) {}
+
+AtomicFile::~AtomicFile()
+{
+    discard();
+}
+
+bool AtomicFile::parseFsyncPolicy(const std::string &value, FsyncPolicy &policy)
+{
+    if (value == "none")
+        policy = FSYNC_NONE;
+    else if (value == "data")
+        policy = FSYNC_DATA;
+    else if (value == "full")
+        policy = FSYNC_FULL;
+    else
+        return false;
+    return true;
+}
+
+// creates the (still nameless) file in the directory of final_path
+bool AtomicFile::open(const std::string &final_path, FsyncPolicy policy)
+{
+    discard();
+    this->final_path = final_path;
+    this->policy = policy;
+    std::string directory = directoryOf(final_path);
+
+    file_fd = ::open(directory.c_str(), O_TMPFILE | O_WRONLY | O_CLOEXEC, ATOMIC_FILE_MODE);
+    if (file_fd != -1)
+        return true;
+    DEBUG_MSG("O_TMPFILE unavailable, using a temp name", strerror(errno));
+
+    std::string pattern = directory + "/" ATOMIC_TEMP_PREFIX "XXXXXX";
+    std::vector<char> name(pattern.begin(), pattern.end());
+    name.push_back('\0');
+    file_fd = mkostemp(&name[0], O_CLOEXEC);
+    if (file_fd == -1)
+    {
+        DEBUG_MSG_1("Can't create upload temp file", strerror(errno));
+        return false;
+    }
+    temp_path = &name[0];
+    fchmod(file_fd, ATOMIC_FILE_MODE);
+    return true;
+}
+
+bool AtomicFile::write(const char *data, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t written = ::write(file_fd, data, length);
+        if (written == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            DEBUG_MSG_1("Upload write failed", strerror(errno));
+            return false;
+        }
+        data += written;
+        length -= written;
+    }
+    return true;
+}
+
+// syncs according to the policy and gives the file its final name, failing if that name exists
+PublishResult AtomicFile::publish()
+{
+    if (file_fd == -1 || !syncFile())
+        return PUBLISH_ERROR;
+    PublishResult result = temp_path.empty() ? linkTmpFile() : renameTempFile();
+    if (result == PUBLISH_OK && policy == FSYNC_FULL && !syncDirectory())
+        result = PUBLISH_ERROR;
+    discard();
+    return result;
+}
+
+// closes and removes whatever was not published
+void AtomicFile::discard()
+{
+    if (file_fd != -1)
+        close(file_fd);
+    file_fd = -1;
+    if (!temp_path.empty())
+        unlink(temp_path.c_str());
+    temp_path.clear();
+}
+
+int AtomicFile::fd() const
+{
+    return file_fd;
+}
+
+bool AtomicFile::syncFile()
+{
+    int result = 0;
+    if (policy == FSYNC_DATA)
+        result = fdatasync(file_fd);
+    else if (policy == FSYNC_FULL)
+        result = fsync(file_fd);
+    if (result == -1)
+        DEBUG_MSG_1("Upload fsync failed", strerror(errno));
+    return result == 0;
+}
+
+// makes the new directory entry itself durable
+bool AtomicFile::syncDirectory()
+{
+    return syncDirectoryOf(final_path);
+}
+
+// fsyncs the directory holding path, for names created outside publish() (e.g. extra hard links)
+bool AtomicFile::syncDirectoryOf(const std::string &path)
+{
+    int dir_fd = ::open(directoryOf(path).c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd == -1)
+        return false;
+    int result = fsync(dir_fd);
+    close(dir_fd);
+    return result == 0;
+}
+
+// linkat never replaces an existing name, EEXIST is the conflict.
+// AT_EMPTY_PATH needs CAP_DAC_READ_SEARCH, the /proc path works for everyone else
+PublishResult AtomicFile::linkTmpFile()
+{
+    if (linkat(file_fd, "", AT_FDCWD, final_path.c_str(), AT_EMPTY_PATH) == 0)
+        return PUBLISH_OK;
+    if (errno == EEXIST)
+        return PUBLISH_EXISTS;
+    std::ostringstream proc_path;
+    proc_path << "/proc/self/fd/" << file_fd;
+    if (linkat(AT_FDCWD, proc_path.str().c_str(), AT_FDCWD, final_path.c_str(), AT_SYMLINK_FOLLOW) == 0)
+        return PUBLISH_OK;
+    if (errno == EEXIST)
+        return PUBLISH_EXISTS;
+    DEBUG_MSG_1("linkat of upload failed", strerror(errno));
+    return PUBLISH_ERROR;
+}
+
+PublishResult AtomicFile::renameTempFile()
+{
+    if (syscall(SYS_renameat2, AT_FDCWD, temp_path.c_str(), AT_FDCWD, final_path.c_str(), RENAME_NOREPLACE) == 0)
+    {
+        temp_path.clear();
+        return PUBLISH_OK;
+    }
+    if (errno == EEXIST)
+        return PUBLISH_EXISTS;
+    if (errno != EINVAL && errno != ENOSYS)
+    {
+        DEBUG_MSG_1("renameat2 of upload failed", strerror(errno));
+        return PUBLISH_ERROR;
+    }
+    // filesystem without RENAME_NOREPLACE: link() doesn't replace either, then drop the temp name
+    if (link(temp_path.c_str(), final_path.c_str()) != 0)
+        return errno == EEXIST ? PUBLISH_EXISTS : PUBLISH_ERROR;
+    unlink(temp_path.c_str());
+    temp_path.clear();
+    return PUBLISH_OK;
+}
@@ -0,0 +1,118 @@
+#include "../../include/contentStore.hpp"
+#include "../../include/sha256.hpp"
+#include "../../include/metrics.hpp"
+#include "../../include/debug.hpp"
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+#include <ctime>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+
+// Hashes the body, then links the matching object to final_path, writing the object first only if
+// this content has not been seen before. PUBLISH_EXISTS if final_path is already taken
+PublishResult ContentStore::store(const std::string &store_dir, const std::string &final_path, const std::string &body, FsyncPolicy policy)
+{
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    Sha256 sha;
+    for (size_t offset = 0; offset < body.size(); offset += CAS_HASH_CHUNK)
+        sha.update(body.data() + offset, std::min(static_cast<size_t>(CAS_HASH_CHUNK), body.size() - offset));
+    std::string digest = sha.hexDigest();
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    Metrics::observe("dedup_hash_seconds", (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+
+    std::string object = objectPath(store_dir, digest);
+    DEBUG_MSG("Content store object", object);
+    // second round only if release() removed the object between our check and the link
+    for (int attempt = 0; attempt < 2; ++attempt)
+    {
+        bool stored = false;
+        if (access(object.c_str(), F_OK) != 0)
+        {
+            PublishResult result = writeObject(object, digest, body, policy);
+            if (result == PUBLISH_ERROR)
+                return PUBLISH_ERROR;
+            stored = (result == PUBLISH_OK); // PUBLISH_EXISTS: an identical upload stored it first
+        }
+        if (link(object.c_str(), final_path.c_str()) == 0)
+        {
+            if (policy == FSYNC_FULL && !AtomicFile::syncDirectoryOf(final_path))
+                return PUBLISH_ERROR;
+            recordUpload(body.size(), stored);
+            return PUBLISH_OK;
+        }
+        int link_errno = errno;
+        if (stored)
+            unlink(object.c_str());
+        if (link_errno == EEXIST)
+            return PUBLISH_EXISTS;
+        if (link_errno != ENOENT)
+        {
+            DEBUG_MSG_1("Linking upload to content object failed", strerror(link_errno));
+            return PUBLISH_ERROR;
+        }
+    }
+    return PUBLISH_ERROR;
+}
+
+// Call before removing a user-visible name: drops the object if that name is its last link
+void ContentStore::release(const std::string &store_dir, const std::string &path)
+{
+    char digest[SHA256_DIGEST_SIZE * 2 + 1];
+    ssize_t length = getxattr(path.c_str(), CAS_XATTR, digest, sizeof(digest) - 1);
+    if (length != SHA256_DIGEST_SIZE * 2)
+        return; // not from the store (uploaded before dedup was enabled, or no xattr support)
+    digest[length] = '\0';
+
+    struct stat name_stat, object_stat;
+    std::string object = objectPath(store_dir, digest);
+    if (stat(path.c_str(), &name_stat) != 0 || stat(object.c_str(), &object_stat) != 0)
+        return;
+    if (name_stat.st_ino == object_stat.st_ino && name_stat.st_dev == object_stat.st_dev && name_stat.st_nlink <= 2)
+    {
+        DEBUG_MSG("Content store dropping object", object);
+        unlink(object.c_str());
+    }
+}
+
+std::string ContentStore::objectPath(const std::string &store_dir, const std::string &digest)
+{
+    return store_dir + "/" + digest.substr(0, 2) + "/" + digest;
+}
+
+bool ContentStore::ensureDirectory(const std::string &path)
+{
+    if (mkdir(path.c_str(), 0755) == 0 || errno == EEXIST)
+        return true;
+    DEBUG_MSG_1("Can't create content store directory", path + ": " + strerror(errno));
+    return false;
+}
+
+PublishResult ContentStore::writeObject(const std::string &object, const std::string &digest, const std::string &body, FsyncPolicy policy)
+{
+    std::string fan_out_dir = object.substr(0, object.find_last_of('/'));
+    std::string store_dir = fan_out_dir.substr(0, fan_out_dir.find_last_of('/'));
+    if (!ensureDirectory(store_dir) || !ensureDirectory(fan_out_dir))
+        return PUBLISH_ERROR;
+
+    AtomicFile file;
+    if (!file.open(object, policy) || !file.write(body.data(), body.size()))
+        return PUBLISH_ERROR;
+    if (fsetxattr(file.fd(), CAS_XATTR, digest.data(), digest.size(), 0) != 0)
+        DEBUG_MSG("Content store xattr unsupported, objects won't be garbage collected", strerror(errno));
+    return file.publish();
+}
+
+// dedup_ratio = bytes uploaded / bytes actually written to the store
+void ContentStore::recordUpload(size_t bytes, bool stored)
+{
+    Metrics::increment("dedup_uploads_total");
+    Metrics::increment("dedup_logical_bytes_total", bytes);
+    if (stored)
+        Metrics::increment("dedup_stored_bytes_total", bytes);
+    else
+        Metrics::increment("dedup_hits_total");
+    Metrics::setRatio("dedup_ratio", "dedup_logical_bytes_total", "dedup_stored_bytes_total");
+}
@@ -0,0 +1,406 @@
+#include "../../include/directoryListing.hpp"
+#include "../../include/contentStore.hpp"
+#include "../../include/debug.hpp"
+#include <algorithm>
+#include <sstream>
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/syscall.h>
+#include <sys/inotify.h>
+
+pthread_mutex_t DirectoryListing::mutex = PTHREAD_MUTEX_INITIALIZER;
+std::map<std::string, DirectoryListing::CachedDirectory> DirectoryListing::cache;
+std::map<int, std::string> DirectoryListing::watch_to_path;
+int DirectoryListing::inotify_fd = -2; // -2: not initialized yet, -1: inotify unavailable
+unsigned long DirectoryListing::use_counter = 0;
+
+// sort orders for ?sort=size and ?sort=mtime, names break ties so pages are stable
+struct CompareBySize
+{
+    bool operator()(const DirectoryEntry *a, const DirectoryEntry *b) const
+    {
+        return a->size != b->size ? a->size < b->size : a->name < b->name;
+    }
+};
+
+struct CompareByMtime
+{
+    bool operator()(const DirectoryEntry *a, const DirectoryEntry *b) const
+    {
+        return a->mtime != b->mtime ? a->mtime < b->mtime : a->name < b->name;
+    }
+};
+
+struct CompareByName
+{
+    bool operator()(const DirectoryEntry &a, const DirectoryEntry &b) const
+    {
+        return a.name < b.name;
+    }
+};
+
+template <typename Compare>
+struct Reversed
+{
+    Compare compare;
+    bool operator()(const DirectoryEntry *a, const DirectoryEntry *b) const
+    {
+        return compare(b, a);
+    }
+};
+
+// the cache and the inotify state are shared by the file I/O workers, one listing is built at a time
+bool DirectoryListing::render(const HttpRequest &request, HttpResponse &response)
+{
+    ScopedLock lock(mutex);
+    const std::vector<DirectoryEntry> *entries = getEntries(request.path);
+    if (!entries)
+    {
+        response.status_code = 500;
+        response.reason_phrase = "Internal Server Error";
+        return false;
+    }
+
+    std::string sort = queryParam(request.queryString, "sort");
+    if (sort != "size" && sort != "mtime")
+        sort = "name";
+    std::string order = queryParam(request.queryString, "order") == "desc" ? "desc" : "asc";
+    size_t total = entries->size();
+    size_t offset = std::min(static_cast<size_t>(strtoul(queryParam(request.queryString, "offset").c_str(), NULL, 10)), total);
+    std::string limit_str = queryParam(request.queryString, "limit");
+    size_t limit = limit_str.empty() ? DIR_LISTING_DEFAULT_LIMIT : strtoul(limit_str.c_str(), NULL, 10);
+    if (limit == 0 || limit > DIR_LISTING_MAX_LIMIT)
+        limit = DIR_LISTING_MAX_LIMIT;
+    size_t end = std::min(total, offset + limit);
+
+    // only the requested page has to be in order
+    std::vector<const DirectoryEntry *> order_view;
+    order_view.reserve(total);
+    for (size_t i = 0; i < total; ++i)
+        order_view.push_back(&(*entries)[i]);
+    if (sort == "name" && order == "desc")
+        std::reverse(order_view.begin(), order_view.end());
+    else if (sort == "size" && order == "asc")
+        std::partial_sort(order_view.begin(), order_view.begin() + end, order_view.end(), CompareBySize());
+    else if (sort == "size")
+        std::partial_sort(order_view.begin(), order_view.begin() + end, order_view.end(), Reversed<CompareBySize>());
+    else if (sort == "mtime" && order == "asc")
+        std::partial_sort(order_view.begin(), order_view.begin() + end, order_view.end(), CompareByMtime());
+    else if (sort == "mtime")
+        std::partial_sort(order_view.begin(), order_view.begin() + end, order_view.end(), Reversed<CompareByMtime>());
+    std::vector<const DirectoryEntry *> page(order_view.begin() + offset, order_view.begin() + end);
+
+    if (wantsJson(request))
+    {
+        response.body = renderJson(request, page, offset, limit, total);
+        response.setHeader("Content-Type", "application/json");
+    }
+    else
+    {
+        response.body = renderHtml(request, page, offset, limit, total, sort, order);
+        response.setHeader("Content-Type", "text/html");
+    }
+    response.status_code = 200;
+    response.reason_phrase = "OK";
+    std::ostringstream length_ss;
+    length_ss << response.body.length();
+    response.setHeader("Content-Length", length_ss.str());
+    return true;
+}
+
+// returns the cached snapshot of the directory, re-reading it if it changed since it was cached
+const std::vector<DirectoryEntry> *DirectoryListing::getEntries(const std::string &path)
+{
+    processInotifyEvents();
+
+    struct stat dir_stat;
+    if (stat(path.c_str(), &dir_stat) != 0 || !S_ISDIR(dir_stat.st_mode))
+        return NULL;
+
+    std::map<std::string, CachedDirectory>::iterator it = cache.find(path);
+    if (it != cache.end())
+    {
+        CachedDirectory &cached = it->second;
+        if (!cached.stale && cached.device == dir_stat.st_dev && cached.inode == dir_stat.st_ino &&
+            cached.mtime.tv_sec == dir_stat.st_mtim.tv_sec && cached.mtime.tv_nsec == dir_stat.st_mtim.tv_nsec)
+        {
+            DEBUG_MSG("Directory listing cache hit", path);
+            cached.last_used = ++use_counter;
+            return &cached.entries;
+        }
+        DEBUG_MSG("Directory listing cache stale", path);
+    }
+
+    std::vector<DirectoryEntry> entries;
+    if (!readEntries(path, entries))
+        return NULL;
+
+    if (it == cache.end())
+    {
+        if (cache.size() >= DIR_CACHE_MAX_DIRS)
+            evictLeastRecentlyUsed();
+        it = cache.insert(std::make_pair(path, CachedDirectory())).first;
+        it->second.watch = -1;
+        addWatch(path, it->second);
+    }
+    CachedDirectory &cached = it->second;
+    cached.device = dir_stat.st_dev;
+    cached.inode = dir_stat.st_ino;
+    cached.mtime = dir_stat.st_mtim;
+    cached.stale = false;
+    cached.last_used = ++use_counter;
+    cached.entries.swap(entries);
+    return &cached.entries;
+}
+
+// reads the directory in large batches with getdents64 and stats entries relative to the
+// directory fd (fstatat) instead of building and resolving a full path per entry
+bool DirectoryListing::readEntries(const std::string &path, std::vector<DirectoryEntry> &entries)
+{
+    int dir_fd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd == -1)
+    {
+        DEBUG_MSG_1("Cant open directory", strerror(errno));
+        return false;
+    }
+
+    std::vector<char> buffer(GETDENTS_BUFFER_SIZE);
+    while (true)
+    {
+        long bytes = syscall(SYS_getdents64, dir_fd, &buffer[0], buffer.size());
+        if (bytes == -1)
+        {
+            DEBUG_MSG_1("getdents64 failed", strerror(errno));
+            close(dir_fd);
+            return false;
+        }
+        if (bytes == 0)
+            break;
+        for (long position = 0; position < bytes;)
+        {
+            struct dirent64 *record = reinterpret_cast<struct dirent64 *>(&buffer[position]);
+            position += record->d_reclen;
+            if (std::strcmp(record->d_name, ".") == 0 || std::strcmp(record->d_name, "..") == 0)
+                continue;
+            if (std::strcmp(record->d_name, CAS_DIR_NAME) == 0)
+                continue; // dedup object store, its files are reachable under their upload names
+
+            struct stat file_stat;
+            if (fstatat(dir_fd, record->d_name, &file_stat, 0) != 0)
+                continue; // vanished between getdents and stat, or dangling symlink
+            DirectoryEntry entry;
+            entry.name = record->d_name;
+            entry.is_directory = S_ISDIR(file_stat.st_mode);
+            entry.size = file_stat.st_size;
+            entry.mtime = file_stat.st_mtime;
+            entries.push_back(entry);
+        }
+    }
+    close(dir_fd);
+    std::sort(entries.begin(), entries.end(), CompareByName());
+    DEBUG_MSG("Directory entries read", entries.size());
+    return true;
+}
+
+// A directory's mtime only changes when entries are added, removed or renamed. The inotify watch
+// also catches files inside it being written to, so listed sizes and dates stay correct
+void DirectoryListing::addWatch(const std::string &path, CachedDirectory &cached)
+{
+    if (inotify_fd == -2)
+        inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd < 0)
+        return;
+    cached.watch = inotify_add_watch(inotify_fd, path.c_str(),
+                                     IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE |
+                                         IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF);
+    if (cached.watch >= 0)
+        watch_to_path[cached.watch] = path;
+}
+
+void DirectoryListing::processInotifyEvents()
+{
+    if (inotify_fd < 0)
+        return;
+    char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t bytes;
+    while ((bytes = read(inotify_fd, buffer, sizeof(buffer))) > 0)
+    {
+        for (ssize_t position = 0; position < bytes;)
+        {
+            const struct inotify_event *event = reinterpret_cast<const struct inotify_event *>(buffer + position);
+            position += sizeof(struct inotify_event) + event->len;
+            std::map<int, std::string>::iterator watched = watch_to_path.find(event->wd);
+            if (watched == watch_to_path.end())
+                continue;
+            std::map<std::string, CachedDirectory>::iterator it = cache.find(watched->second);
+            if (it != cache.end())
+                it->second.stale = true;
+            if (event->mask & IN_IGNORED)
+            {
+                if (it != cache.end())
+                    it->second.watch = -1;
+                watch_to_path.erase(watched);
+            }
+        }
+    }
+}
+
+void DirectoryListing::evictLeastRecentlyUsed()
+{
+    std::map<std::string, CachedDirectory>::iterator oldest = cache.begin();
+    for (std::map<std::string, CachedDirectory>::iterator it = cache.begin(); it != cache.end(); ++it)
+    {
+        if (it->second.last_used < oldest->second.last_used)
+            oldest = it;
+    }
+    if (oldest == cache.end())
+        return;
+    if (oldest->second.watch >= 0)
+    {
+        inotify_rm_watch(inotify_fd, oldest->second.watch);
+        watch_to_path.erase(oldest->second.watch);
+    }
+    cache.erase(oldest);
+}
+
+std::string DirectoryListing::queryParam(const std::string &query, const std::string &name)
+{
+    std::istringstream stream(query);
+    std::string pair;
+    while (std::getline(stream, pair, '&'))
+    {
+        size_t equals = pair.find('=');
+        if (pair.substr(0, equals) == name)
+            return equals == std::string::npos ? "" : pair.substr(equals + 1);
+    }
+    return "";
+}
+
+bool DirectoryListing::wantsJson(const HttpRequest &request)
+{
+    std::map<std::string, std::string>::const_iterator it = request.headers.find("Accept");
+    return it != request.headers.end() && it->second.find("application/json") != std::string::npos &&
+           it->second.find("text/html") == std::string::npos;
+}
+
+std::string DirectoryListing::htmlEscape(const std::string &text)
+{
+    std::string escaped;
+    for (size_t i = 0; i < text.size(); ++i)
+    {
+        switch (text[i])
+        {
+        case '&': escaped += "&amp;"; break;
+        case '<': escaped += "&lt;"; break;
+        case '>': escaped += "&gt;"; break;
+        case '"': escaped += "&quot;"; break;
+        default: escaped += text[i];
+        }
+    }
+    return escaped;
+}
+
+std::string DirectoryListing::jsonEscape(const std::string &text)
+{
+    std::string escaped;
+    for (size_t i = 0; i < text.size(); ++i)
+    {
+        unsigned char c = text[i];
+        if (c == '"' || c == '\\')
+        {
+            escaped += '\\';
+            escaped += c;
+        }
+        else if (c < 0x20)
+        {
+            char code[8];
+            snprintf(code, sizeof(code), "\\u%04x", c);
+            escaped += code;
+        }
+        else
+            escaped += c;
+    }
+    return escaped;
+}
+
+std::string DirectoryListing::pageLink(const std::string &uri, const std::string &sort, const std::string &order, size_t offset, size_t limit)
+{
+    std::ostringstream link;
+    link << uri << "?sort=" << sort << "&amp;order=" << order << "&amp;offset=" << offset << "&amp;limit=" << limit;
+    return link.str();
+}
+
+std::string DirectoryListing::renderHtml(const HttpRequest &request, const std::vector<const DirectoryEntry *> &page,
+                                         size_t offset, size_t limit, size_t total, const std::string &sort, const std::string &order)
+{
+    std::string current_uri = request.uri;
+    if (current_uri.empty() || current_uri[current_uri.length() - 1] != '/')
+        current_uri += '/';
+    std::string title = htmlEscape(current_uri);
+
+    std::ostringstream html;
+    html << "<html>\n<head>\n"
+            "<title>Index of " << title << "</title>\n"
+            "<style>\n"
+            "body { font-family: Arial, sans-serif; margin: 40px; }\n"
+            "h1 { color: #333; }\n"
+            "a { text-decoration: none; color: #0066cc; }\n"
+            "a:hover { text-decoration: underline; }\n"
+            "</style>\n"
+            "</head>\n"
+            "<body>\n"
+            "<h1>Index of " << title << "</h1>\n"
+            "<hr>\n"
+            "<pre>\n";
+
+    // Add parent directory link if not at root
+    if (current_uri != "/")
+        html << "<a href=\"../\">../</a>\n";
+
+    for (size_t i = 0; i < page.size(); ++i)
+    {
+        const DirectoryEntry &entry = *page[i];
+        std::string display_name = entry.is_directory ? entry.name + "/" : entry.name;
+        std::string escaped_name = htmlEscape(display_name);
+        html << "<a href=\"" << htmlEscape(current_uri) << escaped_name << "\">" << escaped_name << "</a>";
+        // pad to a column, long names just get a single separating space
+        html << std::string(display_name.length() < 50 ? 50 - display_name.length() : 1, ' ');
+        html << entry.size << " bytes\n";
+    }
+    html << "</pre>\n<hr>\n";
+
+    if (offset > 0 || offset + page.size() < total)
+    {
+        html << "<p>Entries " << (page.empty() ? offset : offset + 1) << "-" << offset + page.size() << " of " << total;
+        if (offset > 0)
+            html << " <a href=\"" << pageLink(current_uri, sort, order, offset > limit ? offset - limit : 0, limit) << "\">previous</a>";
+        if (offset + page.size() < total)
+            html << " <a href=\"" << pageLink(current_uri, sort, order, offset + page.size(), limit) << "\">next</a>";
+        html << "</p>\n";
+    }
+    html << "</body>\n</html>";
+    return html.str();
+}
+
+std::string DirectoryListing::renderJson(const HttpRequest &request, const std::vector<const DirectoryEntry *> &page,
+                                         size_t offset, size_t limit, size_t total)
+{
+    std::ostringstream json;
+    json << "{\"path\":\"" << jsonEscape(request.uri) << "\",\"total\":" << total << ",\"offset\":" << offset
+         << ",\"limit\":" << limit << ",\"entries\":[";
+    for (size_t i = 0; i < page.size(); ++i)
+    {
+        const DirectoryEntry &entry = *page[i];
+        if (i > 0)
+            json << ",";
+        json << "{\"name\":\"" << jsonEscape(entry.name) << "\",\"type\":\"" << (entry.is_directory ? "directory" : "file")
+             << "\",\"size\":" << entry.size << ",\"mtime\":" << entry.mtime << "}";
+    }
+    json << "]}";
+    return json.str();
+}
@@ -0,0 +1,111 @@
+#include "../../include/gzipEncoder.hpp"
+#include "../../include/debug.hpp"
+#include <cstring>
+
+GzipEncoder::GzipEncoder() : initialized(false), finished(false)
+{
+    std::memset(&stream, 0, sizeof(stream));
+}
+
+GzipEncoder::~GzipEncoder()
+{
+    if (initialized)
+        deflateEnd(&stream);
+}
+
+// zlib needs (1 << (window_bits + 2)) + (1 << (mem_level + 9)) bytes for deflate.
+// Shrink window and hash table alternately until that fits into max_memory (smallest: 9 / 1)
+void GzipEncoder::chooseMemoryParameters(size_t max_memory, int &window_bits, int &mem_level)
+{
+    window_bits = 15;
+    mem_level = 8;
+    while (((size_t)1 << (window_bits + 2)) + ((size_t)1 << (mem_level + 9)) > max_memory)
+    {
+        if (window_bits > 9 && window_bits - 7 >= mem_level)
+            window_bits--;
+        else if (mem_level > 1)
+            mem_level--;
+        else if (window_bits > 9)
+            window_bits--;
+        else
+            break;
+    }
+}
+
+bool GzipEncoder::init(int level, size_t max_memory)
+{
+    if (initialized)
+        return false;
+    if (level < 1 || level > 9)
+        level = GZIP_DEFAULT_LEVEL;
+    int window_bits;
+    int mem_level;
+    chooseMemoryParameters(max_memory, window_bits, mem_level);
+    DEBUG_MSG_1("Gzip window bits", window_bits);
+    DEBUG_MSG_1("Gzip memory level", mem_level);
+
+    // + 16 asks zlib for a gzip header and trailer instead of a raw zlib stream
+    if (deflateInit2(&stream, level, Z_DEFLATED, window_bits + 16, mem_level, Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+        DEBUG_MSG_1("Gzip init failed", (stream.msg ? stream.msg : ""));
+        return false;
+    }
+    initialized = true;
+    return true;
+}
+
+bool GzipEncoder::deflateInto(const char *data, size_t length, int flush_mode, std::string &out)
+{
+    if (!initialized || finished)
+        return false;
+    char buffer[GZIP_CHUNK_SIZE];
+    stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data));
+    stream.avail_in = length;
+    int result;
+    do
+    {
+        stream.next_out = reinterpret_cast<Bytef *>(buffer);
+        stream.avail_out = sizeof(buffer);
+        result = deflate(&stream, flush_mode);
+        if (result == Z_STREAM_ERROR)
+        {
+            DEBUG_MSG_1("Gzip deflate failed", (stream.msg ? stream.msg : ""));
+            return false;
+        }
+        out.append(buffer, sizeof(buffer) - stream.avail_out);
+    } while (stream.avail_out == 0);
+    if (result == Z_STREAM_END)
+        finished = true;
+    return true;
+}
+
+// compresses the next piece of input. With flush set, everything fed so far is
+// emitted (Z_SYNC_FLUSH) so the client can decode it without waiting for more data
+bool GzipEncoder::update(const char *data, size_t length, std::string &out, bool flush)
+{
+    return deflateInto(data, length, flush ? Z_SYNC_FLUSH : Z_NO_FLUSH, out);
+}
+
+bool GzipEncoder::finish(std::string &out)
+{
+    return deflateInto("", 0, Z_FINISH, out) && finished;
+}
+
+size_t GzipEncoder::bytesIn() const
+{
+    return stream.total_in;
+}
+
+size_t GzipEncoder::bytesOut() const
+{
+    return stream.total_out;
+}
+
+bool GzipEncoder::compress(const std::string &in, std::string &out, int level, size_t max_memory)
+{
+    GzipEncoder encoder;
+    out.clear();
+    if (!encoder.init(level, max_memory))
+        return false;
+    return encoder.update(in.data(), in.size(), out, false) && encoder.finish(out);
+}
@@ -1,45 +1,140 @@
 #include "../../include/httpResponse.hpp"
+#include "../../include/responseHandler.hpp"
 #include "../../include/debug.hpp"
+#include <unistd.h>
 
-HttpResponse::HttpResponse() : version(""), status_code(0), reason_phrase(""), headers(), body(""), file_content_type(""), close_connection(false), complete(false) {}
+HttpResponse::HttpResponse() : version(""), status_code(0), reason_phrase(""), headers(), body(""), file_content_type(""), close_connection(false), complete(false), is_cgi_response(false), route(NULL), server(NULL), gzip_accepted(false), head_only(false), keep_body(false), body_fd(-1) {}
+
+HttpResponse::~HttpResponse()
+{
+  closeBodyFile();
+}
+
+void HttpResponse::closeBodyFile()
+{
+  if (body_fd >= 0)
+    close(body_fd);
+  body_fd = -1;
+}
+
+// length of everything after the header block: `body` plus all segments
+size_t HttpResponse::bodyLength() const
+{
+  size_t length = body.size();
+  for (std::vector<BodySegment>::const_iterator it = segments.begin(); it != segments.end(); ++it)
+    length += it->data.size() + it->length;
+  return length;
+}
 
 void HttpResponse::setHeader(const std::string &header_name, const std::string &header_value)
 {
   this->headers[header_name] = header_value;
 }
 
-// generates final response (formatted as one string)
-std::string HttpResponse::generateRawResponseStr()
+// Status lines are rendered at compile time, sorted by code
+struct StatusLine
 {
-  std::string raw_string;
-  // generate response status line:
-  std::ostringstream oss;
-  oss << this->status_code;
-  raw_string = this->version + " " + oss.str() + " " + this->reason_phrase + "\r\n";
-  DEBUG_MSG_2("SG5 ", "");
+  int code;
+  const char *reason;
+  const char *line;
+};
 
-  // add headers
-  for (std::map<std::string, std::string>::const_iterator it = this->headers.begin();
-       it != this->headers.end(); ++it)
+#define STATUS_LINE(code, reason) {code, reason, "HTTP/1.1 " #code " " reason "\r\n"}
+
+static const StatusLine status_lines[] = {
+    STATUS_LINE(200, "OK"),
+    STATUS_LINE(201, "Created"),
+    STATUS_LINE(202, "Accepted"),
+    STATUS_LINE(204, "No Content"),
+    STATUS_LINE(206, "Partial Content"),
+    STATUS_LINE(301, "Moved Permanently"),
+    STATUS_LINE(302, "Found"),
+    STATUS_LINE(303, "See Other"),
+    STATUS_LINE(304, "Not Modified"),
+    STATUS_LINE(307, "Temporary Redirect"),
+    STATUS_LINE(308, "Permanent Redirect"),
+    STATUS_LINE(400, "Bad Request"),
+    STATUS_LINE(401, "Unauthorized"),
+    STATUS_LINE(403, "Forbidden"),
+    STATUS_LINE(404, "Not Found"),
+    STATUS_LINE(405, "Method Not Allowed"),
+    STATUS_LINE(408, "Request Time-out"),
+    STATUS_LINE(409, "Conflict"),
+    STATUS_LINE(411, "Length Required"),
+    STATUS_LINE(413, "Payload Too Large"),
+    STATUS_LINE(415, "Unsupported Media Type"),
+    STATUS_LINE(416, "Range Not Satisfiable"),
+    STATUS_LINE(500, "Internal Server Error"),
+    STATUS_LINE(501, "Not Implemented"),
+    STATUS_LINE(502, "Bad Gateway"),
+    STATUS_LINE(503, "Service Unavailable"),
+    STATUS_LINE(504, "Gateway Time-out"),
+    STATUS_LINE(505, "HTTP Version not supported"),
+};
+
+#undef STATUS_LINE
+
+static const StatusLine *findStatusLine(int code)
+{
+  size_t low = 0;
+  size_t high = sizeof(status_lines) / sizeof(status_lines[0]);
+  while (low < high)
   {
-    // Use simple logging to avoid potential issues in DEBUG_MSG_2
-    raw_string += it->first + ": " + it->second + "\r\n";
-    DEBUG_MSG_2("SG10 ", "");
+    size_t mid = (low + high) / 2;
+    if (status_lines[mid].code == code)
+      return &status_lines[mid];
+    if (status_lines[mid].code < code)
+      low = mid + 1;
+    else
+      high = mid;
   }
-  DEBUG_MSG_2("SG9 ", "");
+  return NULL;
+}
 
-  if (!headers.empty())
-  {
-    DEBUG_MSG_2("SG7 ", "");
+const char *HttpResponse::reasonPhrase(int code)
+{
+  const StatusLine *status = findStatusLine(code);
+  return status ? status->reason : "Unknown";
+}
 
-    raw_string += "\r\n";
-  }
-  // only add body for non-redirects
-  bool is_redirect = (status_code >= 300 && status_code < 400);
-  if (!this->body.empty() && !is_redirect)
+// "HTTP/1.1 <code> <reason>\r\n", NULL for codes not in the table
+const char *HttpResponse::statusLine(int code)
+{
+  const StatusLine *status = findStatusLine(code);
+  return status ? status->line : NULL;
+}
+
+// generates the status line and header block, terminated by the empty line
+// Date comes from the once-per-second cache, Server and add_header from the server's pre-rendered block
+// The body is not copied in here, ResponseWriter sends it next to this block
+std::string HttpResponse::generateHeaderBlock() const
+{
+  const std::string &date = ResponseHandler::generateDateHeader();
+  std::string raw_string;
+  raw_string.reserve(512);
+
+  // generate response status line:
+  const char *status_line = statusLine(status_code);
+  if (status_line && version == "HTTP/1.1" && reason_phrase == reasonPhrase(status_code))
+    raw_string += status_line;
+  else
   {
-    DEBUG_MSG_2("SG8 ", "");
-    raw_string += this->body;
+    std::ostringstream oss;
+    oss << this->status_code;
+    raw_string += this->version + " " + oss.str() + " " + this->reason_phrase + "\r\n";
   }
+
+  // add headers
+  for (std::map<std::string, std::string>::const_iterator it = this->headers.begin();
+       it != this->headers.end(); ++it)
+    raw_string += it->first + ": " + it->second + "\r\n";
+  raw_string += "Date: ";
+  raw_string += date;
+  raw_string += "\r\n";
+  if (server)
+    raw_string += server->getStaticHeaders();
+  else
+    raw_string += "Server: " SERVER_SOFTWARE "\r\n";
+  raw_string += "\r\n";
   return raw_string;
-}
\ No newline at end of file
+}
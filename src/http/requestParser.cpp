@@ -106,7 +106,7 @@ bool RequestParser::mandatoryHeadersPresent(HttpRequest &request)
   {
     return false;
   }
-  if (request.method == "POST")
+  if (request.method == "POST" || request.method == "PUT")
   {
     // Check for the Content-Type header
     // Check for Content-Length or Transfer-Encoding: chunked
@@ -119,7 +119,7 @@ bool RequestParser::mandatoryHeadersPresent(HttpRequest &request)
       return false;
     }
   }
-  else if (request.method == "GET")
+  else if (request.method == "GET" || request.method == "HEAD")
   {
   }
   else if (request.method == "DELETE")
@@ -449,6 +449,14 @@ void RequestParser::tokenizeRequestLine(HttpRequest &request)
     request.error_code = 400;
     throw std::runtime_error("Bad request line");
   }
+
+  // split off the query string, routing and file lookup only work on the path
+  size_t query_pos = request.uri.find('?');
+  if (query_pos != std::string::npos)
+  {
+    request.queryString = request.uri.substr(query_pos + 1);
+    request.uri.erase(query_pos);
+  }
 }
 
 bool RequestParser::validRequestLine(HttpRequest &request)
@@ -458,7 +466,7 @@ bool RequestParser::validRequestLine(HttpRequest &request)
 
 bool RequestParser::validMethod(HttpRequest &request)
 {
-  if (!request.method.empty() && (request.method == "GET" || request.method == "POST" || request.method == "DELETE"))
+  if (!request.method.empty() && (request.method == "GET" || request.method == "HEAD" || request.method == "POST" || request.method == "PUT" || request.method == "DELETE"))
   {
     return true;
   }
@@ -1,8 +1,10 @@
 #include "../../include/responseHandler.hpp"
 #include "../../include/cgi.hpp"
+#include "../../include/cgiCache.hpp"
 #include "../../include/httpRequest.hpp"
 #include "../../include/httpResponse.hpp"
 #include "../../include/debug.hpp"
+#include "../../include/sha256.hpp"
 
 void ResponseHandler::finalizeCGIErrorResponse(int &fd, HttpRequest &request, HttpResponse &response) {
     request.complete = true;
@@ -23,18 +25,8 @@ void ResponseHandler::prepareCGIErrorResponse(HttpResponse &response,
     response.status_code = status_code;
     response.reason_phrase = reason;
 
-    std::ostringstream ss;
-    ss << status_code;
-    
-    std::string error_page_path = "www/errors/" + ss.str() + ".html";
-    std::ifstream error_file(error_page_path.c_str());
-    
-    if (error_file.is_open()) {
-        std::stringstream buffer;
-        buffer << error_file.rdbuf();
-        response.body = buffer.str();
+    if (response.server && response.server->getErrorPageBody(status_code, response.body)) {
         response.setHeader("Content-Type", "text/html");
-        error_file.close();
     } else {
         response.body = body;
         response.setHeader("Content-Type", "text/plain");
@@ -106,7 +98,9 @@ bool ResponseHandler::handleCGIErrors(int &fd, Server &config, HttpRequest &requ
       }
     }
     response.is_cgi_response = true;
-    request.queryString = CGI::extractPathInfo(request.uri);
+    // scripts without a real query string get the path info there (e.g. timestamp.py/flames.jpeg)
+    if (request.queryString.empty())
+      request.queryString = CGI::extractPathInfo(request.uri);
     
     return true;
 }
@@ -114,6 +108,7 @@ bool ResponseHandler::handleCGIErrors(int &fd, Server &config, HttpRequest &requ
 void ResponseHandler::processRequest(int &fd, Server &config, HttpRequest &request, HttpResponse &response)
 {
   response.is_cgi_response = false; // initialize to mute valgrind warning
+  response.head_only = (request.method == "HEAD");
   if (!handleCGIErrors(fd, config, request, response)) {
         return;
   }
@@ -130,9 +125,16 @@ void ResponseHandler::processRequest(int &fd, Server &config, HttpRequest &reque
   }
   
   const Route *route = request.route;
+  response.route = route;
+  response.gzip_accepted = acceptsEncoding(request, "gzip");
  
   DEBUG_MSG("Route found", route->uri);
   DEBUG_MSG("Is CGI route", (route->is_cgi ? "yes" : "no"));
+  if (route->is_cgi && !route->fastcgi_pass.empty())
+  {
+    FastCGI::handleRequest(fd, config, request, response);
+    return;
+  }
   if (route->is_cgi)
   {
     DEBUG_MSG_1("Request status", "Handling CGI request");
@@ -147,41 +149,14 @@ void ResponseHandler::processRequest(int &fd, Server &config, HttpRequest &reque
             return;
         }
       }
+      // cgi_cache: fresh or stale copies and runs already in flight answer GETs without a new script
+      if (CGICache::handle(fd, config, request, response))
+        return;
+      // over the location's or the global CGI limit the request is queued or refused, see CGI::admit
+      if (!CGI::admit(fd, config, request, response))
+        return;
       CGI cgi;
       cgi.handleCGIRequest(fd, request, response);
-      
-      size_t headerEnd = request.body.find("\r\n\r\n");
-      if (headerEnd != std::string::npos)
-      {
-        std::string headers = request.body.substr(0, headerEnd);
-        
-        response.body = request.body.substr(headerEnd + 4);
-        size_t pos = 0;
-        std::string headerSection = headers;
-        while ((pos = headerSection.find("\r\n")) != std::string::npos)
-        {
-          std::string header = headerSection.substr(0, pos);
-          size_t colonPos = header.find(": ");
-          if (colonPos != std::string::npos)
-          {
-            std::string name = header.substr(0, colonPos);
-            std::string value = header.substr(colonPos + 2);
-            response.setHeader(name, value);
-          }
-          headerSection = headerSection.substr(pos + 2);
-        }
-
-        if (!headerSection.empty())
-        {
-          size_t colonPos = headerSection.find(": ");
-          if (colonPos != std::string::npos)
-          {
-            std::string name = headerSection.substr(0, colonPos);
-            std::string value = headerSection.substr(colonPos + 2);
-            response.setHeader(name, value);
-          }
-        }
-      }
       response.close_connection = true;
       DEBUG_MSG("ResponseHandler::processRequest response.close_connection = true", response.close_connection);
       request.complete = true;
@@ -225,6 +200,21 @@ void ResponseHandler::processRequest(int &fd, Server &config, HttpRequest &reque
   ResponseHandler::responseBuilder(response);
 }
 
+// CGI forks and registers its pipes with the poll loop, so those requests can't go to a file I/O worker.
+// Everything else only touches the request/response pair, the filesystem and shared read-only config
+bool ResponseHandler::runsOnEventLoop(const Server &config, const HttpRequest &request)
+{
+  if (request.uri.find("/cgi-bin/") != std::string::npos)
+    return true;
+  const std::map<std::string, Route> &routes = config.getRoutes();
+  for (std::map<std::string, Route>::const_iterator it = routes.begin(); it != routes.end(); ++it)
+  {
+    if (it->second.is_cgi && request.uri.find(it->first) == 0)
+      return true;
+  }
+  return false;
+}
+
 void ResponseHandler::routeRequest(int &fd, Server &config, HttpRequest &request, HttpResponse &response)
 {
   (void)fd;
@@ -243,7 +233,14 @@ void ResponseHandler::routeRequest(int &fd, Server &config, HttpRequest &request
 
 void ResponseHandler::staticContentHandler(HttpRequest &request, HttpResponse &response)
 {
-  if (request.method == "GET")
+  if (request.route->metrics && (request.method == "GET" || request.method == "HEAD"))
+  {
+    response.status_code = 200;
+    response.body = Metrics::render();
+    response.setHeader("Content-Type", METRICS_CONTENT_TYPE);
+    response.setHeader("Cache-Control", "no-store");
+  }
+  else if (request.method == "GET" || request.method == "HEAD")
   {
     ResponseHandler::serveStaticFile(request, response);
   }
@@ -251,6 +248,10 @@ void ResponseHandler::staticContentHandler(HttpRequest &request, HttpResponse &r
   {
     ResponseHandler::processFileUpload(request, response);
   }
+  else if (request.method == "PUT")
+  {
+    ResponseHandler::processResumableUpload(request, response);
+  }
   else if (request.method == "DELETE")
   {
     ResponseHandler::processFileDeletion(request, response);
@@ -261,95 +262,10 @@ void ResponseHandler::staticContentHandler(HttpRequest &request, HttpResponse &r
   }
 }
 
-// creates a directory listing html page if autoindex is 'on'
+// creates a directory listing page if autoindex is 'on' (HTML, or JSON for Accept: application/json)
 void ResponseHandler::generateDirectoryListing(const HttpRequest &request, HttpResponse &response)
 {
-  std::string html = "<html>\n<head>\n"
-                     "<title>Index of " +
-                     request.uri + "</title>\n"
-                                   "<style>\n"
-                                   "body { font-family: Arial, sans-serif; margin: 40px; }\n"
-                                   "h1 { color: #333; }\n"
-                                   "a { text-decoration: none; color: #0066cc; }\n"
-                                   "a:hover { text-decoration: underline; }\n"
-                                   "</style>\n"
-                                   "</head>\n"
-                                   "<body>\n"
-                                   "<h1>Index of " +
-                     request.uri + "</h1>\n"
-                                   "<hr>\n"
-                                   "<pre>\n";
-
-  DIR *dir = opendir(request.path.c_str());
-  if (!dir)
-  {
-    response.status_code = 500;
-    response.reason_phrase = "Internal Server Error";
-    return;
-  }
-
-  // Add parent directory link if not at root
-  if (request.uri != "/")
-  {
-    html += "<a href=\"../\">../</a>\n";
-  }
-
-  struct dirent *entry;
-  while ((entry = readdir(dir)))
-  {
-    std::string name = entry->d_name;
-
-    // Skip . and ..
-    if (name == "." || name == "..")
-    {
-      continue;
-    }
-
-    // Get file info
-    struct stat file_stat;
-    std::string full_path = request.path + "/" + name;
-    if (stat(full_path.c_str(), &file_stat) == 0)
-    {
-      std::ostringstream ss;
-      ss << file_stat.st_size << " bytes";
-      std::string size = ss.str();
-
-      // Format name with trailing slash for directories
-      std::string display_name = name;
-      std::string url_path;
-
-      // Ensure the URI ends with a slash for directories
-      std::string current_uri = request.uri;
-      if (current_uri[current_uri.length() - 1] != '/')
-          current_uri += '/';
-
-      if (S_ISDIR(file_stat.st_mode))
-      {
-        display_name += "/";
-        url_path = current_uri + name + "/";
-      }
-      else
-      {
-        url_path = current_uri + name;
-      }
-
-      // Add entry with proper URL path
-      html += "<a href=\"" + url_path + "\">" + display_name + "</a>";
-      html += std::string(50 - display_name.length(), ' ') + size + "\n";
-    }
-  }
-  closedir(dir);
-
-  html += "</pre>\n<hr>\n</body>\n</html>";
-
-  response.body = html;
-  response.status_code = 200;
-  response.reason_phrase = "OK";
-  response.setHeader("Content-Type", "text/html");
-
-  std::ostringstream length_ss;
-  length_ss << html.length();
-  response.setHeader("Content-Length", length_ss.str());
+  DirectoryListing::render(request, response);
 }
 
 // at this point the path is set in the request!
@@ -406,7 +322,7 @@ void ResponseHandler::serveStaticFile(HttpRequest &request, HttpResponse &respon
     // Bypass fileExists function if the direct check shows the file exists
     if (directExists && S_ISREG(buffer.st_mode) && hasReadPermission(request.path, response))
     {
-      readFile(request, response);
+      deliverFile(request, response);
       request.path = original_path;
       request.is_directory = original_is_directory;
       return;
@@ -425,11 +341,424 @@ void ResponseHandler::serveStaticFile(HttpRequest &request, HttpResponse &respon
   }
   // Regular file handling
   ResponseHandler::setFullPath(request);
+  UploadProgress progress;
+  if (request.method == "HEAD" && ResumableUpload::progress(request.path, progress))
+  {
+    response.status_code = 202; // not there yet, but on its way
+    setUploadProgressHeaders(progress, response);
+    return;
+  }
   if (ResponseHandler::fileExists(request, response) &&
       ResponseHandler::hasReadPermission(request.path, response))
   {
+    deliverFile(request, response);
+  }
+}
+
+// Common tail of the GET file paths once the file is known to exist and be readable:
+// pick the representation, attach validators and answer conditional requests before the file is opened
+void ResponseHandler::deliverFile(HttpRequest &request, HttpResponse &response, bool zero_copy)
+{
+  response.file_content_type = request.content_type;
+  selectPrecompressedFile(request, response);
+
+  struct stat file_stat;
+  if (stat(request.path.c_str(), &file_stat) != 0)
+  {
+    response.status_code = 404;
+    return;
+  }
+  setValidatorHeaders(file_stat, response);
+  if (isNotModified(request, response, file_stat))
+  {
+    DEBUG_MSG("Conditional GET", "304 Not Modified for " + request.path);
+    response.status_code = 304;
+    response.body = "";
+    return;
+  }
+  response.setHeader("Accept-Ranges", "bytes");
+  if (response.head_only)
+  {
+    // HEAD: everything GET would send except the body, the file is never opened (Range is ignored)
+    std::ostringstream length_ss;
+    length_ss << file_stat.st_size;
+    response.status_code = 200;
+    response.setHeader("Content-Type", request.content_type.empty() ? "text/html" : request.content_type); // as responseBuilder does for GET
+    // the same representation headers as the GET, whose body compressResponse() would gzip. Its
+    // compressed length is not known without compressing, so it is left out
+    if (!zero_copy && gzipEligible(response) && file_stat.st_size > 0 &&
+        static_cast<size_t>(file_stat.st_size) >= response.route->gzip_min_length)
+    {
+      response.setHeader("Vary", "Accept-Encoding");
+      if (response.gzip_accepted)
+      {
+        response.setHeader("Content-Encoding", "gzip");
+        weakenETag(response);
+        return;
+      }
+    }
+    response.setHeader("Content-Length", length_ss.str());
+    return;
+  }
+  if (request.headers.find("Range") != request.headers.end() && handleRangeRequest(request, response, file_stat))
+    return;
+  if (zero_copy)
+    attachFile(request, response, file_stat);
+  else
     readFile(request, response);
+}
+
+// Whole file as one segment of the open file: ResponseWriter sends it with sendfile(), nothing is
+// read into `body` (and so nothing is compressed on the fly)
+void ResponseHandler::attachFile(const HttpRequest &request, HttpResponse &response, const struct stat &file_stat)
+{
+  int file_fd = open(request.path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (file_fd == -1)
+  {
+    DEBUG_MSG_1("Cant open file", strerror(errno));
+    response.status_code = 500;
+    return;
+  }
+  response.body_fd = file_fd;
+  response.segments.push_back(BodySegment("", 0, file_stat.st_size));
+  response.status_code = 200;
+  response.setHeader("Content-Type", request.content_type);
+}
+
+// X-Sendfile / X-Accel-Redirect from CGI output: the server sends `file` like a static file
+// (validators, conditional GET, Range, sendfile()) and the script's body is dropped. The name is
+// relative to the location's sendfile_root, an absolute path inside the root works too; either way
+// it has to resolve inside the root, symlinks included. Headers the script set (Content-Type,
+// Content-Disposition, ...) stay
+void ResponseHandler::deliverInternalFile(const HttpRequest &request, HttpResponse &response, const std::string &file)
+{
+  const Route *route = response.route;
+  char root[PATH_MAX];
+  char resolved[PATH_MAX];
+  response.body.clear();
+  if (!route || route->sendfile_root.empty() || realpath(route->sendfile_root.c_str(), root) == NULL)
+  {
+    DEBUG_MSG_1("X-Sendfile without a usable sendfile_root", file);
+    response.status_code = 500;
+    return;
+  }
+  std::string root_dir = std::string(root) + "/";
+  std::string path = file;
+  if (path.compare(0, root_dir.size(), root_dir) != 0)
+  {
+    size_t start = path.find_first_not_of('/');
+    path = root_dir + (start == std::string::npos ? "" : path.substr(start));
+  }
+  struct stat file_stat;
+  if (realpath(path.c_str(), resolved) == NULL || stat(resolved, &file_stat) != 0 || !S_ISREG(file_stat.st_mode))
+  {
+    response.status_code = 404;
+    return;
+  }
+  path = resolved;
+  if (path.compare(0, root_dir.size(), root_dir) != 0 || access(resolved, R_OK) != 0)
+  {
+    DEBUG_MSG_1("X-Sendfile outside sendfile_root or unreadable", path);
+    response.status_code = 403;
+    return;
+  }
+
+  HttpRequest file_request(request);
+  file_request.path = path;
+  size_t dot = path.find_last_of("./");
+  file_request.file_extension = (dot != std::string::npos && path[dot] == '.') ? path.substr(dot + 1) : "";
+  MimeTypeMapper mapper;
+  mapper.findContentType(file_request);
+  std::map<std::string, std::string>::const_iterator type = response.headers.find("Content-Type");
+  if (type != response.headers.end())
+    file_request.content_type = type->second;
+  else if (file_request.content_type.empty())
+    file_request.content_type = "application/octet-stream";
+  deliverFile(file_request, response, true);
+}
+
+// Answers a Range request with 206 (one range, or multipart/byteranges for several) or 416.
+// Returns false if the Range header has to be ignored (malformed, too many ranges, If-Range mismatch),
+// in which case the full file is sent. Range bodies are segments of the open file, nothing is read here
+bool ResponseHandler::handleRangeRequest(const HttpRequest &request, HttpResponse &response, const struct stat &file_stat)
+{
+  if (!ifRangeMatches(request, response, file_stat))
+  {
+    DEBUG_MSG("Range", "If-Range does not match, sending full file");
+    return false;
+  }
+  std::vector<std::pair<off_t, off_t> > ranges;
+  if (!parseRangeHeader(request.headers.find("Range")->second, file_stat.st_size, ranges))
+  {
+    DEBUG_MSG("Range", "Ignoring malformed Range header");
+    return false;
+  }
+
+  std::ostringstream size_ss;
+  size_ss << file_stat.st_size;
+  if (ranges.empty())
+  {
+    response.status_code = 416;
+    response.setHeader("Content-Range", "bytes */" + size_ss.str());
+    return true;
+  }
+
+  int file_fd = open(request.path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (file_fd == -1)
+  {
+    DEBUG_MSG_1("Cant open file", strerror(errno));
+    response.status_code = 500;
+    return true;
+  }
+  response.body_fd = file_fd;
+  response.status_code = 206;
+
+  if (ranges.size() == 1)
+  {
+    response.setHeader("Content-Type", request.content_type);
+    response.setHeader("Content-Range", contentRangeValue(ranges[0].first, ranges[0].second, file_stat.st_size));
+    response.segments.push_back(BodySegment("", ranges[0].first, ranges[0].second - ranges[0].first + 1));
+    return true;
+  }
+
+  std::ostringstream boundary_ss;
+  boundary_ss << std::hex << "MAC_Server_" << file_stat.st_ino << file_stat.st_mtime << std::time(0);
+  std::string boundary = boundary_ss.str();
+  response.setHeader("Content-Type", "multipart/byteranges; boundary=" + boundary);
+  for (size_t i = 0; i < ranges.size(); ++i)
+  {
+    std::string part_header = (i == 0 ? "--" : "\r\n--") + boundary + "\r\n";
+    if (!request.content_type.empty())
+      part_header += "Content-Type: " + request.content_type + "\r\n";
+    part_header += "Content-Range: " + contentRangeValue(ranges[i].first, ranges[i].second, file_stat.st_size) + "\r\n\r\n";
+    response.segments.push_back(BodySegment(part_header, ranges[i].first, ranges[i].second - ranges[i].first + 1));
+  }
+  response.segments.push_back(BodySegment("\r\n--" + boundary + "--\r\n", 0, 0));
+  return true;
+}
+
+// Parses "bytes=0-99,200-,-50" into sorted, merged [first, last] pairs clipped to the file size.
+// Unsatisfiable specs are dropped, so an empty result means 416
+bool ResponseHandler::parseRangeHeader(const std::string &value, off_t file_size, std::vector<std::pair<off_t, off_t> > &ranges)
+{
+  if (value.compare(0, 6, "bytes=") != 0)
+    return false;
+
+  std::vector<std::pair<off_t, off_t> > parsed;
+  std::istringstream stream(value.substr(6));
+  std::string spec;
+  size_t spec_count = 0;
+  while (std::getline(stream, spec, ','))
+  {
+    size_t start = spec.find_first_not_of(" \t");
+    if (start == std::string::npos)
+      continue;
+    spec = spec.substr(start, spec.find_last_not_of(" \t") - start + 1);
+    if (++spec_count > MAX_BYTE_RANGES)
+      return false;
+
+    size_t dash = spec.find('-');
+    if (dash == std::string::npos)
+      return false;
+    std::string first_str = spec.substr(0, dash);
+    std::string last_str = spec.substr(dash + 1);
+    if (first_str.find_first_not_of("0123456789") != std::string::npos ||
+        last_str.find_first_not_of("0123456789") != std::string::npos ||
+        (first_str.empty() && last_str.empty()))
+      return false;
+
+    off_t first;
+    off_t last;
+    if (first_str.empty())
+    {
+      // suffix range: the last N bytes
+      off_t suffix = strtoll(last_str.c_str(), NULL, 10);
+      if (suffix == 0 || file_size == 0)
+        continue;
+      first = suffix < file_size ? file_size - suffix : 0;
+      last = file_size - 1;
+    }
+    else
+    {
+      first = strtoll(first_str.c_str(), NULL, 10);
+      // only an explicit first-last can be malformed; "<size>-" (resuming a complete download) is
+      // merely unsatisfiable
+      if (!last_str.empty() && strtoll(last_str.c_str(), NULL, 10) < first)
+        return false;
+      if (first >= file_size)
+        continue;
+      last = last_str.empty() ? file_size - 1 : strtoll(last_str.c_str(), NULL, 10);
+      if (last >= file_size)
+        last = file_size - 1;
+    }
+    parsed.push_back(std::make_pair(first, last));
+  }
+  if (spec_count == 0)
+    return false;
+
+  // overlapping or adjacent ranges are coalesced so a client cannot make us send the same bytes repeatedly
+  std::sort(parsed.begin(), parsed.end());
+  ranges.clear();
+  for (size_t i = 0; i < parsed.size(); ++i)
+  {
+    if (!ranges.empty() && parsed[i].first <= ranges.back().second + 1)
+      ranges.back().second = std::max(ranges.back().second, parsed[i].second);
+    else
+      ranges.push_back(parsed[i]);
   }
+  return true;
+}
+
+// If-Range holds either an entity tag (strong comparison) or the Last-Modified date;
+// only if it still matches the current file may a partial response be sent
+bool ResponseHandler::ifRangeMatches(const HttpRequest &request, const HttpResponse &response, const struct stat &file_stat)
+{
+  std::map<std::string, std::string>::const_iterator it = request.headers.find("If-Range");
+  if (it == request.headers.end())
+    return true;
+
+  const std::string &value = it->second;
+  if (!value.empty() && (value[0] == '"' || value.compare(0, 2, "W/") == 0))
+  {
+    std::map<std::string, std::string>::const_iterator etag = response.headers.find("ETag");
+    return etag != response.headers.end() && etag->second.compare(0, 2, "W/") != 0 && etag->second == value;
+  }
+  std::time_t date;
+  return parseHttpDate(value, date) && date == file_stat.st_mtime;
+}
+
+std::string ResponseHandler::contentRangeValue(off_t first, off_t last, off_t file_size)
+{
+  std::ostringstream oss;
+  oss << "bytes " << first << "-" << last << "/" << file_size;
+  return oss.str();
+}
+
+// ETag derived from inode, size and mtime (hex), e.g. "1a2b-400-65f0c3d1".
+// A file modified within the current second could change again without its mtime changing,
+// so its tag is only weak until that second is over
+std::string ResponseHandler::generateETag(const struct stat &file_stat)
+{
+  std::ostringstream oss;
+  oss << std::hex << "\"" << file_stat.st_ino << "-" << file_stat.st_size << "-" << file_stat.st_mtime << "\"";
+  if (file_stat.st_mtime >= std::time(0))
+    return "W/" + oss.str();
+  return oss.str();
+}
+
+void ResponseHandler::setValidatorHeaders(const struct stat &file_stat, HttpResponse &response)
+{
+  response.setHeader("ETag", generateETag(file_stat));
+  response.setHeader("Last-Modified", formatHttpDate(file_stat.st_mtime));
+}
+
+// If-None-Match takes precedence over If-Modified-Since (RFC 7232, section 6)
+bool ResponseHandler::isNotModified(const HttpRequest &request, const HttpResponse &response, const struct stat &file_stat)
+{
+  std::map<std::string, std::string>::const_iterator it = request.headers.find("If-None-Match");
+  if (it != request.headers.end())
+  {
+    std::map<std::string, std::string>::const_iterator etag = response.headers.find("ETag");
+    return etag != response.headers.end() && etagListMatches(it->second, etag->second);
+  }
+  it = request.headers.find("If-Modified-Since");
+  if (it != request.headers.end())
+  {
+    std::time_t since;
+    return parseHttpDate(it->second, since) && file_stat.st_mtime <= since;
+  }
+  return false;
+}
+
+// weak comparison of a comma separated If-None-Match list against our tag ("*" matches any)
+bool ResponseHandler::etagListMatches(const std::string &header_value, const std::string &etag)
+{
+  std::string own_tag = etag.compare(0, 2, "W/") == 0 ? etag.substr(2) : etag;
+  std::istringstream stream(header_value);
+  std::string item;
+  while (std::getline(stream, item, ','))
+  {
+    size_t start = item.find_first_not_of(" \t");
+    if (start == std::string::npos)
+      continue;
+    size_t end = item.find_last_not_of(" \t");
+    std::string candidate = item.substr(start, end - start + 1);
+    if (candidate == "*")
+      return true;
+    if (candidate.compare(0, 2, "W/") == 0)
+      candidate = candidate.substr(2);
+    if (candidate == own_tag)
+      return true;
+  }
+  return false;
+}
+
+// checks the Accept-Encoding header for a content coding the client is willing to receive
+// e.g. "gzip, deflate;q=0.5" accepts gzip, "gzip;q=0" or a missing header does not.
+// The coding's own entry wins over "*" wherever it appears: "*, gzip;q=0" refuses gzip
+bool ResponseHandler::acceptsEncoding(const HttpRequest &request, const std::string &coding)
+{
+  std::map<std::string, std::string>::const_iterator it = request.headers.find("Accept-Encoding");
+  if (it == request.headers.end())
+    return false;
+
+  double wildcard = -1; // quality of "*", -1 if absent
+  std::istringstream stream(it->second);
+  std::string item;
+  while (std::getline(stream, item, ','))
+  {
+    size_t start = item.find_first_not_of(" \t");
+    if (start == std::string::npos)
+      continue;
+    size_t params = item.find(';', start);
+    std::string token = item.substr(start, params == std::string::npos ? std::string::npos : params - start);
+    size_t end = token.find_last_not_of(" \t");
+    token = token.substr(0, end + 1);
+    for (size_t i = 0; i < token.size(); ++i)
+      token[i] = std::tolower(token[i]);
+    if (token != coding && token != "*")
+      continue;
+
+    // a quality value of 0 explicitly refuses the coding
+    double quality = 1.0;
+    if (params != std::string::npos)
+    {
+      size_t q_pos = item.find("q=", params);
+      if (q_pos != std::string::npos)
+        quality = std::strtod(item.c_str() + q_pos + 2, NULL);
+    }
+    if (token == coding)
+      return quality > 0;
+    wildcard = quality;
+  }
+  return wildcard > 0;
+}
+
+// if the route has gzip_static enabled and the client accepts gzip, serve "<file>.gz" instead of the file
+// the sidecar is only used if it is a readable regular file that is not older than the original
+void ResponseHandler::selectPrecompressedFile(HttpRequest &request, HttpResponse &response)
+{
+  if (!request.route || !request.route->gzip_static)
+    return;
+  // the representation depends on Accept-Encoding whether or not the sidecar is picked
+  response.setHeader("Vary", "Accept-Encoding");
+  if (!acceptsEncoding(request, "gzip"))
+    return;
+
+  struct stat original_stat;
+  struct stat sidecar_stat;
+  std::string sidecar_path = request.path + ".gz";
+  if (stat(request.path.c_str(), &original_stat) != 0 || stat(sidecar_path.c_str(), &sidecar_stat) != 0)
+    return;
+  if (!S_ISREG(sidecar_stat.st_mode) || sidecar_stat.st_mtime < original_stat.st_mtime ||
+      access(sidecar_path.c_str(), R_OK) != 0)
+  {
+    DEBUG_MSG("Precompressed sidecar", "missing, stale or unreadable: " + sidecar_path);
+    return;
+  }
+  DEBUG_MSG("Serving precompressed sidecar", sidecar_path);
+  request.path = sidecar_path;
+  response.setHeader("Content-Encoding", "gzip");
 }
 
 bool ResponseHandler::readFile(HttpRequest &request, HttpResponse &response)
@@ -483,30 +812,133 @@ void ResponseHandler::processFileUpload(HttpRequest &request, HttpResponse &resp
 
   if (!fileExists(request, response))
   {
+    if (!createShardDirectories(request.route->path, shardDirectory(*request.route, request.file_name)))
+    {
+      response.status_code = 500;
+      return;
+    }
     writeToFile(request, response);
   }
 }
 
+// The upload is written to a nameless file next to its target and only linked in once complete
+// (after the route's fsync_policy), so a GET never sees half a file. The no-replace link also
+// settles the race the fileExists check leaves open: if the name appeared meanwhile -> 409
+// With `dedup = true` the name becomes a hard link into the route's content store instead
 void ResponseHandler::writeToFile(HttpRequest &request, HttpResponse &response)
 {
-  // Open the file and write request body into it
-  std::ofstream file(request.path.c_str(), std::ios::binary);
-  if (file.is_open())
+  PublishResult result;
+  if (request.route->dedup)
+    result = ContentStore::store(request.route->path + "/" CAS_DIR_NAME, request.path, request.body, request.route->fsync_policy);
+  else
   {
-    file << request.body;
-    file.close();
+    AtomicFile file;
+    if (!file.open(request.path, request.route->fsync_policy) || !file.write(request.body.data(), request.body.size()))
+    {
+      DEBUG_MSG("Error", "Failed writing to file");
+      response.status_code = 500;
+      return;
+    }
+    result = file.publish();
+  }
+  if (result == PUBLISH_EXISTS)
+  {
+    DEBUG_MSG("Upload status", "File appeared while uploading: " + request.path);
+    Metrics::increment("upload_conflicts_total");
+    response.status_code = 409;
+    return;
+  }
+  if (result == PUBLISH_ERROR)
+  {
+    DEBUG_MSG("Error", "Failed publishing upload");
+    response.status_code = 500;
+    return;
+  }
+  Metrics::increment("uploads_total");
+  Metrics::increment("upload_bytes_total", request.body.size());
+  response.status_code = 201;
+  response.body = "File uploaded successfully";
+  response.setHeader("Content-Type", "text/plain");
+  DEBUG_MSG("Upload status", "File uploaded successfully");
+}
+
+// PUT /<location>/<name>, optionally with "Content-Range: bytes <first>-<last>/<total>" so a large
+// file can be sent in pieces, resumed after a broken connection and sent over several connections
+// at once. No Content-Range means the body is the whole file. Answers 202 with the received ranges
+// until the file is complete, then 201. HEAD on the name reports the same progress
+void ResponseHandler::processResumableUpload(HttpRequest &request, HttpResponse &response)
+{
+  DEBUG_MSG("Status", "Processing resumable upload");
+  if (request.is_directory || request.file_name.empty() || request.body.empty())
+  {
+    response.status_code = 400;
+    return;
+  }
+  constructFullPath(request, response);
+  if (response.status_code == 404)
+    return;
+
+  off_t first = 0, last = request.body.size() - 1, total = request.body.size();
+  std::map<std::string, std::string>::const_iterator range = request.headers.find("Content-Range");
+  if (range != request.headers.end() &&
+      (!ResumableUpload::parseContentRange(range->second, first, last, total) || last - first + 1 != static_cast<off_t>(request.body.size())))
+  {
+    DEBUG_MSG("Resumable upload", "Invalid Content-Range: " + range->second);
+    response.status_code = 416;
+    return;
+  }
+  struct stat path_stat;
+  if (stat(request.path.c_str(), &path_stat) == 0)
+  {
+    response.status_code = 409; // uploads never replace files, as with POST
+    return;
+  }
+  if (!createShardDirectories(request.route->path, shardDirectory(*request.route, request.file_name)))
+  {
+    response.status_code = 500;
+    return;
+  }
+
+  UploadProgress progress;
+  SegmentResult result = ResumableUpload::writeSegment(request.path, first, last, total, request.body.data(),
+                                                       request.route->fsync_policy, progress);
+  switch (result)
+  {
+  case SEGMENT_STORED:
+    response.status_code = 202;
+    setUploadProgressHeaders(progress, response);
+    break;
+  case SEGMENT_COMPLETE:
+    Metrics::increment("uploads_total");
+    Metrics::increment("upload_bytes_total", total);
     response.status_code = 201;
     response.body = "File uploaded successfully";
     response.setHeader("Content-Type", "text/plain");
-    DEBUG_MSG("Upload status", "File uploaded successfully");
-  }
-  else
-  {
-    DEBUG_MSG("Error", "Failed writing to file");
+    break;
+  case SEGMENT_CONFLICT:
+    response.status_code = 409;
+    break;
+  case SEGMENT_BUSY:
+    response.status_code = 503;
+    response.setHeader("Retry-After", "60");
+    break;
+  default:
     response.status_code = 500;
   }
 }
 
+// Range lists what the server has (inclusive, comma separated); the client resends the rest
+void ResponseHandler::setUploadProgressHeaders(const UploadProgress &progress, HttpResponse &response)
+{
+  std::ostringstream total, received;
+  total << progress.total;
+  received << progress.received;
+  if (!progress.ranges.empty())
+    response.setHeader("Range", "bytes=" + progress.ranges);
+  response.setHeader("Upload-Length", total.str());
+  response.setHeader("Upload-Received", received.str());
+}
+
 void ResponseHandler::processFileDeletion(HttpRequest &request, HttpResponse &response)
 {
   DEBUG_MSG("Status", "Processing file deletion");
@@ -522,6 +954,8 @@ void ResponseHandler::processFileDeletion(HttpRequest &request, HttpResponse &re
 
 void ResponseHandler::removeFile(HttpRequest &request, HttpResponse &response)
 {
+  if (request.route->dedup)
+    ContentStore::release(request.route->path + "/" CAS_DIR_NAME, request.path);
   if (std::remove(request.path.c_str()) == 0)
   {
     response.status_code = 200;
@@ -546,7 +980,7 @@ bool ResponseHandler::fileExists(HttpRequest &request, HttpResponse &response)
   if (stat(request.path.c_str(), &path_stat) == 0)
   {
     // If it's a directory and GET request with autoindex, allow it
-    if (request.is_directory && request.method == "GET" && request.route->autoindex)
+    if (request.is_directory && (request.method == "GET" || request.method == "HEAD") && request.route->autoindex)
     {
       return true;
     }
@@ -563,7 +997,7 @@ bool ResponseHandler::fileExists(HttpRequest &request, HttpResponse &response)
       return true;
     }
   }
-  if (request.method == "GET" || (request.method == "DELETE" && !request.is_directory))
+  if (request.method == "GET" || request.method == "HEAD" || (request.method == "DELETE" && !request.is_directory))
   {
     DEBUG_MSG("File status", "File does not exist");
     response.status_code = 404;
@@ -606,7 +1040,11 @@ void ResponseHandler::finalizeFullPath(HttpRequest &request, size_t &last_slash_
     extractOrGenerateFilename(request);
   }
 
-  request.path += "/" + request.file_name;
+  // only names directly under the location are sharded, explicit subdirectories are taken as they are
+  std::string shard;
+  if (last_slash_pos == std::string::npos)
+    shard = locateShard(*request.route, request.path, request.file_name);
+  request.path += shard + "/" + request.file_name;
   DEBUG_MSG("Full path to content", request.path);
 
   return;
@@ -686,12 +1124,17 @@ void ResponseHandler::extractOrGenerateFilename(HttpRequest &request)
   }
 }
 
+// upload_<seconds>_<nanoseconds>_<sequence>: the per-process sequence keeps names unique within
+// one clock tick, also across the file I/O workers
 std::string ResponseHandler::generateTimestampName()
 {
-  std::time_t current_time = std::time(0);
+  static unsigned long sequence = 0;
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  unsigned long number = __sync_fetch_and_add(&sequence, 1);
 
   std::ostringstream oss;
-  oss << current_time;
+  oss << now.tv_sec << "_" << std::setw(9) << std::setfill('0') << now.tv_nsec << "_" << number;
 
   std::string file_name = "upload_" + oss.str();
 
@@ -798,7 +1241,58 @@ void ResponseHandler::setFullPath(HttpRequest &request)
   }
 
   // Set the full path to the content requested (file name might contain also a directory in it)
-  request.path = request.route->path + request.file_name;
+  // a location's bare URI has no name to shard ("" or "/")
+  std::string shard;
+  if (!request.is_directory && request.file_name.size() > 1)
+    shard = locateShard(*request.route, request.route->path, request.file_name.substr(1));
+  request.path = request.route->path + shard + request.file_name;
+}
+
+// "/ab/cd" for depth 2: the leading hex pairs of sha256(name), so every name has exactly one place
+// and the entries spread evenly. Empty for flat locations and for names with a directory part
+std::string ResponseHandler::shardDirectory(const Route &route, const std::string &file_name)
+{
+  if (route.shard_depth == 0 || file_name.empty() || file_name.find('/') != std::string::npos)
+    return "";
+  std::string digest = Sha256::hash(file_name);
+  std::string shard;
+  for (int level = 0; level < route.shard_depth; ++level)
+    shard += "/" + digest.substr(level * 2, 2);
+  return shard;
+}
+
+// Shard of a name under base, except while the name only exists flat: files stored before shard_depth
+// was set (or written by a script that knows only the plain path) stay reachable, and an upload of
+// the same name still conflicts with them
+std::string ResponseHandler::locateShard(const Route &route, const std::string &base, const std::string &file_name)
+{
+  std::string shard = shardDirectory(route, file_name);
+  if (shard.empty())
+    return shard;
+  struct stat file_stat;
+  if (stat((base + shard + "/" + file_name).c_str(), &file_stat) != 0 && errno == ENOENT &&
+      stat((base + "/" + file_name).c_str(), &file_stat) == 0)
+    return "";
+  return shard;
+}
+
+// mkdir -p of the shard levels below base; the directories are left in place when files go away
+bool ResponseHandler::createShardDirectories(const std::string &base, const std::string &shard)
+{
+  if (shard.empty())
+    return true;
+  for (size_t end = shard.find('/', 1);; end = shard.find('/', end + 1))
+  {
+    std::string path = base + shard.substr(0, end);
+    if (mkdir(path.c_str(), 0755) != 0 && errno != EEXIST)
+    {
+      DEBUG_MSG_1("Can't create shard directory", path + ": " + strerror(errno));
+      return false;
+    }
+    if (end == std::string::npos)
+      break;
+  }
+  return true;
 }
 
 std::string ResponseHandler::createAllowedMethodsStr(const std::set<std::string> &methods)
@@ -829,8 +1323,8 @@ void ResponseHandler::responseBuilder(HttpResponse &response)
   response.version = "HTTP/1.1";
   // 4xx or 5xx -> has a body with error message
   DEBUG_MSG_2("ResponseHandler::responseBuilder", "response.status_code");
-  if (response.status_code >= 400)
-    serveErrorPage(response);  
+  if (response.status_code >= 400 && !response.keep_body)
+    serveErrorPage(response);
   // 200/201 -> has a body with content + content type header already filled in readFile
   //  else       -> has no body or optional (POST, DELETE)???
   DEBUG_MSG_2("ResponseHandler::responseBuilder", "serveErrorPage(response);");
@@ -839,91 +1333,186 @@ void ResponseHandler::responseBuilder(HttpResponse &response)
 
   DEBUG_MSG_2("ResponseHandler::responseBuilder", "getStatusMessage(response.status_code);");
 
-  if (!response.body.empty())
+  if (response.bodyLength() > 0)
   {
     DEBUG_MSG_2("ResponseHandler::responseBuilder", "response.body.empty() not an issue");
     if (response.headers["Content-Type"].empty())     // mandatory if body present (e.g. errors)
       response.headers["Content-Type"] = "text/html"; // use as default
+    compressResponse(response);
     std::ostringstream oss;
-    oss << response.body.length();
+    oss << response.bodyLength();
     response.headers["Content-Length"] = oss.str();
   }
   DEBUG_MSG_2("ResponseHandler::responseBuilder", "generateDateHeader() is an issue");
 
-  response.headers["Date"] = generateDateHeader();
-  response.headers["Server"] = "MAC_Server/1.0";
+  // Date and Server are appended by generateRawResponseStr
+  applyCachePolicy(response);
   if (response.close_connection == true && response.headers.find("Connection") == response.headers.end())
     response.headers["Connection"] = "close";
   DEBUG_MSG_2("\n..............Response complete..............\n", "");
 }
 
-std::string ResponseHandler::generateDateHeader()
+std::string ResponseHandler::cached_date;
+std::time_t ResponseHandler::cached_date_time = 0;
+
+// called by the event loop every iteration, re-formats the Date value at most once per second
+void ResponseHandler::refreshDateHeader()
 {
   std::time_t now = std::time(0);
-  std::tm *gmtm = std::gmtime(&now);
+  if (now == cached_date_time && !cached_date.empty())
+    return;
+  cached_date_time = now;
+  cached_date = formatHttpDate(now);
+}
+
+const std::string &ResponseHandler::generateDateHeader()
+{
+  if (cached_date.empty())
+    refreshDateHeader();
+  return cached_date;
+}
+
+// IMF-fixdate as used by Date and Last-Modified, e.g. "Sun, 06 Nov 1994 08:49:37 GMT"
+std::string ResponseHandler::formatHttpDate(std::time_t time)
+{
+  std::tm gmtm;
+  gmtime_r(&time, &gmtm);
 
   char dateStr[30];
-  std::strftime(dateStr, sizeof(dateStr), "%a, %d %b %Y %H:%M:%S GMT", gmtm);
+  std::strftime(dateStr, sizeof(dateStr), "%a, %d %b %Y %H:%M:%S GMT", &gmtm);
 
   return std::string(dateStr);
 }
 
-void ResponseHandler::serveErrorPage(HttpResponse &response)
+bool ResponseHandler::parseHttpDate(const std::string &date, std::time_t &time)
 {
-  std::string file_path = buildFullPath(response.status_code);
-  response.body = read_error_file(file_path);
-  response.close_connection = true;
-  response.headers["Connection"] = "close";
+  std::tm tm;
+  std::memset(&tm, 0, sizeof(tm));
+  const char *end = strptime(date.c_str(), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+  if (end == NULL || *end != '\0')
+    return false;
+  time = timegm(&tm);
+  return time != -1;
+}
 
-  if (response.is_cgi_response == false)
-  {
-    response.body = read_error_file(file_path);
-    if (response.body.empty())
-    {
-      response.status_code = 500;
-      return;
-    }
-    // alternatively we could just create the html using a template + status code & msg
-    response.close_connection = true;
-    response.headers["Connection"] = "close";
-  }
-  return;
+// gzip_types of the route, or only text/html if the location does not list any (same default as nginx)
+bool ResponseHandler::isCompressibleType(const Route &route, const HttpResponse &response)
+{
+  std::map<std::string, std::string>::const_iterator it = response.headers.find("Content-Type");
+  if (it == response.headers.end())
+    return false;
+  std::string type = it->second.substr(0, it->second.find(';'));
+  if (route.gzip_types.empty())
+    return type == "text/html";
+  return route.gzip_types.find(type) != route.gzip_types.end();
 }
 
-std::string ResponseHandler::buildFullPath(int status_code)
+// Whether the location gzips this response, apart from its size: a 200 of a compressible type that
+// is not encoded yet (e.g. a .gz sidecar). Such responses vary on Accept-Encoding, GET or HEAD alike
+bool ResponseHandler::gzipEligible(const HttpResponse &response)
 {
-  std::ostringstream oss;
-  oss << status_code;
+  const Route *route = response.route;
+  return route && route->gzip && response.status_code == 200 &&
+         response.headers.find("Content-Encoding") == response.headers.end() && isCompressibleType(*route, response);
+}
 
-  std::string full_path = ROOT_DIR;
-  full_path += ERROR_PATH;
-  full_path += oss.str();
-  full_path += ".html";
+// On-the-fly compression stage, runs on the finished body right before Content-Length is set.
+// Skipped for bodies that are already encoded or too small to be worth it
+void ResponseHandler::compressResponse(HttpResponse &response)
+{
+  const Route *route = response.route;
+  if (!gzipEligible(response) || response.body.empty() || response.body.size() < route->gzip_min_length)
+    return;
+  response.setHeader("Vary", "Accept-Encoding");
+  if (!response.gzip_accepted)
+    return;
 
-  return full_path;
+  std::string compressed;
+  if (!GzipEncoder::compress(response.body, compressed, route->gzip_comp_level, route->gzip_max_memory))
+    return;
+  DEBUG_MSG_1("Gzip bytes in", response.body.size());
+  DEBUG_MSG_1("Gzip bytes out", compressed.size());
+  if (compressed.size() >= response.body.size())
+    return;
+  response.body.swap(compressed);
+  response.setHeader("Content-Encoding", "gzip");
+  weakenETag(response);
 }
 
-std::string ResponseHandler::read_error_file(std::string &file_path)
+// the compressed bytes differ from the file the strong validator was made for
+void ResponseHandler::weakenETag(HttpResponse &response)
 {
-  DEBUG_MSG("Trying to read error file path: ", file_path);
-  std::ifstream file;
+  std::map<std::string, std::string>::iterator etag = response.headers.find("ETag");
+  if (etag != response.headers.end() && etag->second.compare(0, 2, "W/") != 0)
+    etag->second = "W/" + etag->second;
+}
 
-  file.open(file_path.c_str(), std::ios::in | std::ios::binary);
-  DEBUG_MSG_3("READ ERROR File Trying to read error file path: ", file_path);
+// compressResponse() for a body that is sent while it is produced (streamed CGI output): its size is
+// unknown, so gzip_min_length does not apply. The caller sets Content-Encoding once its encoder is ready
+bool ResponseHandler::compressesStream(HttpResponse &response)
+{
+  if (!gzipEligible(response))
+    return false;
+  response.setHeader("Vary", "Accept-Encoding");
+  return response.gzip_accepted;
+}
 
-  if (!file.is_open())
+// Emits the location's caching policy on successful responses (and on 304, which must repeat it).
+// An expires rule for the MIME type wins over the location wide cache_control, a Cache-Control
+// set by the handler itself (e.g. a CGI script) is left alone
+void ResponseHandler::applyCachePolicy(HttpResponse &response)
+{
+  const Route *route = response.route;
+  if (!route || (route->cache_control.empty() && route->expires.empty()))
+    return;
+  if (response.status_code != 200 && response.status_code != 206 && response.status_code != 304)
+    return;
+  if (response.headers.find("Cache-Control") != response.headers.end())
+    return;
+
+  std::string type = response.file_content_type;
+  std::map<std::string, std::string>::const_iterator it = response.headers.find("Content-Type");
+  if (type.empty() && it != response.headers.end())
+    type = it->second.substr(0, it->second.find(';'));
+
+  const ExpiresRule *rule = findExpiresRule(*route, type);
+  if (rule)
   {
-    DEBUG_MSG_1("Error reading ERROR file", "");
-    return "";
+    response.setHeader("Cache-Control", rule->cache_control);
+    // a negative duration gives a date in the past: already expired, as nginx does
+    response.setHeader("Expires", formatHttpDate(std::time(0) + rule->seconds));
   }
+  else if (!route->cache_control.empty())
+    response.setHeader("Cache-Control", route->cache_control);
+}
 
-  std::ostringstream buffer;
-  buffer << file.rdbuf();
-  DEBUG_MSG_3("READ ERROR File done Trying to read error file path: ", file_path);
+// exact type first, then "major/*", then the "*" catch-all
+const ExpiresRule *ResponseHandler::findExpiresRule(const Route &route, const std::string &type)
+{
+  if (route.expires.empty())
+    return NULL;
+  std::map<std::string, ExpiresRule>::const_iterator it = route.expires.find(type);
+  if (it == route.expires.end())
+    it = route.expires.find(type.substr(0, type.find('/')) + "/*");
+  if (it == route.expires.end())
+    it = route.expires.find("*");
+  return it == route.expires.end() ? NULL : &it->second;
+}
 
-  file.close();
+// error pages come from the server's preloaded copies, no disk access per error
+void ResponseHandler::serveErrorPage(HttpResponse &response)
+{
+  if (!response.server || !response.server->getErrorPageBody(response.status_code, response.body))
+    response.body.clear();
+  response.headers.erase("Content-Type"); // described the replaced body
+  response.close_connection = true;
+  response.headers["Connection"] = "close";
 
-  return buffer.str();
+  if (response.is_cgi_response == false && response.body.empty())
+  {
+    DEBUG_MSG_1("No error page loaded for status", response.status_code);
+    response.status_code = 500;
+  }
 }
 
 //-----------------
@@ -941,45 +1530,5 @@ std::string ResponseHandler::read_error_file(std::string &file_path)
 // Convert status code to status message
 std::string ResponseHandler::getStatusMessage(int code)
 {
-  switch (code)
-  {
-  case 200:
-    return "OK";
-  case 201:
-    return "Created";
-  case 202:
-    return "Accepted";
-  case 204:
-    return "No Content";
-  case 301:
-    return "Moved Permanently";
-  case 400:
-    return "Bad Request";
-  case 401:
-    return "Unauthorized";
-  case 403:
-    return "Forbidden";
-  case 404:
-    return "Not Found";
-  case 405:
-    return "Method Not Allowed";
-  case 408:
-    return "Request Time-out";
-  case 415:
-    return "Unsupported Media Type";
-  case 500:
-    return "Internal Server Error";
-  case 501:
-    return "Not Implemented";
-  case 502:
-    return "Bad Gateway";
-  case 503:
-    return "Service Unavailable";
-  case 504:
-    return "Gateway Time-out";
-  case 505:
-    return "HTTP Version not supported";
-  default:
-    return "Unknown";
-  }
+  return HttpResponse::reasonPhrase(code);
 }
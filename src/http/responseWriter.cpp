@@ -0,0 +1,136 @@
+#include "../../include/responseWriter.hpp"
+#include "../../include/debug.hpp"
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+
+ResponseWriter::ResponseWriter(HttpResponse &response) : body_fd(-1), current(0), piece_offset(0), remaining(0)
+{
+  header_block = response.generateHeaderBlock();
+  pieces.push_back(WritePiece(header_block.data(), 0, header_block.size()));
+  remaining = header_block.size();
+
+  // HEAD responses carry no body, Content-Length still describes the GET body; 1xx, 204 and 304 never
+  // have one. Other redirects send what they were given (a FastCGI 302 may come with a body)
+  if (response.head_only || response.status_code < 200 || response.status_code == 204 || response.status_code == 304)
+    return;
+
+  // take the buffers over instead of copying them
+  body.swap(response.body);
+  segments.swap(response.segments);
+  body_fd = response.body_fd;
+  response.body_fd = -1;
+
+  if (!body.empty())
+    pieces.push_back(WritePiece(body.data(), 0, body.size()));
+  for (std::vector<BodySegment>::const_iterator it = segments.begin(); it != segments.end(); ++it)
+  {
+    if (!it->data.empty())
+      pieces.push_back(WritePiece(it->data.data(), 0, it->data.size()));
+    if (it->length > 0 && body_fd >= 0)
+      pieces.push_back(WritePiece(NULL, it->offset, it->length));
+  }
+  for (std::vector<WritePiece>::const_iterator it = pieces.begin() + 1; it != pieces.end(); ++it)
+    remaining += it->length;
+}
+
+ResponseWriter::~ResponseWriter()
+{
+  if (body_fd >= 0)
+    close(body_fd);
+}
+
+size_t ResponseWriter::bytesRemaining() const
+{
+  return remaining;
+}
+
+// sends as much as the socket takes; call again on POLLOUT while it returns WRITE_AGAIN
+WriteStatus ResponseWriter::write(int fd)
+{
+  while (current < pieces.size())
+  {
+    WriteStatus status = pieces[current].data ? writeMemory(fd) : writeFile(fd);
+    if (status != WRITE_DONE)
+      return status;
+  }
+  return WRITE_DONE;
+}
+
+// gathers the consecutive memory pieces starting at the cursor into one sendmsg
+WriteStatus ResponseWriter::writeMemory(int fd)
+{
+  struct iovec iov[WRITER_MAX_IOV];
+  size_t count = 0;
+  for (size_t i = current; i < pieces.size() && pieces[i].data && count < WRITER_MAX_IOV; ++i)
+  {
+    size_t skip = (i == current) ? piece_offset : 0;
+    iov[count].iov_base = const_cast<char *>(pieces[i].data + skip);
+    iov[count].iov_len = pieces[i].length - skip;
+    ++count;
+  }
+
+  struct msghdr msg;
+  std::memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = count;
+  ssize_t sent = sendmsg(fd, &msg, MSG_NOSIGNAL);
+  if (sent < 0)
+  {
+    if (errno == EAGAIN || errno == EWOULDBLOCK)
+      return WRITE_AGAIN;
+    if (errno == EINTR)
+      return WRITE_DONE;
+    DEBUG_MSG_2("Send error ", strerror(errno));
+    return WRITE_ERROR;
+  }
+  advance(sent);
+  return WRITE_DONE;
+}
+
+// file ranges go from the page cache to the socket without passing through user space
+WriteStatus ResponseWriter::writeFile(int fd)
+{
+  const WritePiece &piece = pieces[current];
+  off_t offset = piece.offset + piece_offset;
+  ssize_t sent = sendfile(fd, body_fd, &offset, piece.length - piece_offset);
+  if (sent < 0)
+  {
+    if (errno == EAGAIN || errno == EWOULDBLOCK)
+      return WRITE_AGAIN;
+    if (errno == EINTR)
+      return WRITE_DONE;
+    DEBUG_MSG_2("Sendfile error ", strerror(errno));
+    return WRITE_ERROR;
+  }
+  if (sent == 0)
+  {
+    DEBUG_MSG_2("Sendfile error ", "file shrank while sending");
+    return WRITE_ERROR;
+  }
+  advance(sent);
+  return WRITE_DONE;
+}
+
+void ResponseWriter::advance(size_t bytes)
+{
+  remaining -= bytes;
+  while (bytes > 0 && current < pieces.size())
+  {
+    size_t left = pieces[current].length - piece_offset;
+    if (bytes < left)
+    {
+      piece_offset += bytes;
+      return;
+    }
+    bytes -= left;
+    ++current;
+    piece_offset = 0;
+  }
+  // skip empty pieces so write() never issues a zero-length call
+  while (current < pieces.size() && pieces[current].length == 0)
+    ++current;
+}
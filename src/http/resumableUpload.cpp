@@ -0,0 +1,217 @@
+#include "../../include/resumableUpload.hpp"
+#include "../../include/scopedLock.hpp"
+#include "../../include/metrics.hpp"
+#include "../../include/debug.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <unistd.h>
+
+pthread_mutex_t ResumableUpload::mutex = PTHREAD_MUTEX_INITIALIZER;
+std::map<std::string, ResumableUpload::Session *> ResumableUpload::sessions;
+
+static bool parseOffset(const char *&cursor, off_t &value)
+{
+    if (!std::isdigit(static_cast<unsigned char>(*cursor)))
+        return false;
+    char *end;
+    errno = 0;
+    long long parsed = std::strtoll(cursor, &end, 10);
+    if (errno == ERANGE)
+        return false;
+    value = parsed;
+    cursor = end;
+    return true;
+}
+
+// "bytes <start>-<end>/<total>", end inclusive. The total must be known ("*" is refused)
+bool ResumableUpload::parseContentRange(const std::string &value, off_t &start, off_t &end, off_t &total)
+{
+    if (value.compare(0, 6, "bytes ") != 0)
+        return false;
+    const char *cursor = value.c_str() + 6;
+    if (!parseOffset(cursor, start) || *cursor++ != '-' || !parseOffset(cursor, end) || *cursor++ != '/' ||
+        !parseOffset(cursor, total) || *cursor != '\0')
+        return false;
+    return start <= end && end < total && total <= RESUMABLE_MAX_SIZE;
+}
+
+// Writes data (end - start + 1 bytes) at its offset. The upload that completes the file publishes it
+SegmentResult ResumableUpload::writeSegment(const std::string &path, off_t start, off_t end, off_t total,
+                                            const char *data, FsyncPolicy policy, UploadProgress &progress)
+{
+    Session *session;
+    {
+        ScopedLock lock(mutex);
+        SegmentResult error = SEGMENT_ERROR;
+        session = acquire(path, total, policy, error);
+        if (!session)
+            return error;
+        session->writers++;
+    }
+
+    bool written = true;
+    size_t length = end - start + 1;
+    off_t offset = start;
+    while (length > 0)
+    {
+        ssize_t count = pwrite(session->file.fd(), data, length, offset);
+        if (count == -1 && errno == EINTR)
+            continue;
+        if (count <= 0)
+        {
+            DEBUG_MSG_1("Segment write failed", strerror(errno));
+            written = false;
+            break;
+        }
+        data += count;
+        offset += count;
+        length -= count;
+    }
+
+    {
+        ScopedLock lock(mutex);
+        session->writers--;
+        session->last_active = time(0);
+        if (written)
+        {
+            addRange(*session, start, end + 1);
+            Metrics::increment("resumable_segments_total");
+        }
+        else
+            session->failed = true;
+        fillProgress(*session, progress);
+        if (session->failed)
+            return SEGMENT_ERROR;
+        // concurrent writers of the same upload: whoever leaves last with all ranges present publishes
+        if (session->received < session->total || session->writers > 0)
+            return SEGMENT_STORED;
+        sessions.erase(path);
+        Metrics::setGauge("resumable_uploads_active", sessions.size());
+    }
+
+    PublishResult result = session->file.publish();
+    delete session;
+    if (result == PUBLISH_OK)
+        return SEGMENT_COMPLETE;
+    return result == PUBLISH_EXISTS ? SEGMENT_CONFLICT : SEGMENT_ERROR;
+}
+
+// false if no upload to path is running
+bool ResumableUpload::progress(const std::string &path, UploadProgress &progress)
+{
+    ScopedLock lock(mutex);
+    std::map<std::string, Session *>::const_iterator it = sessions.find(path);
+    if (it == sessions.end())
+        return false;
+    fillProgress(*it->second, progress);
+    return true;
+}
+
+// The running upload to path, or a new one: an unnamed file next to path, truncated to total so it
+// is sparse until the segments fill it
+ResumableUpload::Session *ResumableUpload::acquire(const std::string &path, off_t total, FsyncPolicy policy, SegmentResult &error)
+{
+    time_t now = time(0);
+    reapIdle(now);
+    std::map<std::string, Session *>::iterator it = sessions.find(path);
+    if (it != sessions.end())
+    {
+        if (it->second->failed)
+        {
+            DEBUG_MSG("Segment for an upload whose write failed", path);
+            return NULL; // error stays SEGMENT_ERROR
+        }
+        if (it->second->total == total)
+            return it->second;
+        DEBUG_MSG("Segment total differs from the running upload", path);
+        error = SEGMENT_CONFLICT;
+        return NULL;
+    }
+    if (sessions.size() >= RESUMABLE_MAX_SESSIONS)
+    {
+        Metrics::increment("resumable_uploads_refused_total");
+        error = SEGMENT_BUSY;
+        return NULL;
+    }
+
+    Session *session = new Session;
+    session->total = total;
+    session->received = 0;
+    session->writers = 0;
+    session->failed = false;
+    session->last_active = now;
+    if (!session->file.open(path, policy) || ftruncate(session->file.fd(), total) != 0)
+    {
+        DEBUG_MSG_1("Can't create resumable upload file", path);
+        delete session;
+        error = SEGMENT_ERROR;
+        return NULL;
+    }
+    sessions[path] = session;
+    Metrics::setGauge("resumable_uploads_active", sessions.size());
+    return session;
+}
+
+// inserts [start, end) and merges it with every range it overlaps or touches
+void ResumableUpload::addRange(Session &session, off_t start, off_t end)
+{
+    std::map<off_t, off_t>::iterator it = session.ranges.upper_bound(start);
+    if (it != session.ranges.begin())
+    {
+        --it;
+        if (it->second >= start)
+        {
+            start = it->first;
+            end = std::max(end, it->second);
+            session.received -= it->second - it->first;
+            session.ranges.erase(it++);
+        }
+        else
+            ++it;
+    }
+    while (it != session.ranges.end() && it->first <= end)
+    {
+        end = std::max(end, it->second);
+        session.received -= it->second - it->first;
+        session.ranges.erase(it++);
+    }
+    session.ranges[start] = end;
+    session.received += end - start;
+}
+
+void ResumableUpload::fillProgress(const Session &session, UploadProgress &progress)
+{
+    std::ostringstream ranges;
+    for (std::map<off_t, off_t>::const_iterator it = session.ranges.begin(); it != session.ranges.end(); ++it)
+    {
+        if (it != session.ranges.begin())
+            ranges << ",";
+        ranges << it->first << "-" << it->second - 1;
+    }
+    progress.total = session.total;
+    progress.received = session.received;
+    progress.ranges = ranges.str();
+}
+
+// drops (and so discards the data of) uploads nobody continued for RESUMABLE_IDLE_TIMEOUT
+void ResumableUpload::reapIdle(time_t now)
+{
+    std::map<std::string, Session *>::iterator it = sessions.begin();
+    while (it != sessions.end())
+    {
+        if (it->second->writers == 0 && now - it->second->last_active > RESUMABLE_IDLE_TIMEOUT)
+        {
+            DEBUG_MSG("Dropping abandoned upload", it->first);
+            Metrics::increment("resumable_uploads_expired_total");
+            delete it->second;
+            sessions.erase(it++);
+        }
+        else
+            ++it;
+    }
+    Metrics::setGauge("resumable_uploads_active", sessions.size());
+}
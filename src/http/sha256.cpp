@@ -0,0 +1,133 @@
+#include "../../include/sha256.hpp"
+#include <cstring>
+
+static const uint32_t round_constants[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+static inline uint32_t rotateRight(uint32_t value, unsigned bits)
+{
+    return (value >> bits) | (value << (32 - bits));
+}
+
+Sha256::Sha256() : block_length(0), total_length(0)
+{
+    state[0] = 0x6a09e667;
+    state[1] = 0xbb67ae85;
+    state[2] = 0x3c6ef372;
+    state[3] = 0xa54ff53a;
+    state[4] = 0x510e527f;
+    state[5] = 0x9b05688c;
+    state[6] = 0x1f83d9ab;
+    state[7] = 0x5be0cd19;
+}
+
+void Sha256::update(const char *data, size_t length)
+{
+    const unsigned char *input = reinterpret_cast<const unsigned char *>(data);
+    total_length += length;
+    if (block_length > 0)
+    {
+        size_t take = SHA256_BLOCK_SIZE - block_length;
+        if (take > length)
+            take = length;
+        std::memcpy(block + block_length, input, take);
+        block_length += take;
+        input += take;
+        length -= take;
+        if (block_length < SHA256_BLOCK_SIZE)
+            return;
+        transform(block);
+        block_length = 0;
+    }
+    // whole blocks straight from the input, no copy
+    while (length >= SHA256_BLOCK_SIZE)
+    {
+        transform(input);
+        input += SHA256_BLOCK_SIZE;
+        length -= SHA256_BLOCK_SIZE;
+    }
+    std::memcpy(block, input, length);
+    block_length = length;
+}
+
+// pads, processes the last block(s) and returns the digest as 64 lowercase hex characters
+std::string Sha256::hexDigest()
+{
+    uint64_t bit_length = total_length * 8;
+    block[block_length++] = 0x80;
+    if (block_length > SHA256_BLOCK_SIZE - 8)
+    {
+        std::memset(block + block_length, 0, SHA256_BLOCK_SIZE - block_length);
+        transform(block);
+        block_length = 0;
+    }
+    std::memset(block + block_length, 0, SHA256_BLOCK_SIZE - 8 - block_length);
+    for (int i = 0; i < 8; ++i)
+        block[SHA256_BLOCK_SIZE - 1 - i] = static_cast<unsigned char>(bit_length >> (8 * i));
+    transform(block);
+
+    static const char hex[] = "0123456789abcdef";
+    std::string digest;
+    digest.reserve(SHA256_DIGEST_SIZE * 2);
+    for (int i = 0; i < 8; ++i)
+    {
+        for (int shift = 28; shift >= 0; shift -= 4)
+            digest += hex[(state[i] >> shift) & 0xf];
+    }
+    return digest;
+}
+
+std::string Sha256::hash(const std::string &data)
+{
+    Sha256 sha;
+    sha.update(data.data(), data.size());
+    return sha.hexDigest();
+}
+
+void Sha256::transform(const unsigned char *chunk)
+{
+    uint32_t w[64];
+    for (int i = 0; i < 16; ++i)
+        w[i] = (uint32_t)chunk[i * 4] << 24 | (uint32_t)chunk[i * 4 + 1] << 16 | (uint32_t)chunk[i * 4 + 2] << 8 | chunk[i * 4 + 3];
+    for (int i = 16; i < 64; ++i)
+    {
+        uint32_t s0 = rotateRight(w[i - 15], 7) ^ rotateRight(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = rotateRight(w[i - 2], 17) ^ rotateRight(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+    for (int i = 0; i < 64; ++i)
+    {
+        uint32_t s1 = rotateRight(e, 6) ^ rotateRight(e, 11) ^ rotateRight(e, 25);
+        uint32_t choice = (e & f) ^ (~e & g);
+        uint32_t temp1 = h + s1 + choice + round_constants[i] + w[i];
+        uint32_t s0 = rotateRight(a, 2) ^ rotateRight(a, 13) ^ rotateRight(a, 22);
+        uint32_t majority = (a & b) ^ (a & c) ^ (b & c);
+        uint32_t temp2 = s0 + majority;
+        h = g;
+        g = f;
+        f = e;
+        e = d + temp1;
+        d = c;
+        c = b;
+        b = a;
+        a = temp1 + temp2;
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g;
+    state[7] += h;
+}
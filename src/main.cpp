@@ -21,7 +21,8 @@
 
 int main(int argc, char *argv[])
 {
-    signal(SIGCHLD, SIG_IGN);
+    // a CGI script that exits before reading its whole body makes writes to its stdin fail with EPIPE
+    signal(SIGPIPE, SIG_IGN);
 
     (void)argc;
     std::string config_path;
@@ -84,6 +84,29 @@ bool Parser::parseLocationBlock(std::istream &config_file, Server &server)
             {
                 route.content_type.insert(value_array.begin(), value_array.end());
             }
+            if (key == "gzip_types")
+            {
+                route.gzip_types.insert(value_array.begin(), value_array.end());
+            }
+            if (key == "fastcgi_pass")
+            {
+                for (std::set<std::string>::iterator it = value_array.begin(); it != value_array.end(); ++it)
+                {
+                    struct sockaddr_storage addr;
+                    socklen_t addr_len;
+                    if (!FastCGI::parseAddress(*it, addr, addr_len))
+                        throw std::runtime_error("Invalid fastcgi_pass address (expected unix:/path or ip:port): " + *it);
+                    route.fastcgi_pass.push_back(*it);
+                }
+            }
+            if (key == "expires")
+            {
+                for (std::set<std::string>::iterator it = value_array.begin(); it != value_array.end(); ++it)
+                {
+                    if (!parseExpiresRule(*it, route))
+                        throw std::runtime_error("Invalid expires entry (expected \"<mime type> <duration>\"): " + *it);
+                }
+            }
         }
         else if (result == KEY_VALUE_PAIR || result == KEY_VALUE_PAIR_WITH_QUOTES)
         {
@@ -116,6 +139,142 @@ bool Parser::parseLocationBlock(std::istream &config_file, Server &server)
                 {
                     route.autoindex = (value == "true" || value == "on" || value == "1");
                 }
+                if (key == "fsync_policy" && !AtomicFile::parseFsyncPolicy(value, route.fsync_policy))
+                {
+                    throw std::runtime_error("Invalid fsync_policy (expected none, data or full): " + value);
+                }
+                if (key == "dedup")
+                {
+                    route.dedup = (value == "true" || value == "on" || value == "1");
+                }
+                if (key == "metrics")
+                {
+                    route.metrics = (value == "true" || value == "on" || value == "1");
+                }
+                if (key == "gzip_static")
+                {
+                    route.gzip_static = (value == "true" || value == "on" || value == "1");
+                }
+                if (key == "gzip")
+                {
+                    route.gzip = (value == "true" || value == "on" || value == "1");
+                }
+                if (key == "gzip_min_length")
+                {
+                    route.gzip_min_length = strtoul(value.c_str(), NULL, 10);
+                }
+                if (key == "shard_depth")
+                {
+                    int depth = atoi(value.c_str());
+                    if (depth < 0 || depth > SHARD_MAX_DEPTH || value.find_first_not_of("0123456789") != std::string::npos)
+                        throw std::runtime_error("Invalid shard_depth (0-3): " + value);
+                    route.shard_depth = depth;
+                }
+                if (key == "fastcgi_max_conns")
+                {
+                    int conns = atoi(value.c_str());
+                    if (conns < 1 || conns > 1024 || value.find_first_not_of("0123456789") != std::string::npos)
+                        throw std::runtime_error("Invalid fastcgi_max_conns (1-1024): " + value);
+                    route.fastcgi_max_conns = conns;
+                }
+                if (key == "fastcgi_timeout")
+                {
+                    int timeout = atoi(value.c_str());
+                    if (timeout < 1 || value.find_first_not_of("0123456789") != std::string::npos)
+                        throw std::runtime_error("Invalid fastcgi_timeout (seconds): " + value);
+                    route.fastcgi_timeout = timeout;
+                }
+                if (key == "cgi_pool_min" || key == "cgi_pool_max")
+                {
+                    int workers = atoi(value.c_str());
+                    if (workers < 0 || workers > CGI_POOL_MAX_WORKERS || value.find_first_not_of("0123456789") != std::string::npos)
+                        throw std::runtime_error("Invalid " + key + " (0-256): " + value);
+                    if (key == "cgi_pool_min")
+                        route.cgi_pool_min = workers;
+                    else
+                        route.cgi_pool_max = workers;
+                }
+                if (key == "cgi_pool_max_requests")
+                {
+                    if (value.find_first_not_of("0123456789") != std::string::npos || strtoul(value.c_str(), NULL, 10) == 0)
+                        throw std::runtime_error("Invalid cgi_pool_max_requests: " + value);
+                    route.cgi_pool_max_requests = strtoul(value.c_str(), NULL, 10);
+                }
+                if (key == "cgi_pool_idle_timeout")
+                {
+                    int timeout = atoi(value.c_str());
+                    if (timeout < 1 || value.find_first_not_of("0123456789") != std::string::npos)
+                        throw std::runtime_error("Invalid cgi_pool_idle_timeout (seconds): " + value);
+                    route.cgi_pool_idle_timeout = timeout;
+                }
+                if (key == "fastcgi_root")
+                {
+                    route.fastcgi_root = value;
+                }
+                if (key == "sendfile_root")
+                {
+                    route.sendfile_root = value;
+                }
+                if (key == "cgi_splice")
+                {
+                    route.cgi_splice = (value == "true" || value == "on" || value == "1");
+                }
+                if (key == "cgi_pipe_size")
+                {
+                    // the kernel rounds up to pages and caps unprivileged requests at fs.pipe-max-size (1M)
+                    if (value.empty() || value.find_first_not_of("0123456789") != std::string::npos)
+                        throw std::runtime_error("Invalid cgi_pipe_size: " + value);
+                    route.cgi_pipe_size = strtoul(value.c_str(), NULL, 10);
+                }
+                if (key == "cgi_max_procs" || key == "cgi_queue_max")
+                {
+                    if (value.empty() || value.find_first_not_of("0123456789") != std::string::npos)
+                        throw std::runtime_error("Invalid " + key + ": " + value);
+                    if (key == "cgi_max_procs")
+                        route.cgi_max_procs = strtoul(value.c_str(), NULL, 10);
+                    else
+                        route.cgi_queue_max = strtoul(value.c_str(), NULL, 10);
+                }
+                if (key == "cgi_queue_timeout")
+                {
+                    int timeout = atoi(value.c_str());
+                    if (timeout < 1 || value.find_first_not_of("0123456789") != std::string::npos)
+                        throw std::runtime_error("Invalid cgi_queue_timeout (seconds): " + value);
+                    route.cgi_queue_timeout = timeout;
+                }
+                if (key == "cgi_cache")
+                {
+                    route.cgi_cache = (value == "true" || value == "on" || value == "1");
+                }
+                if (key == "cgi_cache_ttl" || key == "cgi_cache_stale")
+                {
+                    if (value.empty() || value.find_first_not_of("0123456789") != std::string::npos)
+                        throw std::runtime_error("Invalid " + key + " (seconds): " + value);
+                    if (key == "cgi_cache_ttl")
+                        route.cgi_cache_ttl = atoi(value.c_str());
+                    else
+                        route.cgi_cache_stale = atoi(value.c_str());
+                }
+                if (key == "gzip_comp_level")
+                {
+                    int level = atoi(value.c_str());
+                    if (level < 1 || level > 9)
+                        throw std::runtime_error("Invalid gzip_comp_level (1-9): " + value);
+                    route.gzip_comp_level = level;
+                }
+                if (key == "gzip_max_memory")
+                {
+                    route.gzip_max_memory = strtoul(value.c_str(), NULL, 10);
+                }
+                if (key == "cache_control")
+                {
+                    route.cache_control = value;
+                }
+                if (key == "immutable" && (value == "true" || value == "on" || value == "1") && route.cache_control.empty())
+                {
+                    // fingerprinted assets never change under the same URL: cache for a year, skip revalidation
+                    route.cache_control = "public, max-age=31536000, immutable";
+                }
             }
         }
     }
@@ -129,6 +288,50 @@ bool Parser::parseLocationBlock(std::istream &config_file, Server &server)
     return true;
 }
 
+// "image/png 30d" -> expires["image/png"] with the Cache-Control value rendered up front
+bool Parser::parseExpiresRule(const std::string &entry, Route &route)
+{
+    std::istringstream stream(entry);
+    std::string type, duration, extra;
+    if (!(stream >> type >> duration) || (stream >> extra))
+        return false;
+
+    ExpiresRule rule;
+    if (!parseDuration(duration, rule.seconds))
+        return false;
+    if (rule.seconds < 0)
+        rule.cache_control = "no-cache";
+    else
+    {
+        std::ostringstream oss;
+        oss << "max-age=" << rule.seconds;
+        rule.cache_control = oss.str();
+    }
+    route.expires[type] = rule;
+    return true;
+}
+
+// accepts plain seconds or a number with an s/m/h/d suffix, "-1" disables caching
+bool Parser::parseDuration(const std::string &value, long &seconds)
+{
+    char *end;
+    seconds = strtol(value.c_str(), &end, 10);
+    if (end == value.c_str())
+        return false;
+    std::string unit(end);
+    if (unit.empty() || unit == "s")
+        return true;
+    if (unit == "m")
+        seconds *= 60;
+    else if (unit == "h")
+        seconds *= 3600;
+    else if (unit == "d")
+        seconds *= 86400;
+    else
+        return false;
+    return true;
+}
+
 bool Parser::checkMaxBodySize(const std::string &value)
 {
     char *end;
@@ -379,6 +582,22 @@ bool Parser::parseErrorBlock(std::istream &config_file, Server &server)
     return true;
 }
 
+// "Name: value" with a token name and no CR/LF, normalized to "Name: value"
+bool Parser::parseHeaderLine(const std::string &entry, std::string &header)
+{
+    std::string::size_type colon = entry.find(':');
+    if (colon == std::string::npos || colon == 0 || entry.find_first_of("\r\n") != std::string::npos)
+        return false;
+    std::string name = entry.substr(0, colon);
+    if (name.find_first_of(" \t\"(),/;<=>?@[]{}") != std::string::npos)
+        return false;
+    std::string::size_type value_start = entry.find_first_not_of(" \t", colon + 1);
+    if (value_start == std::string::npos)
+        return false;
+    header = name + ": " + entry.substr(value_start);
+    return true;
+}
+
 bool Parser::parseServerBlock(std::istream &config_file, Server &server)
 {
     std::string line;
@@ -398,6 +617,23 @@ bool Parser::parseServerBlock(std::istream &config_file, Server &server)
             }
             return false;
         }
+        if (checkKeyPair(line) == KEY_ARRAY_PAIR)
+        {
+            std::set<std::string> value_array;
+            if (!parseKeyArray(line, key, value_array))
+                return false;
+            if (key == "add_header")
+            {
+                for (std::set<std::string>::iterator it = value_array.begin(); it != value_array.end(); ++it)
+                {
+                    std::string header;
+                    if (!parseHeaderLine(*it, header))
+                        throw std::runtime_error("Invalid add_header entry (expected \"Name: value\"): " + *it);
+                    server.add_headers.push_back(header);
+                }
+            }
+            continue;
+        }
         if (!parseKeyValue(line, key, value))
             return false;
         if (key == "listen")
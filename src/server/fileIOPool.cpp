@@ -0,0 +1,156 @@
+#include "../../include/fileIOPool.hpp"
+#include "../../include/responseHandler.hpp"
+#include "../../include/metrics.hpp"
+#include "../../include/scopedLock.hpp"
+#include "../../include/debug.hpp"
+#include <cerrno>
+#include <cstring>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+pthread_mutex_t FileIOPool::mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t FileIOPool::work_available = PTHREAD_COND_INITIALIZER;
+std::vector<pthread_t> FileIOPool::threads;
+std::deque<FileIOJob *> FileIOPool::queue;
+std::vector<FileIOJob *> FileIOPool::completed;
+int FileIOPool::event_fd = -1;
+bool FileIOPool::stopping = false;
+
+// Returns false if no worker could be started; submit() then refuses every job and the loop does the work
+bool FileIOPool::start(size_t workers)
+{
+    event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (event_fd == -1)
+    {
+        DEBUG_MSG_1("eventfd failed, file I/O stays on the event loop", strerror(errno));
+        return false;
+    }
+    for (size_t i = 0; i < workers; ++i)
+    {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, workerMain, NULL) != 0)
+        {
+            DEBUG_MSG_1("pthread_create failed", strerror(errno));
+            break;
+        }
+        threads.push_back(thread);
+    }
+    Metrics::setGauge("fileio_workers", threads.size());
+    DEBUG_MSG("File I/O workers started", threads.size());
+    return !threads.empty();
+}
+
+void FileIOPool::stop()
+{
+    {
+        ScopedLock lock(mutex);
+        stopping = true;
+        pthread_cond_broadcast(&work_available);
+    }
+    for (size_t i = 0; i < threads.size(); ++i)
+        pthread_join(threads[i], NULL);
+    threads.clear();
+    for (size_t i = 0; i < queue.size(); ++i)
+    {
+        delete queue[i]->response;
+        delete queue[i];
+    }
+    queue.clear();
+    for (size_t i = 0; i < completed.size(); ++i)
+    {
+        delete completed[i]->response;
+        delete completed[i];
+    }
+    completed.clear();
+    if (event_fd != -1)
+        close(event_fd);
+    event_fd = -1;
+}
+
+// Takes ownership of the response on success. Fails when the pool isn't running or the queue is full
+bool FileIOPool::submit(int fd, Server *server, const HttpRequest &request, HttpResponse *response)
+{
+    ScopedLock lock(mutex);
+    if (threads.empty() || stopping)
+        return false;
+    if (queue.size() >= FILEIO_QUEUE_MAX)
+    {
+        Metrics::increment("fileio_queue_full_total");
+        return false;
+    }
+    FileIOJob *job = new FileIOJob;
+    job->fd = fd;
+    job->server = server;
+    job->request = request;
+    job->response = response;
+    clock_gettime(CLOCK_MONOTONIC, &job->submitted);
+    queue.push_back(job);
+    Metrics::setGauge("fileio_queue_depth", queue.size());
+    Metrics::increment("fileio_jobs_submitted_total");
+    pthread_cond_signal(&work_available);
+    return true;
+}
+
+// moves the finished jobs to `jobs`; the caller sends each response and then calls finish()
+void FileIOPool::takeCompleted(std::vector<FileIOJob *> &jobs)
+{
+    uint64_t signals;
+    while (read(event_fd, &signals, sizeof(signals)) > 0)
+        ;
+    ScopedLock lock(mutex);
+    jobs.insert(jobs.end(), completed.begin(), completed.end());
+    completed.clear();
+}
+
+void FileIOPool::finish(FileIOJob *job)
+{
+    Metrics::observe("fileio_total_seconds", secondsSince(job->submitted));
+    delete job;
+}
+
+int FileIOPool::notifyFd()
+{
+    return event_fd;
+}
+
+void *FileIOPool::workerMain(void *arg)
+{
+    (void)arg;
+    while (true)
+    {
+        FileIOJob *job;
+        {
+            ScopedLock lock(mutex);
+            while (queue.empty() && !stopping)
+                pthread_cond_wait(&work_available, &mutex);
+            if (stopping)
+                return NULL;
+            job = queue.front();
+            queue.pop_front();
+            Metrics::setGauge("fileio_queue_depth", queue.size());
+        }
+        clock_gettime(CLOCK_MONOTONIC, &job->started);
+        Metrics::observe("fileio_queue_wait_seconds", secondsSince(job->submitted));
+
+        ResponseHandler handler;
+        handler.processRequest(job->fd, *job->server, job->request, *job->response);
+        Metrics::observe("fileio_service_seconds", secondsSince(job->started));
+
+        {
+            ScopedLock lock(mutex);
+            completed.push_back(job);
+        }
+        uint64_t one = 1;
+        if (write(event_fd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+            DEBUG_MSG_1("eventfd write failed", strerror(errno));
+    }
+    return NULL;
+}
+
+double FileIOPool::secondsSince(const struct timespec &start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+}
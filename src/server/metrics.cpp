@@ -0,0 +1,79 @@
+#include "../../include/metrics.hpp"
+#include "../../include/scopedLock.hpp"
+#include <sstream>
+
+// upper bounds in seconds, 100us .. 5s; everything slower lands in +Inf
+static const double bucket_bounds[] = {0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01,
+                                       0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5};
+static const size_t bucket_count = sizeof(bucket_bounds) / sizeof(bucket_bounds[0]);
+
+pthread_mutex_t Metrics::mutex = PTHREAD_MUTEX_INITIALIZER;
+std::map<std::string, double> Metrics::counters;
+std::map<std::string, double> Metrics::gauges;
+std::map<std::string, Metrics::Histogram> Metrics::histograms;
+
+Metrics::Histogram::Histogram() : buckets(bucket_count + 1, 0), count(0), sum(0) {}
+
+void Metrics::increment(const std::string &name, double value)
+{
+    ScopedLock lock(mutex);
+    counters[name] += value;
+}
+
+void Metrics::setGauge(const std::string &name, double value)
+{
+    ScopedLock lock(mutex);
+    gauges[name] = value;
+}
+
+void Metrics::addGauge(const std::string &name, double delta)
+{
+    ScopedLock lock(mutex);
+    gauges[name] += delta;
+}
+
+// gauge = counter / counter, computed under the lock so both counters are from the same moment
+void Metrics::setRatio(const std::string &name, const std::string &numerator, const std::string &denominator)
+{
+    ScopedLock lock(mutex);
+    double divisor = counters[denominator];
+    if (divisor > 0)
+        gauges[name] = counters[numerator] / divisor;
+}
+
+void Metrics::observe(const std::string &name, double seconds)
+{
+    ScopedLock lock(mutex);
+    Histogram &histogram = histograms[name];
+    size_t bucket = 0;
+    while (bucket < bucket_count && seconds > bucket_bounds[bucket])
+        ++bucket;
+    histogram.buckets[bucket]++;
+    histogram.count++;
+    histogram.sum += seconds;
+}
+
+std::string Metrics::render()
+{
+    ScopedLock lock(mutex);
+    std::ostringstream out;
+    for (std::map<std::string, double>::const_iterator it = counters.begin(); it != counters.end(); ++it)
+        out << "# TYPE " << it->first << " counter\n" << it->first << " " << it->second << "\n";
+    for (std::map<std::string, double>::const_iterator it = gauges.begin(); it != gauges.end(); ++it)
+        out << "# TYPE " << it->first << " gauge\n" << it->first << " " << it->second << "\n";
+    for (std::map<std::string, Histogram>::const_iterator it = histograms.begin(); it != histograms.end(); ++it)
+    {
+        const Histogram &histogram = it->second;
+        unsigned long cumulative = 0;
+        out << "# TYPE " << it->first << " histogram\n";
+        for (size_t i = 0; i < bucket_count; ++i)
+        {
+            cumulative += histogram.buckets[i];
+            out << it->first << "_bucket{le=\"" << bucket_bounds[i] << "\"} " << cumulative << "\n";
+        }
+        out << it->first << "_bucket{le=\"+Inf\"} " << histogram.count << "\n";
+        out << it->first << "_sum " << histogram.sum << "\n";
+        out << it->first << "_count " << histogram.count << "\n";
+    }
+    return out.str();
+}
@@ -1,6 +1,11 @@
 #include "../../include/server.hpp"
 #include "../../include/httpRequest.hpp"
 #include "../../include/webService.hpp"
+#include "../../include/scopedLock.hpp"
+#include <fstream>
+#include <dirent.h>
+
+pthread_mutex_t Server::error_pages_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 Server::Server(int listener_fd, std::string port, std::string name, std::string root_directory) : listener_fd(listener_fd), port(port), name(name), root_directory(root_directory) {}
 
@@ -69,6 +74,71 @@ void Server::setErrorPage(const int &code, const std::string &path)
     error_pages[code] = path;
 }
 
+// Reads every error page into memory so errors are served without touching the disk.
+// Defaults come from ROOT_DIR/errors/<code>.html, pages configured in [[server.error_page]] override them.
+// The new set is read off to the side and swapped in under the lock, workers never wait for the disk
+void Server::loadErrorPages()
+{
+    std::map<int, std::string> paths;
+    std::string default_dir = std::string(ROOT_DIR) + ERROR_PATH;
+    DIR *dir = opendir(default_dir.c_str());
+    if (dir)
+    {
+        struct dirent *entry;
+        while ((entry = readdir(dir)))
+        {
+            char *end;
+            long code = strtol(entry->d_name, &end, 10);
+            if (end != entry->d_name && std::string(end) == ".html" && code >= 400 && code < 600)
+                paths[code] = default_dir + entry->d_name;
+        }
+        closedir(dir);
+    }
+    for (std::map<int, std::string>::const_iterator it = error_pages.begin(); it != error_pages.end(); ++it)
+        paths[it->first] = it->second;
+
+    std::map<int, std::string> bodies;
+    for (std::map<int, std::string>::const_iterator it = paths.begin(); it != paths.end(); ++it)
+    {
+        std::ifstream file(it->second.c_str(), std::ios::in | std::ios::binary);
+        if (!file.is_open())
+        {
+            std::cerr << "Warning: can't open error page " << it->second << " for status " << it->first << std::endl;
+            continue;
+        }
+        std::ostringstream buffer;
+        buffer << file.rdbuf();
+        bodies[it->first] = buffer.str();
+    }
+    ScopedLock lock(error_pages_mutex);
+    error_page_bodies.swap(bodies);
+    DEBUG_MSG("Error pages loaded", error_page_bodies.size());
+}
+
+// Headers that are identical for every response of this server, appended verbatim after the per-response ones
+void Server::renderStaticHeaders()
+{
+    static_headers = "Server: " SERVER_SOFTWARE "\r\n";
+    for (std::vector<std::string>::const_iterator it = add_headers.begin(); it != add_headers.end(); ++it)
+        static_headers += *it + "\r\n";
+}
+
+const std::string &Server::getStaticHeaders() const
+{
+    return static_headers;
+}
+
+// a copy, a SIGHUP reload may replace the set while a worker builds its response
+bool Server::getErrorPageBody(int code, std::string &body) const
+{
+    ScopedLock lock(error_pages_mutex);
+    std::map<int, std::string>::const_iterator it = error_page_bodies.find(code);
+    if (it == error_page_bodies.end())
+        return false;
+    body = it->second;
+    return true;
+}
+
 void Server::setErrorPages(const std::map<int, std::string> &error_pages)
 {
     this->error_pages = error_pages;
@@ -169,4 +239,8 @@ void Server::clear()
     index.clear();
     routes.clear();
     error_pages.clear();
+    ScopedLock lock(error_pages_mutex);
+    error_page_bodies.clear();
+    add_headers.clear();
+    static_headers.clear();
 }
@@ -18,24 +18,38 @@ std::vector<pollfd> WebService::pfds_vec;
 std::vector<Server> WebService::servers;
 std::map<int, Server *> WebService::fd_to_server;
 std::map<int, HttpResponse *> WebService::cgi_fd_to_http_response; // fds to respective server objects pointer
+std::map<int, ResponseWriter *> WebService::pending_writes;
+volatile sig_atomic_t WebService::reload_requested = 0;
 
 WebService::WebService(const std::string &config_file)
 {
     signal(SIGINT, sigintHandler);
+    signal(SIGHUP, sighupHandler);
     Parser parser;
     servers = parser.parseConfig(config_file);
     DEBUG_MSG("Configured servers", servers.size());
 
     for (std::vector<Server>::iterator it = servers.begin(); it != servers.end(); ++it)
     {
+        (*it).loadErrorPages();
+        (*it).renderStaticHeaders();
         (*it).debugServer();
         (*it).debugPrintRoutes();
     }
     setupSockets();
+    // before the file I/O threads: without pidfds it blocks SIGCHLD, and they must inherit that
+    ChildReaper::start();
+    // after the listeners: start() relies on them being the first entries of pfds_vec
+    if (FileIOPool::start(FILEIO_WORKERS))
+        addToPfdsVector(FileIOPool::notifyFd(), true);
+    CGIPool::start(servers);
 }
 
 void WebService::cleanup()
 {
+    for (std::map<int, ResponseWriter *>::iterator it = pending_writes.begin(); it != pending_writes.end(); ++it)
+        delete it->second;
+    pending_writes.clear();
     for (size_t i = 0; i < pfds_vec.size(); i++)
     {
         close(pfds_vec[i].fd);
@@ -57,6 +71,9 @@ void WebService::cleanup()
 
 WebService::~WebService()
 {
+    FileIOPool::stop();
+    CGIPool::stop();
+    ChildReaper::stop();
     WebService::cleanup();
     DEBUG_MSG("Service status", "stopped");
 }
@@ -205,6 +222,7 @@ void WebService::closeConnection(const int &fd, size_t &i, Server &server)
 {
     (void)i;
     const int fd_to_delete = fd;
+    dropPendingWrite(fd_to_delete);
     if (close(fd) == -1)
     {
         DEBUG_MSG_2("Closing connection FD failed", fd);
@@ -245,6 +263,8 @@ void WebService::newConnection(Server &server)
     }
     else
     {
+        // responses are written as far as the socket takes them, the rest on the next POLLOUT
+        fcntl(new_fd, F_SETFL, O_NONBLOCK);
         DEBUG_MSG("New connection accepted for server ", server.getName());
         DEBUG_MSG("On fd", new_fd);
         addToPfdsVector(new_fd, false);
@@ -289,16 +309,28 @@ int WebService::start()
     (void)i;
     while (true)
     {
+        if (reload_requested)
+        {
+            reload_requested = 0;
+            for (std::vector<Server>::iterator it = servers.begin(); it != servers.end(); ++it)
+                (*it).loadErrorPages();
+        }
         if (!CGI::running_processes.empty())
         {
             CGI::checkAllCGIProcesses();
         }
+        CGI::checkQueue();
+        FastCGI::checkTimeouts();
+        CGIPool::maintain();
+        ChildReaper::maintain();
         int poll_count = poll(pfds_vec.data(), pfds_vec.size(), POLL_TIMEOUT);
         if (poll_count == -1)
         {
             DEBUG_MSG_1("Poll error", strerror(errno));
             continue;
         }
+        ResponseHandler::refreshDateHeader();
+        bool file_io_done = false;
 
         // Check CGI processes for timeouts
         // Iterate backwards to handle removals safely
@@ -308,24 +340,57 @@ int WebService::start()
             {
                 continue;
             }
-            if (pfds_vec[i].revents == 0)
+            // taken out of the entry: handlers erase entries below i, which moves entries already
+            // handled in this pass down to where the loop visits them a second time
+            short revents = pfds_vec[i].revents;
+            pfds_vec[i].revents = 0;
+            if (revents == 0)
+            {
+                continue;
+            }
+            // a copy as well: handlers add entries, and a reallocation leaves references to pfds_vec[i].fd dangling
+            int fd = pfds_vec[i].fd;
+            if (fd == FileIOPool::notifyFd())
             {
+                // collected after this pass, finishing them adds and removes pfds entries
+                file_io_done = true;
                 continue;
             }
-            if (cgi_fd_to_http_response.find(pfds_vec[i].fd) != cgi_fd_to_http_response.end() &&
-                (pfds_vec[i].revents & (POLLIN | POLLOUT | POLLHUP | POLLERR | POLLNVAL)))
+            if (pending_writes.find(fd) != pending_writes.end())
             {
-                CGI::checkCGIProcess(pfds_vec[i].fd);
-                i--;
+                if (revents & (POLLOUT | POLLERR | POLLHUP | POLLNVAL))
+                    continuePendingWrite(fd, i);
+                continue;
+            }
+            if (ChildReaper::ownsFd(fd))
+            {
+                ChildReaper::handleEvent(fd);
+                continue;
+            }
+            if (CGIPool::ownsFd(fd))
+            {
+                CGIPool::handleEvent(fd);
+                continue;
+            }
+            if (FastCGI::ownsFd(fd))
+            {
+                FastCGI::handleEvent(fd, revents);
+                continue;
+            }
+            if (cgi_fd_to_http_response.find(fd) != cgi_fd_to_http_response.end() &&
+                (revents & (POLLIN | POLLOUT | POLLHUP | POLLERR | POLLNVAL)))
+            {
+                CGI::checkCGIProcess(fd, revents);
+                continue;
             }
 
-            if (fd_to_server.find(pfds_vec[i].fd) == fd_to_server.end())
+            if (fd_to_server.find(fd) == fd_to_server.end())
             {
                 continue;
             }
             // Get server object from a particular connection fd
-            Server *server_obj = fd_to_server[pfds_vec[i].fd];
-            if (pfds_vec[i].revents & POLLIN)
+            Server *server_obj = fd_to_server[fd];
+            if (revents & POLLIN)
             {
                 if (i < servers.size())
                 {
@@ -333,22 +398,24 @@ int WebService::start()
                 }
                 else
                 {
-                    DEBUG_MSG_2("Receive request  ", pfds_vec[i].fd);
-                    receiveRequest(pfds_vec[i].fd, i, *server_obj);
+                    DEBUG_MSG_2("Receive request  ", fd);
+                    receiveRequest(fd, i, *server_obj);
                 }
             }
-            else if (pfds_vec[i].revents & POLLOUT)
+            else if (revents & POLLOUT)
             {
-                DEBUG_MSG_2("------->Send response  ", pfds_vec[i].fd);
+                DEBUG_MSG_2("------->Send response  ", fd);
 
-                sendResponse(pfds_vec[i].fd, i, *server_obj);
+                sendResponse(fd, i, *server_obj);
             }
-            else if (pfds_vec[i].revents & (POLLERR | POLLHUP | POLLNVAL))
+            else if (revents & (POLLERR | POLLHUP | POLLNVAL))
             {
-                DEBUG_MSG_2("-------->Close connection  ", pfds_vec[i].fd);
-                closeConnection(pfds_vec[i].fd, i, *server_obj);
+                DEBUG_MSG_2("-------->Close connection  ", fd);
+                closeConnection(fd, i, *server_obj);
             }
         }
+        if (file_io_done)
+            handleFileIOCompletions();
     }
 }
 
@@ -424,6 +491,10 @@ void WebService::receiveRequest(int &fd, size_t &i, Server &server)
                     closeConnection(fd, i, server);
                 }
             }
+            else if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            {
+                DEBUG_MSG_2("Receive would block", fd);
+            }
             else
             {
                 DEBUG_MSG_2("Receive failed, error", strerror(errno));
@@ -490,82 +561,149 @@ void WebService::receiveRequest(int &fd, size_t &i, Server &server)
 
 void WebService::sendResponse(int &fd, size_t &i, Server &server)
 {
-    HttpRequest request_obj = server.getRequestObject(fd);
+    const HttpRequest &request_obj = server.getRequestObject(fd);
     DEBUG_MSG_2("------->WebService::sendResponse server.getRequestObject(fd) passed ", fd);
 
     if (request_obj.complete)
     {
-        HttpRequest request = server.getRequestObject(fd);
-        DEBUG_MSG_2("------->WebService::sendResponse server.getRequestObject(fd); passed ", fd);
-
+        HttpRequest request = request_obj;
         HttpResponse *response = new (HttpResponse);
-        ResponseHandler handler;
+        response->server = &server;
 
-        handler.processRequest(fd, server, request, *response);
-        // Add null check before accessing route -> to catch faulty cgi requests (e.g. not .py)
-        if (request.route == NULL)
+        // disk work goes to the file I/O pool; the fd leaves the poll set until the job comes back
+        if (!ResponseHandler::runsOnEventLoop(server, request) && FileIOPool::submit(fd, &server, request, response))
         {
-            // Handle invalid CGI or other requests without routes
-            pfds_vec[i].events = POLLOUT;
-            std::string responseStr = response->generateRawResponseStr();
-            DEBUG_MSG_2("------->WebService::sendResponse sending responseStr ", responseStr.c_str());
-
-            int nbytes = send(fd, responseStr.c_str(), responseStr.size(), 0);
-            if (nbytes == -1)
-            {
-                DEBUG_MSG_2("Send error ", strerror(errno));
-            }
-            else if (nbytes == 0)
-            {
-                DEBUG_MSG_2("Connection closed by client", "");
-            }
-
-            closeConnection(fd, i, server);
-            delete response;
+            DEBUG_MSG_2("------->WebService::sendResponse handed to file I/O pool ", fd);
+            deleteFromPfdsVecForCGI(fd);
             return;
         }
 
-        // If request is a CGI, skip this part
-        const Route *route = request.route; // Route is already stored in request
-        if (!route->is_cgi)
-        {
-            if (response->status_code != 0 && response->status_code != 301)
-            {
-                // Modify the pollfd to monitor POLLOUT for this FD
-                DEBUG_MSG_2("------->WebService::sendResponse pfds_vec[i].events = POLLOUT; is the issue ", fd);
+        ResponseHandler handler;
+        handler.processRequest(fd, server, request, *response);
+        finishResponse(fd, i, server, request, response);
+    }
+}
 
-                pfds_vec[i].events = POLLOUT;
-                DEBUG_MSG_2("------->WebService::sendResponse pfds_vec[i].events = POLLOUT; passed ", fd);
-            }
+// Sends a processed response and closes the connection (or leaves the rest to the pending writer)
+void WebService::finishResponse(int fd, size_t &i, Server &server, const HttpRequest &request, HttpResponse *response)
+{
+    // CGI answers from CGI::sendCGIResponse once the script is done, it owns the response
+    // (requests that failed before routing, e.g. faulty cgi requests, have no route and are answered here)
+    if (request.route != NULL && request.route->is_cgi)
+        return;
 
-            std::string responseStr = response->generateRawResponseStr();
-            DEBUG_MSG_2("------->WebService::sendResponse generateRawResponseStr(); passed ", fd);
+    //  added obligatory close of connection for all cases to get rid of extra pfds
+    response->close_connection = true;
+    if (queueResponse(fd, *response))
+    {
+        DEBUG_MSG_2("WebService::sendResponse: Response sent to fd, closing connection", fd);
+        closeConnection(fd, i, server);
+    }
+    delete response;
+}
 
-            int nbytes = send(fd, responseStr.c_str(), responseStr.size(), 0);
-            if (nbytes == -1)
-            {
-                DEBUG_MSG_2("Send error ", strerror(errno));
-            }
-            else if (nbytes == 0)
-            {
-                DEBUG_MSG_2("Connection closed by client", "");
-            }
-            DEBUG_MSG_2("Response sent to fd", fd);
-            DEBUG_MSG_2("WebService::sendResponse response.close_connection", response->close_connection);
-            //  added obligatory close of connection for all cases to get rid of extra pfds
-            response->close_connection = true;
-            if (response->close_connection == true)
-            {
-                DEBUG_MSG_2("WebService::sendResponse: Response sent to fd, closing connection", fd);
-                closeConnection(fd, i, server);
-            }
-            else
-            {
-                server.resetRequestObject(fd);
-            }
-            delete response;
-        }
+// Responses built by the file I/O workers: the client fd rejoins the poll set and the response is sent
+void WebService::handleFileIOCompletions()
+{
+    std::vector<FileIOJob *> jobs;
+    FileIOPool::takeCompleted(jobs);
+    for (size_t j = 0; j < jobs.size(); ++j)
+    {
+        FileIOJob *job = jobs[j];
+        size_t i = 0;
+        addToPfdsVector(job->fd, false);
+        finishResponse(job->fd, i, *job->server, job->request, job->response);
+        FileIOPool::finish(job);
+    }
+}
+
+// Hands the response to a ResponseWriter and sends what the socket takes right now.
+// Returns true when the response is finished (sent or failed) and the caller closes the connection,
+// false when the rest is pending: the writer then owns the fd and closes it in continuePendingWrite.
+// The response itself can be deleted either way.
+bool WebService::queueResponse(int fd, HttpResponse &response)
+{
+    ResponseWriter *writer = new ResponseWriter(response);
+    if (writer->write(fd) == WRITE_AGAIN)
+    {
+        DEBUG_MSG_2("Partial write, bytes left", writer->bytesRemaining());
+        pending_writes[fd] = writer;
+        setPollfdEventsToOut(fd);
+        return false;
     }
+    delete writer;
+    return true;
+}
+
+void WebService::continuePendingWrite(int fd, size_t &i)
+{
+    std::map<int, ResponseWriter *>::iterator it = pending_writes.find(fd);
+    if (it == pending_writes.end() || it->second->write(fd) == WRITE_AGAIN)
+        return;
+    DEBUG_MSG_2("Pending response finished on fd", fd);
+
+    std::map<int, Server *>::iterator server_it = fd_to_server.find(fd);
+    if (server_it != fd_to_server.end())
+        closeConnection(fd, i, *server_it->second);
+    else
+    {
+        // CGI responses: the fd was already detached from its server
+        dropPendingWrite(fd);
+        close(fd);
+        deleteFromPfdsVecForCGI(fd);
+    }
+}
+
+void WebService::dropPendingWrite(int fd)
+{
+    std::map<int, ResponseWriter *>::iterator it = pending_writes.find(fd);
+    if (it == pending_writes.end())
+        return;
+    delete it->second;
+    pending_writes.erase(it);
+}
+
+// Local redirect from CGI output (RFC 3875 6.2.2): the connection goes back to its server with a GET
+// for `location`, answered by sendResponse() like any request on its next POLLOUT. Scripts that keep
+// redirecting get a 500 after MAX_INTERNAL_REDIRECTS
+void WebService::redirectInternally(int fd, Server &server, const HttpRequest &original, const std::string &location)
+{
+    HttpRequest request;
+    request.method = "GET";
+    request.version = original.version;
+    request.headers = original.headers;
+    request.headers.erase("Content-Length");
+    request.headers.erase("Content-Type");
+    request.headers.erase("Transfer-Encoding");
+    request.uri = location;
+    size_t query_pos = request.uri.find('?');
+    if (query_pos != std::string::npos)
+    {
+        request.queryString = request.uri.substr(query_pos + 1);
+        request.uri.erase(query_pos);
+    }
+    request.internal_redirects = original.internal_redirects + 1;
+    request.headers_parsed = true;
+    request.complete = true;
+    RequestParser::checkForDirectory(request);
+    DEBUG_MSG_2("Internal redirect to", location);
+
+    fd_to_server[fd] = &server;
+    if (findPollFd(fd) == NULL)
+        addToPfdsVector(fd, false);
+    if (request.internal_redirects > MAX_INTERNAL_REDIRECTS)
+    {
+        DEBUG_MSG_1("Too many internal redirects, last one to", location);
+        HttpResponse *response = new HttpResponse;
+        response->server = &server;
+        response->status_code = 500;
+        ResponseHandler::responseBuilder(*response);
+        size_t i = 0;
+        finishResponse(fd, i, server, request, response);
+        return;
+    }
+    server.setRequestObject(fd, request);
+    setPollfdEventsToOut(fd);
 }
 
 void WebService::sigintHandler(int signal)
@@ -579,6 +717,13 @@ void WebService::sigintHandler(int signal)
     }
 }
 
+// SIGHUP: re-read the error pages from disk at the top of the next loop iteration
+void WebService::sighupHandler(int signal)
+{
+    (void)signal;
+    reload_requested = 1;
+}
+
 void WebService::setPollfdEventsToOut(int fd)
 {
     for (size_t i = 0; i < pfds_vec.size(); ++i)
@@ -0,0 +1,256 @@
+#!/bin/bash
+# Before/after numbers for the performance work. Each section starts ./webserv (or $WEBSERV, e.g. a
+# build of an older commit) on port 8090 with a config that turns the feature off and on, drives it
+# with tests/load.py and reports requests/s, MB/s, bytes per response and the server's own CPU time
+# per request (utime + stime from /proc, so the client's cost is not in it).
+# Run from the repository root: make bench, or tests/bench.sh [section...]
+# Sections: gzip writev upload dedup fastcgi splice
+
+WEBSERV=${WEBSERV:-./webserv}
+PORT=8090
+BASE=http://127.0.0.1:$PORT
+WORK=$(mktemp -d)
+DATA=www/_bench # served by the "/" location
+SCRIPT=cgi-bin/_bench_hello.py
+TICK=$(getconf CLK_TCK)
+SERVER=
+
+cleanup()
+{
+    stop_server
+    [ -n "$FCGI" ] && kill "$FCGI" 2>/dev/null
+    rm -rf "$WORK" "$DATA" "$SCRIPT"
+}
+trap cleanup EXIT
+
+# write_config <file> <lines added to the "/" location> [more location blocks]
+write_config()
+{
+    cat > "$1" <<EOF
+[[server]]
+listen = $PORT
+host = "127.0.0.1"
+root = "www"
+index = "index.html"
+client_max_body_size = 2000000
+allow_methods = ["GET", "HEAD", "POST", "DELETE"]
+cgi_ext = [".py"]
+cgi_path = "/cgi-bin"
+
+[[server.error_page]]
+404 = "www/errors/404.html"
+
+[[server.location]]
+uri = "/"
+allow_methods = ["GET", "HEAD", "POST", "DELETE"]
+is_cgi = false
+$2
+
+$3
+EOF
+}
+
+start_server()
+{
+    "$WEBSERV" "$1" > "$WORK/server.log" 2>&1 &
+    SERVER=$!
+    for _ in $(seq 50); do
+        curl -s -o /dev/null "$BASE/" && return
+        sleep 0.1
+    done
+    echo "webserv did not start:" >&2
+    cat "$WORK/server.log" >&2
+    exit 1
+}
+
+stop_server()
+{
+    [ -n "$SERVER" ] && kill "$SERVER" 2>/dev/null && wait "$SERVER" 2>/dev/null
+    SERVER=
+}
+
+cpu_ticks()
+{
+    awk '{ print $14 + $15 }' "/proc/$SERVER/stat"
+}
+
+# measure <label> <load.py arguments...>: one result line, with the server's CPU per request
+measure()
+{
+    local label=$1
+    shift
+    local before after result requests
+    before=$(cpu_ticks)
+    result=$(python3 tests/load.py "$@")
+    after=$(cpu_ticks)
+    requests=$(echo "$result" | sed 's/.*requests=\([0-9]*\).*/\1/')
+    printf '%-34s %s server_cpu_ms_per_request=%s\n' "$label" "$result" \
+        "$(awk "BEGIN { printf \"%.3f\", ($after - $before) * 1000 / $TICK / $requests }")"
+}
+
+# text that compresses like real pages rather than like one repeated block: this tree's sources
+make_text()
+{
+    local file=$1 size=$2
+    while [ "$(stat -c %s "$file" 2>/dev/null || echo 0)" -lt "$size" ]; do
+        cat src/*/*.cpp >> "$file"
+    done
+    truncate -s "$size" "$file"
+}
+
+# user-027: CPU cost of on-the-fly gzip against the bytes it saves, per compression level
+bench_gzip()
+{
+    echo "== gzip: 256 KB text/html, 300 requests"
+    make_text "$DATA/page.html" 262144
+    for level in 1 6 9; do
+        write_config "$WORK/gzip.config" "gzip = true
+gzip_comp_level = $level"
+        start_server "$WORK/gzip.config"
+        [ "$level" = 1 ] && measure "identity (no Accept-Encoding)" "$BASE/_bench/page.html" -n 300
+        measure "gzip_comp_level = $level" "$BASE/_bench/page.html" -n 300 -H "Accept-Encoding: gzip"
+        stop_server
+    done
+}
+
+# user-034: cost of serializing and sending a response against its body size; compare a build from
+# before the scatter-gather writer with WEBSERV=<old binary>
+bench_writev()
+{
+    echo "== writev: static files by size, $WEBSERV"
+    write_config "$WORK/writev.config" ""
+    for size in 1024 65536 1048576 8388608; do
+        head -c "$size" /dev/urandom > "$DATA/$size.bin"
+    done
+    start_server "$WORK/writev.config"
+    measure "1 KB" "$BASE/_bench/1024.bin" -n 2000
+    measure "64 KB" "$BASE/_bench/65536.bin" -n 1000
+    measure "1 MB" "$BASE/_bench/1048576.bin" -n 300
+    measure "8 MB" "$BASE/_bench/8388608.bin" -n 60
+    # a client reading at 16 MB/s, more than the socket buffers hold, must not hold up everyone else
+    head -c 67108864 /dev/urandom > "$DATA/67108864.bin"
+    curl -s -o /dev/null --limit-rate 16M "$BASE/_bench/67108864.bin" &
+    local slow=$!
+    sleep 0.5
+    measure "1 KB beside a slow 64 MB download" "$BASE/_bench/1024.bin" -n 500
+    wait $slow
+    stop_server
+}
+
+# upload_location <lines>: POSTs to /_bench/ store bodies under www/_bench
+upload_location()
+{
+    cat <<EOF
+[[server.location]]
+uri = "/_bench/"
+path = "/_bench/"
+root = "www"
+allow_methods = ["GET", "POST", "DELETE"]
+is_cgi = false
+$1
+EOF
+}
+
+# user-037: upload throughput for each durability mode, small and large bodies
+bench_upload()
+{
+    echo "== upload: POST bodies to a directory, 300 requests each"
+    head -c 4096 /dev/urandom > "$WORK/4k.bin"
+    head -c 262144 /dev/urandom > "$WORK/256k.bin"
+    for policy in none data full; do
+        write_config "$WORK/upload.config" "" "$(upload_location "fsync_policy = \"$policy\"")"
+        start_server "$WORK/upload.config"
+        measure "4 KB, fsync_policy = $policy" "$BASE/_bench/" -n 300 -m POST -d "$WORK/4k.bin"
+        measure "256 KB, fsync_policy = $policy" "$BASE/_bench/" -n 300 -m POST -d "$WORK/256k.bin"
+        stop_server
+        rm -rf "${DATA:?}"/*
+    done
+}
+
+# user-038: hashing cost on unique uploads, and what identical ones save in time and disk
+bench_dedup()
+{
+    echo "== dedup: 256 KB POST bodies, 300 requests, fsync_policy none"
+    head -c 262144 /dev/urandom > "$WORK/256k.bin"
+    for dedup in false true; do
+        write_config "$WORK/dedup.config" "" "$(upload_location "dedup = $dedup")"
+        start_server "$WORK/dedup.config"
+        measure "unique bodies, dedup = $dedup" "$BASE/_bench/" -n 300 -m POST -d "$WORK/256k.bin" -u
+        echo "  disk used: $(du -sk "$DATA" | cut -f1) KB"
+        rm -rf "${DATA:?}"/* "$DATA"/.cas
+        measure "identical bodies, dedup = $dedup" "$BASE/_bench/" -n 300 -m POST -d "$WORK/256k.bin"
+        echo "  disk used: $(du -sk "$DATA" | cut -f1) KB"
+        stop_server
+        rm -rf "${DATA:?}"/* "$DATA"/.cas
+    done
+}
+
+# cgi_location <lines>: the /cgi-bin/ location running this tree's cgi-bin scripts
+cgi_location()
+{
+    cat <<EOF
+[[server.location]]
+uri = "/cgi-bin/"
+path = "/cgi-bin/"
+root = "/cgi-bin"
+allow_methods = ["GET", "POST"]
+is_cgi = true
+$1
+EOF
+}
+
+# fastcgi_location <address>: /fcgi-bin/ runs the same scripts through the FastCGI backend
+fastcgi_location()
+{
+    cat <<EOF
+[[server.location]]
+uri = "/fcgi-bin/"
+allow_methods = ["GET"]
+is_cgi = true
+fastcgi_pass = ["$1"]
+fastcgi_root = "cgi-bin"
+EOF
+}
+
+# user-041: a small script through fork+exec per request, the warm CGI pool and the FastCGI stand-in
+bench_fastcgi()
+{
+    echo "== fastcgi: a 100 byte script response, 500 requests, 4 clients"
+    printf '#!/usr/bin/env python3\nprint("Content-Type: text/plain")\nprint()\nprint("x" * 99)\n' > "$SCRIPT"
+    python3 fastcgi_app.py "$WORK/fcgi.sock" > "$WORK/fcgi.log" 2>&1 &
+    FCGI=$!
+    write_config "$WORK/fastcgi.config" "" "$(cgi_location "cgi_max_procs = 16")
+$(fastcgi_location "unix:$WORK/fcgi.sock")"
+    start_server "$WORK/fastcgi.config"
+    measure "fork+exec per request" "$BASE/cgi-bin/_bench_hello.py" -n 500 -c 4
+    measure "FastCGI" "$BASE/fcgi-bin/_bench_hello.py" -n 500 -c 4
+    stop_server
+    write_config "$WORK/pool.config" "" "$(cgi_location "cgi_pool_min = 4
+cgi_pool_max = 8")"
+    start_server "$WORK/pool.config"
+    sleep 1 # let the pool come up
+    measure "warm CGI pool" "$BASE/cgi-bin/_bench_hello.py" -n 500 -c 4
+    stop_server
+    kill "$FCGI"
+    FCGI=
+}
+
+# user-047: relaying a script's large output through user space against splice()
+bench_splice()
+{
+    echo "== splice: a script writing 256 MB, 5 requests"
+    printf '#!/usr/bin/env python3\nimport sys\nout = sys.stdout.buffer\nout.write(b"Content-Type: application/octet-stream\\r\\n\\r\\n")\nblock = b"x" * 1048576\nfor _ in range(256):\n    out.write(block)\n' > "$SCRIPT"
+    for splice in false true; do
+        write_config "$WORK/splice.config" "" "$(cgi_location "cgi_splice = $splice
+cgi_pipe_size = 1048576")"
+        start_server "$WORK/splice.config"
+        measure "cgi_splice = $splice" "$BASE/cgi-bin/_bench_hello.py" -n 5
+        stop_server
+    done
+}
+
+mkdir -p "$DATA"
+SECTIONS=${*:-gzip writev upload dedup fastcgi splice}
+for section in $SECTIONS; do
+    "bench_$section"
+done
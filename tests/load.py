@@ -0,0 +1,102 @@
+#!/usr/bin/env python3
+# Minimal HTTP load generator for tests/bench.sh: N requests over C threads, one connection per
+# request (the server closes CGI connections anyway). Prints one line of results:
+#   requests=<n> errors=<n> seconds=<s> rps=<requests/s> mbps=<MB/s> bytes_per_request=<n>
+#   python3 tests/load.py URL [-n requests] [-c concurrency] [-m method] [-d body file] [-u] [-H "Name: value"]
+import argparse
+import socket
+import threading
+import time
+from urllib.parse import urlsplit
+
+
+def request(host, port, raw):
+    """Sends one request and reads the response until the server closes or the body is complete"""
+    sock = socket.create_connection((host, port))
+    try:
+        sock.sendall(raw)
+        head = b""
+        while b"\r\n\r\n" not in head:
+            data = sock.recv(65536)
+            if not data:
+                return 0, 0
+            head += data
+        head, _, body = head.partition(b"\r\n\r\n")
+        lines = head.split(b"\r\n")
+        try:
+            status = int(lines[0].split()[1])
+        except (IndexError, ValueError):
+            return 0, 0
+        length = None
+        for line in lines[1:]:
+            name, _, value = line.partition(b":")
+            if name.strip().lower() == b"content-length":
+                length = int(value)
+        received = len(body)
+        while length is None or received < length:
+            data = sock.recv(1 << 20)
+            if not data:
+                break
+            received += len(data)
+        return status, received
+    finally:
+        sock.close()
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("url")
+    parser.add_argument("-n", type=int, default=200)
+    parser.add_argument("-c", type=int, default=1)
+    parser.add_argument("-m", default="GET")
+    parser.add_argument("-d", help="file sent as the request body")
+    parser.add_argument("-u", action="store_true", help="make each body unique: its last 8 bytes are the request number")
+    parser.add_argument("-H", action="append", default=[])
+    args = parser.parse_args()
+
+    url = urlsplit(args.url)
+    path = url.path + ("?" + url.query if url.query else "")
+    body = open(args.d, "rb").read() if args.d else b""
+    head = "%s %s HTTP/1.1\r\nHost: %s\r\nConnection: close\r\n" % (args.m, path or "/", url.netloc)
+    for header in args.H:
+        head += header + "\r\n"
+    if body:
+        head += "Content-Length: %d\r\n" % len(body)
+    raw = head.encode() + b"\r\n" + body
+    if args.u and len(body) < 8:
+        parser.error("-u needs a body of at least 8 bytes")
+
+    lock = threading.Lock()
+    counts = {"left": args.n, "errors": 0, "bytes": 0}
+
+    def worker():
+        while True:
+            with lock:
+                if counts["left"] == 0:
+                    return
+                counts["left"] -= 1
+                number = counts["left"]
+            data = raw[:-8] + number.to_bytes(8, "big") if args.u else raw
+            try:
+                status, received = request(url.hostname, url.port or 80, data)
+            except OSError:
+                status, received = 0, 0
+            with lock:
+                counts["bytes"] += received
+                if status == 0 or status >= 400:
+                    counts["errors"] += 1
+
+    start = time.monotonic()
+    threads = [threading.Thread(target=worker) for _ in range(args.c)]
+    for thread in threads:
+        thread.start()
+    for thread in threads:
+        thread.join()
+    seconds = time.monotonic() - start
+    print("requests=%d errors=%d seconds=%.3f rps=%.1f mbps=%.1f bytes_per_request=%d" % (
+        args.n, counts["errors"], seconds, args.n / seconds, counts["bytes"] / seconds / 1e6,
+        counts["bytes"] // max(args.n, 1)))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,108 @@
+#!/bin/bash
+# Regression checks against a running server: starts ./webserv with the given config (default
+# tomldb.config), sends requests with curl and compares status codes and headers.
+# Run from the repository root: make check, or tests/regress.sh [config]
+
+CONFIG=${1:-tomldb.config}
+BASE=${BASE:-http://127.0.0.1:8080}
+FAILED=0
+
+pass() { echo "PASS  $1"; }
+fail() { echo "FAIL  $1: $2"; FAILED=1; }
+
+# expect_status <name> <status> <curl args...>
+expect_status()
+{
+    local name=$1 want=$2
+    shift 2
+    local got
+    got=$(curl -s -o /dev/null -w '%{http_code}' "$@")
+    [ "$got" = "$want" ] && pass "$name" || fail "$name" "status $got, expected $want"
+}
+
+# expect_header <name> <header regex> <curl args...>: the response head must contain a matching line
+expect_header()
+{
+    local name=$1 pattern=$2
+    shift 2
+    curl -s -o /dev/null -D - "$@" | tr -d '\r' | grep -qiE "$pattern" && pass "$name" || fail "$name" "no header matching '$pattern'"
+}
+
+# expect_no_header <name> <header regex> <curl args...>
+expect_no_header()
+{
+    local name=$1 pattern=$2
+    shift 2
+    curl -s -o /dev/null -D - "$@" | tr -d '\r' | grep -qiE "$pattern" && fail "$name" "unexpected header matching '$pattern'" || pass "$name"
+}
+
+alive()
+{
+    kill -0 "$SERVER" 2>/dev/null && pass "server still running" || fail "server still running" "webserv exited"
+}
+
+# /fcgi-bin/ in tomldb.config runs the scripts through fastcgi_app.py
+SCRIPT=cgi-bin/_regress_redirect.py
+python3 fastcgi_app.py /tmp/webserv-fcgi.sock > /tmp/webserv-regress-fcgi.log 2>&1 &
+FCGI=$!
+./webserv "$CONFIG" > /tmp/webserv-regress.log 2>&1 &
+SERVER=$!
+trap 'kill $SERVER $FCGI 2>/dev/null; rm -f $SCRIPT' EXIT
+sleep 1
+
+# a location's bare URI that is not served as a directory has no file name to shard
+expect_status "bare location URI" 301 "$BASE/redirect-test/"
+alive
+
+# files stored flat before shard_depth was set on /uploads/ stay reachable
+expect_status "flat upload on a sharded location" 200 "$BASE/uploads/flames.jpeg"
+
+# a streamed CGI response is framed once, and nothing of the request body ends up in its head
+UPLOAD=$(mktemp)
+echo "regression upload" > "$UPLOAD"
+HEAD=$(curl -s -o /dev/null -D - -F "file=@$UPLOAD" "$BASE/cgi-bin/post.py" | tr -d '\r')
+rm -f "$UPLOAD"
+if echo "$HEAD" | grep -qi '^Content-Length:' && echo "$HEAD" | grep -qi '^Transfer-Encoding:'; then
+    fail "CGI multipart POST framing" "both Content-Length and Transfer-Encoding"
+else
+    pass "CGI multipart POST framing"
+fi
+echo "$HEAD" | grep -qi '^Content-Disposition:' && fail "CGI head without request headers" "Content-Disposition leaked" \
+    || pass "CGI head without request headers"
+
+# an open-ended range starting at the end of the file is unsatisfiable, not malformed
+SIZE=$(stat -c %s www/index.html)
+expect_status "Range bytes=<size>-" 416 -H "Range: bytes=$SIZE-" "$BASE/index.html"
+expect_status "Range bytes=<size-1>-" 206 -H "Range: bytes=$((SIZE - 1))-" "$BASE/index.html"
+expect_status "Range last before first" 200 -H "Range: bytes=5-2" "$BASE/index.html"
+
+# an exact coding overrides "*", and q=0 on it refuses it
+expect_header "Accept-Encoding gzip" '^Content-Encoding: gzip' -H "Accept-Encoding: gzip" "$BASE/index.html"
+expect_header "Accept-Encoding *" '^Content-Encoding: gzip' -H "Accept-Encoding: *" "$BASE/index.html"
+expect_no_header "Accept-Encoding *, gzip;q=0" '^Content-Encoding:' -H "Accept-Encoding: *, gzip;q=0" "$BASE/index.html"
+expect_no_header "Accept-Encoding gzip;q=0, *" '^Content-Encoding:' -H "Accept-Encoding: gzip;q=0, *" "$BASE/index.html"
+
+# HEAD carries the representation headers of the GET on gzip locations
+expect_header "GET Vary on a gzip location" '^Vary: Accept-Encoding' "$BASE/index.html"
+expect_header "HEAD Vary on a gzip location" '^Vary: Accept-Encoding' -I "$BASE/index.html"
+expect_header "HEAD Content-Encoding with gzip accepted" '^Content-Encoding: gzip' -I -H "Accept-Encoding: gzip" "$BASE/index.html"
+expect_header "HEAD weak ETag with gzip accepted" '^ETag: W/' -I -H "Accept-Encoding: gzip" "$BASE/index.html"
+expect_no_header "HEAD no identity length with gzip accepted" '^Content-Length:' -I -H "Accept-Encoding: gzip" "$BASE/index.html"
+
+# a negative expires rule ("text/html -1" on /images/) sends a date in the past
+HEAD=$(curl -s -o /dev/null -D - "$BASE/images/" | tr -d '\r')
+EXPIRES=$(echo "$HEAD" | sed -n 's/^Expires: //Ip')
+DATE=$(echo "$HEAD" | sed -n 's/^Date: //Ip')
+if [ -n "$EXPIRES" ] && [ "$(date -d "$EXPIRES" +%s)" -lt "$(date -d "$DATE" +%s)" ]; then
+    pass "negative expires is in the past"
+else
+    fail "negative expires is in the past" "Expires '$EXPIRES', Date '$DATE'"
+fi
+
+# a FastCGI redirect keeps the body its Content-Length announces
+printf 'print("Status: 302 Found")\nprint("Location: http://example.com/")\nprint()\nprint("moved here.")\n' > "$SCRIPT"
+RESULT=$(curl -s -o /dev/null -w '%{http_code} %{size_download}' "$BASE/fcgi-bin/_regress_redirect.py")
+[ "$RESULT" = "302 12" ] && pass "FastCGI 302 with a body" || fail "FastCGI 302 with a body" "got '$RESULT', expected '302 12'"
+
+alive
+exit $FAILED